@@ -30,14 +30,15 @@
 #include "mdnssvc.h"
 #include "config_cast.h"
 #include "ixml.h"
+#include "registry.h"
 
 #define DISCOVERY_TIME 	20
 #define MEDIA_VOLUME	0.5
+#define CONFIG_WATCH	5
 
 /*----------------------------------------------------------------------------*/
 /* globals */
 /*----------------------------------------------------------------------------*/
-struct sMR	*glMRDevices;
 uint16_t	glPortBase, glPortRange, glPicoPort;
 int32_t		glLogLimit = -1;
 int			glMaxDevices = 32;
@@ -86,12 +87,19 @@ static char*				glPidFile = NULL;
 static bool					glAutoSaveConfigFile = false;
 static bool					glGracefullShutdown = true;
 static void*				glConfigID = NULL;
+static tMRConfig			glMRDefaults;
+static int					glArgc;
+static char**				glArgv;
 static char					glConfigName[STR_LEN] = "./config.xml";
+static char					glSnapshotName[STR_LEN] = "";
 static struct mdnsd*		glmDNSServer = NULL;
 static pthread_mutex_t		glMainMutex;
 static uint32_t				glNetmask;
 static char*				glNameFormat = "%s+";
 
+// RAOP and cast threads always hold a valid device
+static registry_t			glRegistry;
+
 static char usage[] =
 			VERSION "\n"
 		   "See -t for license terms\n"
@@ -103,6 +111,7 @@ static char usage[] =
 		   "  -x <config file>      read config from file (default is ./config.xml)\n"
 		   "  -i <config file>      discover players, save <config file> and exit\n"
 		   "  -I                    auto save config at every network scan\n"
+		   "  -w <file|->           players snapshot for warm start (default is <config file>.cache, - to disable)\n"
 		   "  -N <format>           transform device name using C format (%s=name)\n"
 		   "  -l <[rtp][:http][:f]> RTP and HTTP latency (ms), ':f' forces silence fill\n"
 		   "  -r                    let timing reference drift (no click)\n"
@@ -159,10 +168,18 @@ static char license[] =
 /* prototypes */
 /*----------------------------------------------------------------------------*/
 static void *MRThread(void *args);
-static bool  AddCastDevice(struct sMR *Device, char *Name, char *UDN, bool Group, struct in_addr ip, uint16_t port);
+static bool  AddCastDevice(struct sMR *Device, char *Name, char *UDN, bool Group, struct in_addr ip, uint16_t port, uint8_t *mac);
+static void	 RestoreSnapshot(void);
 static void  RemoveCastDevice(struct sMR *Device);
+static void	 RegistryInit(void);
+static void	 RegistryEnd(void);
+static struct sMR *RegistryAcquire(void);
+static void	 RegistryPublish(struct sMR *Device);
+static void	 RegistryRelease(struct sMR *Device);
 static bool	 Start(bool cold);
 static bool	 Stop(bool exit);
+static void	 Rebind(void);
+static void	 PlayerArgs(tMRConfig *Config);
 
 /*----------------------------------------------------------------------------*/
 static void raop_cb(void *owner, raopsr_event_t event, ...) {
@@ -380,41 +397,56 @@ static char *GetmDNSAttribute(mdnssd_txt_attr_t *p, int count, char *name) {
 
 /*----------------------------------------------------------------------------*/
 static struct sMR *SearchUDN(char *UDN) {
-	for (int i = 0; i < glMaxDevices; i++) {
-		if (glMRDevices[i].Running && !strcmp(glMRDevices[i].UDN, UDN))
-			return glMRDevices + i;
+	struct sMR **Devices, *Device = NULL;
+	int Count = RegistryList(&Devices, false);
+
+	for (int i = 0; i < Count && !Device; i++) {
+		if (Devices[i]->Running && !strcmp(Devices[i]->UDN, UDN)) Device = Devices[i];
 	}
 
-	return NULL;
+	free(Devices);
+	return Device;
 }
 
 /*----------------------------------------------------------------------------*/
 static void UpdateDevices() {
+	struct sMR **Devices;
+	int Count;
+
 	pthread_mutex_lock(&glMainMutex);
+	Count = RegistryList(&Devices, false);
 
-	for (int i = 0; i < glMaxDevices; i++) {
-		struct sMR *Device = glMRDevices + i;
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
 		if (Device->Running && Device->Remove && !CastIsConnected(Device->CastCtx)) {
-			struct in_addr addr = CastGetAddr(glMRDevices[i].CastCtx);
+			struct in_addr addr = CastGetAddr(Device->CastCtx);
 			if (!ping_host(addr, 100)) {
 				LOG_INFO("[%p]: removing renderer (%s)", Device, Device->Config.Name);
 				raopsr_delete(Device->Raop);
 				RemoveCastDevice(Device);
+				if (*glSnapshotName) SaveSnapshotLater(glSnapshotName);
 			} else {
 				LOG_DEBUG("[%p]: (%s) mute to mDNS search, but answers ping, so keep it", Device, Device->Config.Name);
 			}
 		}
 	}
 
+	free(Devices);
 	pthread_mutex_unlock(&glMainMutex);
 }
 
 /*----------------------------------------------------------------------------*/
 static bool isMember(struct in_addr host) {
-	for (int i = 0; i < MAX_RENDERERS; i++) {
-		if (glMRDevices[i].Running && CastGetAddr(glMRDevices[i].CastCtx).s_addr == host.s_addr) return true;
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false);
+	bool Member = false;
+
+	for (int i = 0; i < Count && !Member; i++) {
+		if (Devices[i]->Running && CastGetAddr(Devices[i]->CastCtx).s_addr == host.s_addr) Member = true;
 	}
-	return false;
+
+	free(Devices);
+	return Member;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -517,12 +549,9 @@ static bool mDNSsearchCallback(mdnssd_service_t *slist, void *cookie, bool *stop
 			continue;
 		}
 
-		// new device so search a free spot - as this function is not called
+		// new device so get a free slot - as this function is not called
 		// recursively, no need to lock the device's mutex
-		for (Device = glMRDevices; Device < glMRDevices + glMaxDevices && Device->Running; Device++);
-
-		// no more room !
-		if (Device == glMRDevices + glMaxDevices) {
+		if ((Device = RegistryAcquire()) == NULL) {
 			LOG_ERROR("Too many devices (max:%u)", glMaxDevices);
 			NFREE(UDN);
 			break;
@@ -537,7 +566,9 @@ static bool mDNSsearchCallback(mdnssd_service_t *slist, void *cookie, bool *stop
 		Name = GetmDNSAttribute(s->attr, s->attr_count, "fn");
 		if (!Name) Name = strdup(s->hostname);
 		
-		if (AddCastDevice(Device, Name, UDN, Group, s->addr, s->port) && !glDiscovery) {
+		if (!AddCastDevice(Device, Name, UDN, Group, s->addr, s->port, NULL)) {
+			RegistryRelease(Device);
+		} else if (!glDiscovery) {
 			Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
 										"aircast", Device->Config.mac, Device->Config.Codec,
 										Device->Config.Metadata, Device->Config.Drift,
@@ -558,10 +589,11 @@ static bool mDNSsearchCallback(mdnssd_service_t *slist, void *cookie, bool *stop
 	UpdateDevices();
 
 	if ((Updated && glAutoSaveConfigFile) || glDiscovery) {
-		LOG_INFO("Updating configuration %s", glConfigName);
-		SaveConfig(glConfigName, glConfigID, false);
+		SaveConfigLater(glConfigName, &glConfigID);
 	}
 
+	if (Updated && *glSnapshotName) SaveSnapshotLater(glSnapshotName);
+
 	// we have not released the slist
 	return false;
 }
@@ -574,12 +606,172 @@ static void *mDNSsearchThread(void *args) {
 	return NULL;
 }
 
+/*----------------------------------------------------------------------------*/
+static void ReloadConfig(void) {
+	tMRConfig Common;
+	struct sMR **Devices;
+
+	// start again from defaults (common section is optional)
+	memcpy(&Common, &glMRDefaults, sizeof(tMRConfig));
+
+	pthread_mutex_lock(&glMainMutex);
+
+	void *Doc = LoadConfig(glConfigName, &Common);
+	if (!Doc) {
+		pthread_mutex_unlock(&glMainMutex);
+		LOG_WARN("cannot reload configuration %s, keeping current one", glConfigName);
+		return;
+	}
+
+	// command line still overrides config file
+	PlayerArgs(&Common);
+	FreeConfig(glConfigID);
+	glConfigID = Doc;
+	memcpy(&glMRConfig, &Common, sizeof(tMRConfig));
+
+	LOG_INFO("configuration %s changed, updating players", glConfigName);
+
+	// main mutex prevents players from being removed in our back
+	int Count = RegistryList(&Devices, false);
+
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
+		tMRConfig Config;
+
+		if (!Device->Running) continue;
+
+		// devices that do not have a <device> section might still see <common> changes
+		memcpy(&Config, &glMRConfig, sizeof(tMRConfig));
+		LoadMRConfig(glConfigID, Device->UDN, &Config);
+
+		if (!Config.Enabled) {
+			LOG_INFO("[%p]: removing disabled renderer (%s)", Device, Device->Config.Name);
+			raopsr_delete(Device->Raop);
+			RemoveCastDevice(Device);
+			continue;
+		}
+
+		// name and mac are computed at discovery unless forced by config
+		if (!*Config.Name) strcpy(Config.Name, Device->Config.Name);
+		if (!memcmp(Config.mac, "\0\0\0\0\0\0", 6)) memcpy(Config.mac, Device->Config.mac, 6);
+
+		// these are given to the AirPlay instance at creation
+		bool Rebuild = strcmp(Config.Name, Device->Config.Name) || memcmp(Config.mac, Device->Config.mac, 6) ||
+					   strcmp(Config.Codec, Device->Config.Codec) || strcmp(Config.Latency, Device->Config.Latency) ||
+					   Config.Metadata != Device->Config.Metadata || Config.Drift != Device->Config.Drift ||
+					   Config.Flush != Device->Config.Flush;
+
+		if (Config.StopReceiver != Device->Config.StopReceiver || Config.MediaVolume != Device->Config.MediaVolume) {
+			LOG_INFO("[%p]: receiver settings will apply when %s is re-discovered", Device, Device->Config.Name);
+		}
+
+		if (Rebuild && !glDiscovery) raopsr_delete(Device->Raop);
+
+		pthread_mutex_lock(&Device->Mutex);
+		if (Rebuild && Device->RaopState == RAOP_PLAY) {
+			CastStop(Device->CastCtx);
+			Device->ExpectStop = true;
+		}
+		if (Rebuild) Device->RaopState = RAOP_STOP;
+		memcpy(&Device->Config, &Config, sizeof(tMRConfig));
+		pthread_mutex_unlock(&Device->Mutex);
+
+		if (Rebuild && !glDiscovery) {
+			LOG_INFO("[%p]: re-creating AirPlay instance (%s)", Device, Device->Config.Name);
+			Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+										"aircast", Device->Config.mac, Device->Config.Codec,
+										Device->Config.Metadata, Device->Config.Drift,
+										Device->Config.Flush, Device->Config.Latency,
+										Device, raop_cb, NULL, glPortBase, glPortRange, -1);
+			if (!Device->Raop) LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+		}
+	}
+
+	free(Devices);
+	pthread_mutex_unlock(&glMainMutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void Rebind(void) {
+	struct sMR **Devices;
+	char* iface = NULL;
+
+	// this forces an ongoing search to end
+	mdnssd_close(glmDNSsearchHandle);
+	pthread_join(glmDNSsearchThread, NULL);
+
+	// main mutex prevents players from being removed in our back
+	pthread_mutex_lock(&glMainMutex);
+	int Count = RegistryList(&Devices, false);
+
+	// only AirPlay instances are bound to our address, Cast connections reconnect by themselves
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
+		if (!Device->Running || !Device->Raop) continue;
+
+		raopsr_delete(Device->Raop);
+		Device->Raop = NULL;
+
+		pthread_mutex_lock(&Device->Mutex);
+		if (Device->RaopState == RAOP_PLAY) {
+			CastStop(Device->CastCtx);
+			Device->ExpectStop = true;
+		}
+		Device->RaopState = RAOP_STOP;
+		pthread_mutex_unlock(&Device->Mutex);
+	}
+
+	mdnsd_stop(glmDNSServer);
+	http_pico_close();
+
+	glHost = get_interface(!strchr(glBinding, '?') ? glBinding : NULL, &iface, &glNetmask);
+	LOG_INFO("Re-binding to %s [%s] with mask 0x%08x", inet_ntoa(glHost), iface, ntohl(glNetmask));
+	NFREE(iface);
+
+	glPicoPort = glPortBase;
+	http_pico_init(glHost, &glPicoPort, glPicoPort ? glPortRange : 1);
+
+	char hostname[STR_LEN];
+	gethostname(hostname, sizeof(hostname));
+	strcat(hostname, ".local");
+
+	if ((glmDNSServer = mdnsd_start(glHost, false)) != NULL) mdnsd_set_hostname(glmDNSServer, hostname, glHost);
+	else LOG_ERROR("cannot start mDNS server on %s", inet_ntoa(glHost));
+
+	for (int i = 0; i < Count && glmDNSServer && !glDiscovery; i++) {
+		struct sMR *Device = Devices[i];
+		if (!Device->Running) continue;
+
+		Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+									"aircast", Device->Config.mac, Device->Config.Codec,
+									Device->Config.Metadata, Device->Config.Drift,
+									Device->Config.Flush, Device->Config.Latency,
+									Device, raop_cb, NULL, glPortBase, glPortRange, -1);
+		if (!Device->Raop) LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+	}
+
+	free(Devices);
+	pthread_mutex_unlock(&glMainMutex);
+
+	// discovery restarts on the new interface, known players are kept
+	glmDNSsearchHandle = mdnssd_init(false, glHost, true);
+	pthread_create(&glmDNSsearchThread, NULL, &mDNSsearchThread, NULL);
+}
+
 /*----------------------------------------------------------------------------*/
 static void *MainThread(void *args) {
+	uint32_t Last = gettime_ms();
+
 	while (glMainRunning) {
-		crossthreads_sleep(30*1000);
+		crossthreads_sleep(CONFIG_WATCH*1000);
 		if (!glMainRunning) break;
 
+		// config file edits are applied without restarting
+		if (ConfigChanged()) ReloadConfig();
+
+		if (gettime_ms() - Last < 30*1000) continue;
+		Last = gettime_ms();
+
 		if (glLogFile && glLogLimit != - 1) {
 			uint32_t size = ftell(stderr);
 
@@ -610,9 +802,7 @@ static void *MainThread(void *args) {
 			host = get_interface(!strchr(glBinding, '?') ? glBinding : NULL, NULL, &glNetmask);
 			if (host.s_addr != INADDR_NONE && host.s_addr != glHost.s_addr) {
 				LOG_INFO("IP change detected %s", inet_ntoa(glHost));
-				Stop(false);
-				glMainRunning = true;
-				Start(false);
+				Rebind();
 			}
 		}
 
@@ -623,10 +813,12 @@ static void *MainThread(void *args) {
 }
 
 /*----------------------------------------------------------------------------*/
-static bool AddCastDevice(struct sMR *Device, char *Name, char *UDN, bool group, struct in_addr ip, uint16_t port) {
-	// read parameters from default then config file
+static bool AddCastDevice(struct sMR *Device, char *Name, char *UDN, bool group, struct in_addr ip, uint16_t port, uint8_t *mac) {
+	// read parameters from default then config file (both can be reloaded)
+	pthread_mutex_lock(&glMainMutex);
 	memcpy(&Device->Config, &glMRConfig, sizeof(tMRConfig));
 	LoadMRConfig(glConfigID, UDN, &Device->Config);
+	pthread_mutex_unlock(&glMainMutex);
 	if (!Device->Config.Enabled) return false;
 
 	// do not zero-out the structure as the mutex must be preserved
@@ -654,7 +846,9 @@ static bool AddCastDevice(struct sMR *Device, char *Name, char *UDN, bool group,
 
 	if (!memcmp(Device->Config.mac, "\0\0\0\0\0\0", 6)) {
 		uint32_t mac_size = 6;
-		if (group || SendARP(ip.s_addr, INADDR_ANY, Device->Config.mac, &mac_size)) {
+		// keep the mac we had so that AirPlay clients see the same player
+		if (mac) memcpy(Device->Config.mac, mac, 6);
+		else if (group || SendARP(ip.s_addr, INADDR_ANY, Device->Config.mac, &mac_size)) {
 			*(uint32_t*) (Device->Config.mac + 2) = hash32(Device->UDN);
 			LOG_INFO("[%p]: creating MAC", Device);
 		}
@@ -662,31 +856,40 @@ static bool AddCastDevice(struct sMR *Device, char *Name, char *UDN, bool group,
 	}
 
 	// virtual players duplicate mac address
-	for (int i = 0; i < glMaxDevices; i++) {
-		if (glMRDevices[i].Running && Device != glMRDevices + i && !memcmp(&glMRDevices[i].Config.mac, Device->Config.mac, 6)) {
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false);
+	for (int i = 0; i < Count; i++) {
+		if (Devices[i]->Running && Device != Devices[i] && !memcmp(&Devices[i]->Config.mac, Device->Config.mac, 6)) {
 			memset(Device->Config.mac, 0xcc, 2);
 			*(uint32_t*) (Device->Config.mac + 2) = hash32(Device->UDN);
 			LOG_INFO("[%p]: duplicated mac ... updating", Device);
 		}
 	}
+	free(Devices);
 
 	LOG_INFO("[%p]: adding renderer (%s - %s:%hu) with mac %hX%X", Device, Name, inet_ntoa(ip), port, *(uint16_t*) Device->Config.mac, *(uint32_t*) (Device->Config.mac + 2));
 
 	Device->CastCtx = CreateCastDevice(Device, Device->Group, Device->Config.StopReceiver, ip, port, Device->Config.MediaVolume);
 	pthread_create(&Device->Thread, NULL, &MRThread, Device);
+	RegistryPublish(Device);
 
 	return true;
 }
 
 /*----------------------------------------------------------------------------*/
 static void FlushCastDevices(void) {
-	for (int i = 0; i < glMaxDevices; i++) {
-		struct sMR *p = &glMRDevices[i];
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false);
+
+	for (int i = 0; i < Count; i++) {
+		struct sMR *p = Devices[i];
 		if (p->Running) {
 			raopsr_delete(p->Raop);
 			RemoveCastDevice(p);
 		 }
 	}
+
+	free(Devices);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -699,6 +902,90 @@ static void RemoveCastDevice(struct sMR *Device) {
 	DeleteCastDevice(Device->CastCtx);
 
 	pthread_join(Device->Thread, NULL);
+	RegistryRelease(Device);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _createDevice(void *Item) {
+	pthread_mutex_init(&((struct sMR*) Item)->Mutex, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _destroyDevice(void *Item) {
+	pthread_mutex_destroy(&((struct sMR*) Item)->Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void RegistryInit(void) {
+	registry_init(&glRegistry, sizeof(struct sMR), _createDevice, _destroyDevice);
+}
+
+/*----------------------------------------------------------------------------*/
+static void RegistryEnd(void) {
+	registry_end(&glRegistry);
+}
+
+/*----------------------------------------------------------------------------*/
+static struct sMR *RegistryAcquire(void) {
+	return registry_acquire(&glRegistry, glMaxDevices);
+}
+
+/*----------------------------------------------------------------------------*/
+static void RegistryPublish(struct sMR *Device) {
+	registry_publish(&glRegistry, Device);
+}
+
+/*----------------------------------------------------------------------------*/
+static void RegistryRelease(struct sMR *Device) {
+	registry_release(&glRegistry, Device);
+}
+
+/*----------------------------------------------------------------------------*/
+int RegistryList(struct sMR ***List, bool All) {
+	return registry_list(&glRegistry, (void***) List, All);
+}
+
+/*----------------------------------------------------------------------------*/
+static void RestoreSnapshot(void) {
+	tSnapshot *List;
+	int Count = LoadSnapshot(glSnapshotName, &List), Restored = 0;
+
+	for (int i = 0; i < Count; i++) {
+		tSnapshot *Snap = List + i;
+		struct sMR *Device;
+
+		if (SearchUDN(Snap->UDN)) continue;
+
+		if ((Device = RegistryAcquire()) == NULL) {
+			LOG_ERROR("Too many devices (max:%u)", glMaxDevices);
+			break;
+		}
+
+		if (!AddCastDevice(Device, Snap->Name, Snap->UDN, Snap->Group, Snap->Host, Snap->Port, Snap->mac)) {
+			RegistryRelease(Device);
+			continue;
+		}
+
+		if (!glDiscovery) {
+			Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+										"aircast", Device->Config.mac, Device->Config.Codec,
+										Device->Config.Metadata, Device->Config.Drift,
+										Device->Config.Flush, Device->Config.Latency,
+										Device, raop_cb, NULL, glPortBase, glPortRange, -1);
+			if (!Device->Raop) {
+				LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+				RemoveCastDevice(Device);
+				continue;
+			}
+		}
+
+		// suspect until mDNS sees it, players that neither answer nor ping are removed
+		Device->Remove = true;
+		Restored++;
+	}
+
+	if (Count) LOG_INFO("restored %d/%d players from snapshot %s", Restored, Count, glSnapshotName);
+	NFREE(List);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -719,9 +1006,8 @@ static bool Start(bool cold) {
 			return false;
 		}
 
-		// mutexes must always be valid
-		glMRDevices = calloc(glMaxDevices, sizeof(struct sMR));
-		for (int i = 0; i < glMaxDevices; i++) pthread_mutex_init(&glMRDevices[i].Mutex, 0);
+		// device slots are allocated on demand, recycled on restart and only freed on exit
+		RegistryInit();
 
 		pthread_mutex_init(&glMainMutex, 0);
 
@@ -741,6 +1027,12 @@ static bool Start(bool cold) {
 	if ((glmDNSServer = mdnsd_start(glHost, false)) == NULL) return false;
 	mdnsd_set_hostname(glmDNSServer, hostname, glHost);
 
+	// configuration is written by a background thread that coalesces updates
+	SaveConfigInit(&glMainMutex);
+
+	// publish known players right away, discovery will sort them out
+	if (cold && *glSnapshotName) RestoreSnapshot();
+
 	// start the mDNS devices discovery thread
 	glmDNSsearchHandle = mdnssd_init(false, glHost, true);
 	pthread_create(&glmDNSsearchThread, NULL, &mDNSsearchThread, NULL);
@@ -758,6 +1050,10 @@ static bool Stop(bool exit) {
 		mdnssd_close(glmDNSsearchHandle);
 		pthread_join(glmDNSsearchThread, NULL);
 
+		// write pending configuration while all renderers are still known
+		LOG_DEBUG("flush configuration ...", NULL);
+		SaveConfigEnd();
+
 		LOG_DEBUG("flush renderers ...", NULL);
 		FlushCastDevices();
 
@@ -769,26 +1065,27 @@ static bool Stop(bool exit) {
 		LOG_DEBUG("terminate main thread ...", NULL);
 		crossthreads_wake();
 		pthread_join(glMainThread, NULL);
-		for (int i = 0; i < glMaxDevices; i++) pthread_mutex_destroy(&glMRDevices[i].Mutex);
+		RegistryEnd();
 		pthread_mutex_destroy(&glMainMutex);
 
 		// terminate pico http server
 		http_pico_close();
 
-		if (glConfigID) ixmlDocument_free(glConfigID);
+		FreeConfig(glConfigID);
 		netsock_close();
 		cross_ssl_free();
 	}
 
-	free(glMRDevices);
 	return true;
 }
 
 /*---------------------------------------------------------------------------*/
 static void sighandler(int signum) {
 	if (!glGracefullShutdown) {
-		for (int i = 0; i < glMaxDevices; i++) {
-			struct sMR *p = &glMRDevices[i];
+		struct sMR **Devices;
+		int Count = RegistryList(&Devices, false);
+		for (int i = 0; i < Count; i++) {
+			struct sMR *p = Devices[i];
 			if (p->Running && p->State == PLAYING) CastStop(p->CastCtx);
 		}
 		LOG_INFO("forced exit", NULL);
@@ -799,6 +1096,50 @@ static void sighandler(int signum) {
 	exit(0);
 }
 
+/*---------------------------------------------------------------------------*/
+static int OptLength(char *opt, int optind, int argc) {
+	// 2 for an option with a value, 1 for a flag and 0 when unknown
+	if (strstr("abxdpiflcvNw", opt) && optind < argc - 1) return 2;
+	if (strstr("tzZIkr", opt) || opt[0] == '-') return 1;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool PlayerOpt(char *opt, char *optarg, tMRConfig *Config) {
+	switch (opt[0]) {
+	case 'v':
+		Config->MediaVolume = atof(optarg);
+		break;
+	case 'c':
+		strcpy(Config->Codec, optarg);
+		break;
+	case 'r':
+		Config->Drift = true;
+		break;
+	case 'l':
+		strcpy(Config->Latency, optarg);
+		break;
+	case '-':
+		if (strcmp(opt + 1, "noflush")) return false;
+		Config->Flush = false;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void PlayerArgs(tMRConfig *Config) {
+	// same walk as ParseArgs (which has validated it), only for player options
+	for (int optind = 1, n; optind < glArgc && strlen(glArgv[optind]) >= 2 && glArgv[optind][0] == '-'; optind += n) {
+		char *opt = glArgv[optind] + 1;
+		if ((n = OptLength(opt, optind, glArgc)) == 0) break;
+		PlayerOpt(opt, n == 2 ? glArgv[optind + 1] : NULL, Config);
+	}
+}
+
 /*---------------------------------------------------------------------------*/
 static bool ParseArgs(int argc, char **argv) {
 	char *optarg = NULL;
@@ -812,28 +1153,23 @@ static bool ParseArgs(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("abxdpiflcvN", opt) && optind < argc - 1) {
-			optarg = argv[optind + 1];
-			optind += 2;
-		} else if (strstr("tzZIkr", opt) || opt[0] == '-') {
-			optarg = NULL;
-			optind += 1;
-		}
-		else {
+		int n = OptLength(opt, optind, argc);
+
+		if (!n) {
 			printf("%s", usage);
 			return false;
 		}
 
+		optarg = n == 2 ? argv[optind + 1] : NULL;
+		optind += n;
+
+		// these are re-applied when config file is reloaded
+		if (PlayerOpt(opt, optarg, &glMRConfig)) continue;
+
 		switch (opt[0]) {
 		case 'f':
 			glLogFile = optarg;
 			break;
-		case 'v':
-			glMRConfig.MediaVolume = atof(optarg);
-			break;
-		case 'c':
-			strcpy(glMRConfig.Codec, optarg);
-			break;
 		case 'b':
 			strcpy(glBinding, optarg);
 			break;
@@ -847,6 +1183,9 @@ static bool ParseArgs(int argc, char **argv) {
 		case 'I':
 			glAutoSaveConfigFile = true;
 			break;
+		case 'w':
+			strncpy(glSnapshotName, optarg, STR_LEN - 1);
+			break;
 		case 'p':
 			glPidFile = optarg;
 			break;
@@ -859,12 +1198,6 @@ static bool ParseArgs(int argc, char **argv) {
 		case 'k':
 			glGracefullShutdown = false;
 			break;
-		case 'r':
-			glMRConfig.Drift = true;
-			break;
-		case 'l':
-			strcpy(glMRConfig.Latency, optarg);
-			break;
 #if LINUX || FREEBSD
 		case 'z':
 			glDaemonize = true;
@@ -895,9 +1228,6 @@ static bool ParseArgs(int argc, char **argv) {
 		case 't':
 			printf("%s", license);
 			return false;
-		case '-':
-			if (!strcmp(opt + 1, "noflush")) glMRConfig.Flush = false;
-			break;
 		default:
 			break;
 		}
@@ -935,6 +1265,10 @@ int main(int argc, char *argv[]) {
 	}
 
 	// load config from xml file
+	// keep defaults to restart from them when config file is reloaded
+	memcpy(&glMRDefaults, &glMRConfig, sizeof(tMRConfig));
+	glArgc = argc;
+	glArgv = argv;
 	glConfigID = (void*) LoadConfig(glConfigName, &glMRConfig);
 
 	// potentially overwrite with some cmdline parameters
@@ -943,6 +1277,10 @@ int main(int argc, char *argv[]) {
 	// make sure port range is correct
 	if (glPortBase && !glPortRange) glPortRange = glMaxDevices*4;
 
+	// snapshot lives next to config, but discovery mode must start from scratch
+	if (!*glSnapshotName) snprintf(glSnapshotName, STR_LEN, "%.*s.cache", STR_LEN - 7, glConfigName);
+	if (!strcmp(glSnapshotName, "-") || glDiscovery) *glSnapshotName = '\0';
+
 	if (glLogFile) {
 		if (!freopen(glLogFile, "a", stderr)) {
 			fprintf(stderr, "error opening logfile %s: %s\n", glLogFile, strerror(errno));
@@ -1036,14 +1374,19 @@ int main(int argc, char *argv[]) {
 		if (!strcmp(resp, "save"))	{
 			char name[128];
 			(void)! scanf("%s", name);
+			// saver thread and config reload also use the document
+			pthread_mutex_lock(&glMainMutex);
 			SaveConfig(name, glConfigID, true);
+			pthread_mutex_unlock(&glMainMutex);
 		}
 
 		if (!strcmp(resp, "dump") || !strcmp(resp, "dumpall"))	{
 			bool all = !strcmp(resp, "dumpall");
+			struct sMR **Devices;
+			int Count = RegistryList(&Devices, all);
 
-			for (int i = 0; i < glMaxDevices; i++) {
-				struct sMR *p = &glMRDevices[i];
+			for (int i = 0; i < Count; i++) {
+				struct sMR *p = Devices[i];
 				bool Locked = pthread_mutex_trylock(&p->Mutex);
 
 				if (!Locked) pthread_mutex_unlock(&p->Mutex);
@@ -1055,6 +1398,8 @@ int main(int argc, char *argv[]) {
 						   p->GroupMaster ? p->GroupMaster->Next : NULL);
 				printf("\n");
 			}
+
+			free(Devices);
 		}
 
 	};
@@ -81,7 +81,8 @@ struct sMR {
 
 extern int32_t				glLogLimit;
 extern tMRConfig			glMRConfig;
-extern struct sMR			*glMRDevices;
 extern int					glMaxDevices;
 extern unsigned short		glPortBase, glPortRange;
 extern char					glBinding[16];
+
+int		RegistryList(struct sMR ***List, bool All);
@@ -352,6 +352,11 @@ struct in_addr CastGetAddr(struct sCastCtx *Ctx) {
 	return Ctx->ip;
 }
 
+/*----------------------------------------------------------------------------*/
+uint16_t CastGetPort(struct sCastCtx *Ctx) {
+	return Ctx->port;
+}
+
 /*----------------------------------------------------------------------------*/
 void DeleteCastDevice(struct sCastCtx *Ctx) {
 	pthread_mutex_lock(&Ctx->Mutex);
@@ -22,4 +22,5 @@ void 	DeleteCastDevice(struct sCastCtx *Ctx);
 bool	CastIsConnected(struct sCastCtx *Ctx);
 bool 	CastIsMediaSession(struct sCastCtx *Ctx);
 struct in_addr CastGetAddr(struct sCastCtx *Ctx);
+uint16_t	CastGetPort(struct sCastCtx *Ctx);
 
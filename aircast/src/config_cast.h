@@ -9,7 +9,27 @@
 
 #pragma once
 
+#include "aircast.h"
+
+// what is needed to publish a renderer before it is discovered again
+typedef struct sSnapshot {
+	char			UDN[RESOURCE_LENGTH];
+	char			Name[STR_LEN];
+	struct in_addr	Host;
+	uint16_t		Port;
+	bool			Group;
+	uint8_t			mac[6];
+} tSnapshot;
+
 void	  	SaveConfig(char *name, void *ref, bool full);
+void		SaveConfigLater(char *name, void **ref);
+void		SaveConfigInit(pthread_mutex_t *Lock);
+void		SaveConfigEnd(void);
+void		SaveSnapshot(char *name);
+void		SaveSnapshotLater(char *name);
+int			LoadSnapshot(char *name, tSnapshot **List);
 void*		LoadConfig(char *name, struct sMRConfig *Conf);
 void*		FindMRConfig(void *ref, char *UDN);
 void*		LoadMRConfig(void *ref, char *UDN, struct sMRConfig *Conf);
+void		FreeConfig(void *ref);
+bool		ConfigChanged(void);
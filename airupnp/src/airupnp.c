@@ -28,6 +28,8 @@
 #include "avt_util.h"
 #include "config_upnp.h"
 #include "mr_util.h"
+#include "soap_util.h"
+#include "relay_util.h"
 
 #define	AV_TRANSPORT 			"urn:schemas-upnp-org:service:AVTransport"
 #define	RENDERING_CTRL 			"urn:schemas-upnp-org:service:RenderingControl"
@@ -37,10 +39,21 @@
 
 #define DISCOVERY_TIME 		30
 #define PRESENCE_TIMEOUT	(DISCOVERY_TIME * 6)
+#define SEARCH_MX			10
+#define SEARCH_BURST_MX		3
+#define SEARCH_BURST		3
+#define SEARCH_MIN			(DISCOVERY_TIME - SEARCH_MX)
+#define SEARCH_MAX			300
+#define PRESENCE_DEADLINE	3000
 #define BYE_TIMEOUT			5
+#define DESC_TTL			(DISCOVERY_TIME * 10)
 
 #define MAX_DEVICES			32
+#define MAX_GROUPS			8
+#define DESC_WORKERS		4
+#define DESC_PENDING		64
 #define HTTP_FIXED_LENGTH	INT_MAX
+#define CONFIG_WATCH		5
 
 /* for the haters of GOTO statement: I'm not a big fan either, but there are
 cases where they make code more leightweight and readable, instead of tons of
@@ -53,7 +66,6 @@ of code repeating and break/continue
 /*----------------------------------------------------------------------------*/
 int32_t  			glLogLimit = -1;
 UpnpClient_Handle 	glControlPointHandle;
-struct sMR			*glMRDevices;
 int					glMaxDevices = MAX_DEVICES;
 uint16_t			glPortBase, glPortRange;
 char				glBinding[128] = "?";
@@ -79,7 +91,12 @@ tMRConfig			glMRConfig = {
 							false,		 // drift
 							{0, 0, 0, 0, 0, 0 }, // MAC
 							"",			// artwork
-							"broadcast"
+							"broadcast", // stream type
+							false,		 // transport events
+							500, 10000,	 // state poll interval bounds
+							false,		 // gapless
+							true,		 // keep-alive
+							"fixed"		 // codec policy
 					};
 
 /*----------------------------------------------------------------------------*/
@@ -88,8 +105,75 @@ tMRConfig			glMRConfig = {
 typedef struct sUpdate {
 	enum { DISCOVERY, BYE_BYE, SEARCH_TIMEOUT } Type;
 	char *Data;
+	uint32_t Hash;
+	struct sUpdate *Next;
 } tUpdate;
 
+/*
+Pending updates are also chained by key (type + location or UDN) so that a new
+one identical to a pending one is simply dropped. Protected by glUpdateMutex
+*/
+#define UPDATE_BUCKETS	64
+
+static struct {
+	tUpdate		*Buckets[UPDATE_BUCKETS];
+	uint32_t	Depth, MaxDepth;
+	uint32_t	Queued, Coalesced;
+} glUpdates;
+
+/*
+New devices are probed by a pool of workers so that a slow or dead player does
+not hold the update queue. Pending holds description URLs being queued or
+processed, in arrival order, so that the same player is not probed twice and
+new players are published in that order
+*/
+static struct {
+	bool			Running;
+	pthread_t		Thread[DESC_WORKERS];
+	pthread_mutex_t	Mutex;
+	pthread_cond_t	Cond;
+	struct {
+		char	*URL;
+		bool	Busy;
+	} Pending[DESC_PENDING];
+	int				Count;
+} glDescPool;
+
+/*
+General searches are scheduled: a burst of short searches at start, IP change or
+when a player leaves, then the pause after each search doubles as long as the
+set of players does not change, up to SEARCH_MAX. Presence timeout follows that
+pause so that a stable player is never declared missing between two searches
+*/
+static struct {
+	pthread_mutex_t	Mutex;
+	bool			Busy, Changed;
+	int				Burst, Version;
+	uint32_t		Interval, Due, Sent, Count;
+	const char		*Reason;
+} glSearch;
+
+static struct {
+	uint32_t		Sweeps, Probed, Removed;
+	uint32_t		Last, Max;			// duration in ms
+} glPresence;
+
+/*
+A virtual group is one AirPlay endpoint whose audio is encoded once and served
+by a relay to all its members. Groups are read from config at start and their
+mutex is always taken before a member's
+*/
+static struct sGroup {
+	tGroupConfig	Config;
+	struct raopsr_s	*Raop;
+	struct sRelay	*Relay;
+	raopsr_event_t	RaopState;
+	char			*ProtocolInfo;
+	uint8_t			mac[6];
+	pthread_mutex_t	Mutex;
+} glGroups[MAX_GROUPS];
+static int			glGroupCount;
+
 /*----------------------------------------------------------------------------*/
 /* consts or pseudo-const													  */
 /*----------------------------------------------------------------------------*/
@@ -103,7 +187,7 @@ static const struct cSearchedSRV_s
 } cSearchedSRV[NB_SRV] = {	{AV_TRANSPORT, AVT_SRV_IDX, 0},
 						{RENDERING_CTRL, REND_SRV_IDX, 120},
 						{CONNECTION_MGR, CNX_MGR_IDX, 0},
-						{TOPOLOGY, TOPOLOGY_IDX, 0},
+						{TOPOLOGY, TOPOLOGY_IDX, 120},
 						{GROUP_RENDERING_CTRL, GRP_REND_SRV_IDX, 0},
 				   };
 
@@ -126,13 +210,18 @@ static bool				glGracefullShutdown = true;
 static bool				glDiscovery = false;
 static pthread_mutex_t 	glUpdateMutex;
 static pthread_cond_t  	glUpdateCond;
+static pthread_mutex_t	glCommitMutex;
 static pthread_t 		glMainThread, glUpdateThread;
 static cross_queue_t	glUpdateQueue;
 static bool				glInteractive = true;
 static char*			glLogFile;
 static uint16_t			glPort;
 static void*			glConfigID = NULL;
+static tMRConfig		glMRDefaults;
+static int				glArgc;
+static char**			glArgv;
 static char				glConfigName[STR_LEN] = "./config.xml";
+static char				glSnapshotName[STR_LEN] = "";
 static char*			glNameFormat = "%s+";
 
 static char usage[] =
@@ -149,6 +238,7 @@ static char usage[] =
 		   "  -x <config file>       read config from file (default is ./config.xml)\n"
 		   "  -i <config file>       discover players, save <config file> and exit\n"
 		   "  -I                     auto save config at every network scan\n"
+		   "  -w <file|->            players snapshot for warm start (default is <config file>.cache, - to disable)\n"
 		   "  -l <[rtp][:http][:f]>  RTP and HTTP latency (ms), ':f' forces silence fill\n"
 		   "  -r                     let timing reference drift (no click)\n"
 		   "  -f <logfile>           write debug to logfile\n"
@@ -157,6 +247,7 @@ static char usage[] =
 		   "  -m <n1,n2...>          exclude devices whose model include tokens\n"
 		   "  -n <m1,m2,...>         exclude devices whose name includes tokens\n"
 		   "  -o <m1,m2,...>         include only listed models; overrides -m and -n (use <NULL> if player don't return a model)\n"
+		   "                         tokens can be prefixed by model:, number:, mfr:, udn: or ip: (ip:<addr>[/<bits>])\n"
 		   "  -d <log>=<level>       set logging level, logs: all|raop|main|util|upnp, level: error|warn|info|debug|sdebug\n"
 #if LINUX || FREEBSD
 		   "  -z                     daemonize\n"
@@ -207,15 +298,31 @@ static char license[] =
 /*----------------------------------------------------------------------------*/
 /* prototypes */
 /*----------------------------------------------------------------------------*/
-static 	void*	MRThread(void *args);
+static	uint32_t	PollDevice(struct sMR *Device);
 static 	void*	UpdateThread(void *args);
-static 	bool 	AddMRDevice(struct sMR *Device, char * UDN, IXML_Document *DescDoc,	const char *location);
-static	bool 	isExcluded(char *Model, char *ModelNumber);
+static	void	QueueUpdate(int Type, const char *Data);
+static	void	DescPoolInit(void);
+static	void	DescPoolEnd(void);
+static	void	DescPoolSubmit(char *Location);
+static	void	DescPoolTurn(const char *Location);
+static 	bool 	AddMRDevice(struct sMR *Device, char * UDN, IXML_Document *DescDoc,	const char *location, tSnapshot *Snap);
+static	void	SetProtocolInfo(struct sMR *Device);
+static	void	Subscribe(struct sMR *Device);
+static	char*	CodecProtocolInfo(char *Codec);
+static	void	GroupsInit(void);
+static	void	GroupsEnd(void);
+static	void	Rebind(void);
+static	void	RestoreSnapshot(void);
+static	void	SearchRequest(const char *Reason, bool Burst);
+static	void	SearchChanged(void);
+static	void	PlayerArgs(tMRConfig *Config);
+static	uint32_t SearchPresence(void);
 static bool 	Start(bool cold);
 static bool 	Stop(bool exit);
 
 // functions with _ prefix means that the device mutex is expected to be locked
 static bool 	_ProcessQueue(struct sMR *Device);
+static void 	_SetTransportState(struct sMR *Device, enum eMRstate State);
 
 
 
@@ -224,53 +331,52 @@ static bool 	_ProcessQueue(struct sMR *Device);
 #define STATE_POLL  (500)
 #define MAX_ACTION_ERRORS (5)
 #define MIN_POLL (min(TRACK_POLL, STATE_POLL))
-static void *MRThread(void *args) {
-	int elapsed, wakeTimer = MIN_POLL;
-	unsigned last;
-	struct sMR *p = (struct sMR*) args;
-
-	last = gettime_ms();
-
-	for (; p->Running; crossthreads_sleep(wakeTimer)) {
-		elapsed = gettime_ms() - last;
-
-		// context is valid as long as thread runs
-		pthread_mutex_lock(&p->Mutex);
-
-		wakeTimer = (p->State != STOPPED) ? MIN_POLL / 2: MIN_POLL * 10;
-		LOG_SDEBUG("[%p]: UPnP thread timer %d %d", p, elapsed, wakeTimer);
-
-		p->StatePoll += elapsed;
-		p->TrackPoll += elapsed;
+#define MAX_EVENT_MISMATCH	(3)
+#define CHAIN_WAIT	(1000)
+#define DUE(t, now) ((int32_t) ((now) - (t)) >= 0)
+static uint32_t PollDevice(struct sMR *p) {
+	uint32_t now = gettime_ms();
 
-		/*
-		should not request any status update if we are stopped, off or waiting
-		for an action to be performed or slave
-		*/
-		if (p->Master || (p->RaopState != RAOP_PLAY && p->State == STOPPED) ||
-			p->ErrorCount < 0 || p->ErrorCount > MAX_ACTION_ERRORS || p->WaitCookie) goto sleep;
-
-		// do polling as event is broken in many uPNP devices (not synchronously)
-		if (p->StatePoll > STATE_POLL) {
-			// get state (PLAYING, STOPPED...)
-			p->StatePoll = 0;
-			AVTCallAction(p, "GetTransportInfo", p->seqN++);
-		} else if (p->TrackPoll > TRACK_POLL) {
-			// get track position & CurrentURI
-			p->TrackPoll = 0;
-			if (p->State != STOPPED && p->State != PAUSED) AVTCallAction(p, "GetPositionInfo", p->seqN++);
-		}
+	/*
+	should not request any status update if we are stopped (and not driven by a
+	group), off or slave. Such devices are dropped from the poller until something
+	(re)schedules them
+	*/
+	if (p->Master || (p->RaopState != RAOP_PLAY && !p->Group && p->State == STOPPED)) {
+		LOG_SDEBUG("[%p]: UPnP poll idle", p);
+		return 0;
+	}
 
-sleep:
-		last = gettime_ms(),
-		pthread_mutex_unlock(&p->Mutex);
+	// a FLUSH that no PLAY follows is a pause or a seek, renderer must not go on
+	if (p->Chained && DUE(p->ChainDeadline, now)) {
+		LOG_INFO("[%p]: no stream after flush, stopping", p);
+		AVTStop(p);
+		p->ExpectStop = true;
+		p->Chained = false;
 	}
 
-	// clean our stuff before exiting
-	AVTActionFlush(&p->ActionQueue);
-	LOG_INFO("[%p] player thread exited", p);
+	// slow down when renderer is not playing
+	uint32_t Delay = (p->State != STOPPED) ? MIN_POLL / 2 : MIN_POLL * 10;
+
+	// waiting for an action to be performed or in error, check again later
+	if (p->ErrorCount < 0 || p->ErrorCount > MAX_ACTION_ERRORS || p->WaitCookie) return Delay;
+
+	// do polling as event is broken in many uPNP devices (not synchronously)
+	if (DUE(p->StatePoll, now)) {
+		// get state (PLAYING, STOPPED...), only to verify events when we trust them
+		p->StatePoll = now + (p->TrustEvents ? p->StateInterval : p->Config.PollMin);
+		AVTCallAction(p, "GetTransportInfo", p->seqN++);
+	} else if (DUE(p->TrackPoll, now)) {
+		// get track position & CurrentURI
+		p->TrackPoll = now + TRACK_POLL;
+		if (p->State != STOPPED && p->State != PAUSED) AVTCallAction(p, "GetPositionInfo", p->seqN++);
+	}
 
-	return NULL;
+	// one action at a time, so don't come back before Delay (nor after a flush's deadline)
+	if (p->Chained) Delay = min(Delay, p->ChainDeadline - now);
+	now += Delay;
+	if (p->Chained || DUE(p->StatePoll, now) || DUE(p->TrackPoll, now)) return Delay;
+	return min(p->StatePoll - now, p->TrackPoll - now) + Delay;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -292,21 +398,32 @@ void HandleRAOP(void *owner, raopsr_event_t event, ...) {
 		case RAOP_STOP:
 			// this is TEARDOWN, so far there is always a FLUSH before
 			LOG_INFO("[%p]: Stop", Device);
-			if (Device->RaopState == RAOP_PLAY) {
+			if (Device->RaopState == RAOP_PLAY || Device->Chained) {
 				AVTStop(Device);
 				Device->ExpectStop = true;
+				Device->Chained = false;
 			}
 			Device->RaopState = event;
 			break;
 		case RAOP_FLUSH:
 			if (Device->Config.Flush) {
 				LOG_INFO("[%p]: Flush", Device);
-				AVTStop(Device);
-				Device->ExpectStop = true;
+				// renderer keeps playing and next stream will be chained on PLAY
+				if (Device->Config.Gapless && Device->NextURI && Device->RaopState == RAOP_PLAY && Device->State == PLAYING) {
+					Device->Chained = true;
+					Device->ChainDeadline = gettime_ms() + CHAIN_WAIT;
+					PollSchedule(Device, CHAIN_WAIT);
+				} else {
+					AVTStop(Device);
+					Device->ExpectStop = true;
+				}
 				Device->RaopState = event;
             }
 			break;
 		case RAOP_PLAY: {
+			// its own AirPlay session takes the player back from any group
+			Device->Group = NULL;
+
 			if (Device->RaopState != RAOP_PLAY) {
 				uint16_t port = va_arg(args, uint32_t);
 				char* uri, * mp3radio = "";
@@ -321,8 +438,15 @@ void HandleRAOP(void *owner, raopsr_event_t event, ...) {
 				(void) !sscanf(Device->Config.Codec, "%31[^:]", codec);
 				(void) !asprintf(&uri, "%shttp://%s:%u/stream-%u.%s", mp3radio, inet_ntoa(glHost), port, count++, codec);
 
-				LOG_INFO("[%p]: uPNP setURI %s (cookie %p)", Device, uri, Device->seqN);
-				AVTSetURI(Device, uri, &Device->MetaData, Device->ProtocolInfo);
+				if (Device->Chained) {
+					// no stop, just switch to the armed stream
+					AVTSetNextURI(Device, uri, &Device->MetaData, Device->ProtocolInfo);
+					AVTBasic(Device, "Next");
+					Device->Chained = false;
+				} else {
+					LOG_INFO("[%p]: uPNP setURI %s (cookie %p)", Device, uri, Device->seqN);
+					AVTSetURI(Device, uri, &Device->MetaData, Device->ProtocolInfo);
+				}
 				free(uri);
 			}
 
@@ -330,6 +454,7 @@ void HandleRAOP(void *owner, raopsr_event_t event, ...) {
 
 			// don't set volume, a RAOP_VOLUME will be sent by the controller
 			Device->RaopState = event;
+			PollSchedule(Device, 0);
 			break;
 		}
 		case RAOP_VOLUME: {
@@ -358,17 +483,26 @@ void HandleRAOP(void *owner, raopsr_event_t event, ...) {
 			} else {
 				double Ratio = GroupVolume ? (RaopVolume * Device->Config.MaxVolume) / GroupVolume : 0;
 
+				struct sMR *Members[MAX_MEMBERS];
+				int Count = GroupMembers(Device, Members, MAX_MEMBERS);
+
 				// set volume for all devices
-				for (i = 0; i < glMaxDevices; i++) {
-					struct sMR *p = glMRDevices + i;
-					if (!p->Running || (p != Device && p->Master != Device) || p->Volume < 0) continue;
+				for (i = 0; i < Count; i++) {
+					struct sMR *p = Members[i];
+
+					// actions of a slave belong to it, so it must be locked as well (master first)
+					if (p != Device && (p->Master != Device || !CheckAndLock(p))) continue;
+
+					if ((p == Device || p->Master == Device) && p->Volume >= 0) {
+						// for standalone master, GroupVolume & Volume are identical
+						if (GroupVolume) p->Volume = min(p->Volume * Ratio, p->Config.MaxVolume);
+						else p->Volume = RaopVolume * p->Config.MaxVolume;
 
-					// for standalone master, GroupVolume & Volume are identical
-					if (GroupVolume) p->Volume = min(p->Volume * Ratio, p->Config.MaxVolume);
-					else p->Volume = RaopVolume * p->Config.MaxVolume;
+						CtrlSetVolume(p, p->Volume + 0.5, p->seqN++);
+						LOG_INFO("[%p]: Volume[0..100] %d:%d", p, (int) p->Volume, GroupVolume);
+					}
 
-					CtrlSetVolume(p, p->Volume + 0.5, p->seqN++);
-					LOG_INFO("[%p]: Volume[0..100] %d:%d", p, (int) p->Volume, GroupVolume);
+					if (p != Device) pthread_mutex_unlock(&p->Mutex);
 				}
 			}
 			break;
@@ -383,16 +517,236 @@ void HandleRAOP(void *owner, raopsr_event_t event, ...) {
 
 
 /*----------------------------------------------------------------------------*/
-void HandleHTTP(void *owner, struct key_data_s *headers, struct key_data_s *response) {
-	struct sMR *Device = (struct sMR*) owner;
+static void AddDLNAHeaders(char *ProtocolInfo, struct key_data_s *headers, struct key_data_s *response) {
 	char* p;
 
-	if (kd_lookup(headers, "getcontentFeatures.dlna.org") && (p = strcasestr(Device->ProtocolInfo, "DLNA.ORG")) != NULL) {
+	if (kd_lookup(headers, "getcontentFeatures.dlna.org") && (p = strcasestr(ProtocolInfo, "DLNA.ORG")) != NULL) {
 		kd_add(response, "contentFeatures.dlna.org", p);
 	}
 	kd_add(response, "transferMode.dlna.org", "Streaming");
 }
 
+/*----------------------------------------------------------------------------*/
+void HandleHTTP(void *owner, struct key_data_s *headers, struct key_data_s *response) {
+	struct sMR *Device = (struct sMR*) owner;
+	AddDLNAHeaders(Device->ProtocolInfo, headers, response);
+}
+
+/*----------------------------------------------------------------------------*/
+static void GroupCommand(struct sGroup *Group, raopsr_event_t Event, char *URI, double Volume) {
+	/*
+	Each member has its own action queue and SOAP requests are sent async, so
+	all members receive their commands together, not one after the other
+	*/
+	for (int i = 0; i < Group->Config.Count; i++) {
+		struct sMR *p = UDN2Device(Group->Config.Members[i]);
+
+		if (!p) {
+			LOG_DEBUG("[%p]: group member %s not found", Group, Group->Config.Members[i]);
+			continue;
+		}
+
+		if (!CheckAndLock(p)) continue;
+
+		// a Sonos slave follows its coordinator, it must not be told anything
+		if (p->Master) {
+			LOG_INFO("[%p]: group member %s is a slave, skipping", Group, p->Config.Name);
+			pthread_mutex_unlock(&p->Mutex);
+			continue;
+		}
+
+		switch (Event) {
+			case RAOP_PLAY:
+				// a group being torn down does not take anyone anymore
+				if (!Group->Raop) break;
+				p->Group = Group;
+				if (URI) {
+					char *uri, *mp3radio = "";
+					if ((strcasestr(glMRConfig.Codec, "mp3") || strcasestr(glMRConfig.Codec, "aac") || !strcasecmp(p->Config.StreamType, "radio")) && *p->Service[TOPOLOGY_IDX].ControlURL) {
+						mp3radio = "x-rincon-mp3radio://";
+					}
+					(void) !asprintf(&uri, "%s%s", mp3radio, URI);
+					LOG_INFO("[%p]: uPNP setURI %s for group %s", p, uri, Group->Config.Name);
+					AVTSetURI(p, uri, &p->MetaData, Group->ProtocolInfo);
+					free(uri);
+				}
+				AVTPlay(p);
+				PollSchedule(p, 0);
+				break;
+			case RAOP_STOP:
+				// member may have been taken back by its own AirPlay session
+				if (p->Group != Group) break;
+				AVTStop(p);
+				p->ExpectStop = true;
+				p->Group = NULL;
+				break;
+			case RAOP_VOLUME:
+				if (p->Group != Group && p->RaopState == RAOP_PLAY) break;
+				p->VolumeStampTx = gettime_ms();
+				p->Volume = Volume * p->Config.MaxVolume;
+				CtrlSetVolume(p, p->Volume + 0.5, p->seqN++);
+				LOG_INFO("[%p]: Volume[0..100] %d for group %s", p, (int) p->Volume, Group->Config.Name);
+				break;
+			default:
+				break;
+		}
+
+		pthread_mutex_unlock(&p->Mutex);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void HandleGroupRAOP(void *owner, raopsr_event_t event, ...) {
+	struct sGroup *Group = (struct sGroup*) owner;
+
+	va_list args;
+	va_start(args, event);
+	pthread_mutex_lock(&Group->Mutex);
+
+	switch (event) {
+		case RAOP_STREAM:
+			LOG_INFO("[%p]: group %s stream", Group, Group->Config.Name);
+			Group->RaopState = event;
+			break;
+		case RAOP_FLUSH:
+			if (!glMRConfig.Flush) break;
+			// fall through
+		case RAOP_STOP:
+			LOG_INFO("[%p]: group %s stop", Group, Group->Config.Name);
+			if (Group->RaopState == RAOP_PLAY) {
+				GroupCommand(Group, RAOP_STOP, NULL, 0);
+				RelayStop(Group->Relay);
+			}
+			Group->RaopState = event;
+			break;
+		case RAOP_PLAY: {
+			char *uri = NULL;
+
+			if (Group->RaopState != RAOP_PLAY) {
+				uint16_t port = va_arg(args, uint32_t);
+				char *source, codec[32] = "flac";
+				static int count;
+
+				// the relay is the only client of the encoder, members all read from it
+				(void) !sscanf(glMRConfig.Codec, "%31[^:]", codec);
+				(void) !asprintf(&source, "http://%s:%u/stream-%u.%s", inet_ntoa(glHost), port, count, codec);
+				if (RelayStart(Group->Relay, source)) {
+					(void) !asprintf(&uri, "http://%s:%u/group-%u.%s", inet_ntoa(glHost), RelayPort(Group->Relay), count, codec);
+				} else {
+					LOG_ERROR("[%p]: cannot relay %s", Group, source);
+				}
+				count++;
+				free(source);
+			}
+
+			GroupCommand(Group, RAOP_PLAY, uri, 0);
+			NFREE(uri);
+			Group->RaopState = event;
+			break;
+		}
+		case RAOP_VOLUME: {
+			// members are set to the same level, each within its own max volume
+			double RaopVolume = va_arg(args, double);
+			GroupCommand(Group, RAOP_VOLUME, NULL, RaopVolume);
+			break;
+		}
+		default:
+			break;
+	}
+
+	pthread_mutex_unlock(&Group->Mutex);
+	va_end(args);
+}
+
+/*----------------------------------------------------------------------------*/
+static void HandleGroupHTTP(void *owner, struct key_data_s *headers, struct key_data_s *response) {
+	struct sGroup *Group = (struct sGroup*) owner;
+	AddDLNAHeaders(Group->ProtocolInfo, headers, response);
+}
+
+/*----------------------------------------------------------------------------*/
+static void GroupsInit(void) {
+	tGroupConfig *List;
+
+	if (!glConfigID || !glmDNSServer) return;
+
+	pthread_mutex_lock(&glCommitMutex);
+	int Count = LoadGroups(glConfigID, &List);
+	pthread_mutex_unlock(&glCommitMutex);
+
+	for (int i = 0; i < Count && glGroupCount < MAX_GROUPS; i++) {
+		struct sGroup *Group = glGroups + glGroupCount;
+		uint32_t hash = hash32(List[i].Name);
+
+		memset(Group, 0, sizeof(struct sGroup));
+		memcpy(&Group->Config, List + i, sizeof(tGroupConfig));
+		Group->ProtocolInfo = CodecProtocolInfo(glMRConfig.Codec);
+		Group->RaopState = RAOP_STOP;
+		Group->mac[0] = 0xbb; Group->mac[1] = 0xbb;
+		memcpy(Group->mac + 2, &hash, 4);
+		pthread_mutex_init(&Group->Mutex, 0);
+
+		if ((Group->Relay = RelayCreate(glHost, glPortBase, glPortRange)) == NULL) {
+			LOG_ERROR("[%p]: cannot create relay for group %s", Group, Group->Config.Name);
+			pthread_mutex_destroy(&Group->Mutex);
+			continue;
+		}
+
+		/*
+		relay forwards the stream as it comes and a late member joins anywhere in
+		it, which would be in the middle of a chunk, so never use chunked encoding
+		*/
+		int HTTPLength = glMRConfig.HTTPLength == -3 ? -1 : glMRConfig.HTTPLength;
+
+		Group->Raop = raopsr_create(glHost, glmDNSServer, Group->Config.Name,
+						   "airupnp", Group->mac, glMRConfig.Codec,
+						   glMRConfig.Metadata, glMRConfig.Drift, glMRConfig.Flush,
+						   glMRConfig.Latency, Group,
+						   HandleGroupRAOP, HandleGroupHTTP, glPortBase, glPortRange,
+						   HTTPLength ? HTTPLength : HTTP_FIXED_LENGTH);
+
+		if (!Group->Raop) {
+			LOG_ERROR("[%p]: cannot create RAOP instance for group %s", Group, Group->Config.Name);
+			RelayDelete(Group->Relay);
+			pthread_mutex_destroy(&Group->Mutex);
+			continue;
+		}
+
+		LOG_INFO("[%p]: virtual group %s with %d members (relay port %hu)", Group, Group->Config.Name,
+				 Group->Config.Count, RelayPort(Group->Relay));
+		glGroupCount++;
+	}
+
+	NFREE(List);
+}
+
+/*----------------------------------------------------------------------------*/
+static void GroupsEnd(void) {
+	for (int i = 0; i < glGroupCount; i++) {
+		struct sGroup *Group = glGroups + i;
+
+		struct raopsr_s *Raop = Group->Raop;
+
+		/*
+		Members notify the group's RAOP instance under their own lock, so once they
+		are all detached nobody can use it and it can be deleted. A late PLAY will
+		not attach them again as it is serialized with this by the group's mutex
+		*/
+		pthread_mutex_lock(&Group->Mutex);
+		GroupCommand(Group, RAOP_STOP, NULL, 0);
+		Group->Raop = NULL;
+		pthread_mutex_unlock(&Group->Mutex);
+
+		// no more RAOP callbacks once deleted
+		raopsr_delete(Raop);
+
+		RelayDelete(Group->Relay);
+		pthread_mutex_destroy(&Group->Mutex);
+	}
+
+	glGroupCount = 0;
+}
+
 /*----------------------------------------------------------------------------*/
 static bool _ProcessQueue(struct sMR *Device) {
 	struct sService *Service = &Device->Service[AVT_SRV_IDX];
@@ -400,47 +754,83 @@ static bool _ProcessQueue(struct sMR *Device) {
 	int rc = 0;
 
 	Device->WaitCookie = 0;
-	if ((Action = queue_extract(&Device->ActionQueue)) == NULL) return false;
+	if ((Action = Device->Actions) == NULL) return false;
+	Device->Actions = Action->Next;
 
 	Device->WaitCookie = Device->seqN++;
-	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
-							 NULL, Action->ActionNode, ActionHandler, Device->WaitCookie);
+	rc = SoapSendAsync(Device, Service, Action->ActionNode, ActionHandler, Device->WaitCookie);
 
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("Error in queued UpnpSendActionAsync -- %d", rc);
+		LOG_ERROR("Error in queued SoapSendAsync -- %d", rc);
 	}
 
 	ixmlDocument_free(Action->ActionNode);
+	free(Action->Name);
 	free(Action);
 
 	return (rc == 0);
 }
 
+/*----------------------------------------------------------------------------*/
+static void _SetTransportState(struct sMR *p, enum eMRstate State) {
+	// a group member reports to the group's AirPlay controller, not to its own
+	struct raopsr_s *Raop = p->Group ? p->Group->Raop : p->Raop;
+	raopsr_event_t RaopState = p->Group ? p->Group->RaopState : p->RaopState;
+
+	if (State == TRANSITIONING && p->State != TRANSITIONING) {
+		p->State = TRANSITIONING;
+		LOG_INFO("[%p]: uPNP transition", p);
+	} else if (State == STOPPED && p->State != STOPPED) {
+		if (RaopState == RAOP_PLAY && !p->ExpectStop) raopsr_notify(Raop, RAOP_STOP, NULL);
+		p->State = STOPPED;
+		p->ExpectStop = false;
+		// nothing to chain to anymore
+		p->Chained = false;
+		LOG_INFO("[%p]: uPNP stopped", p);
+	} else if (State == PLAYING && p->State != PLAYING) {
+		p->State = PLAYING;
+		if (RaopState != RAOP_PLAY) raopsr_notify(Raop, RAOP_PLAY, NULL);
+		LOG_INFO("[%p]: uPNP playing", p);
+	} else if (State == PAUSED && p->State != PAUSED) {
+		p->State = PAUSED;
+		if (RaopState == RAOP_PLAY) raopsr_notify(Raop, RAOP_PAUSE, NULL);
+		LOG_INFO("[%p]: uPNP pause", p);
+	}
+}
+
 /*----------------------------------------------------------------------------*/
 static void ProcessEvent(Upnp_EventType EventType, const void *_Event, void *Cookie) {
 	UpnpEvent* Event = (UpnpEvent*)_Event;
 	struct sMR *Device = SID2Device(UpnpEvent_get_SID(Event));
 	IXML_Document *VarDoc = UpnpEvent_get_ChangedVariables(Event);
-	char  *r = NULL;
-	char  *LastChange = NULL;
+	tLastChange Change;
 
 	// this is async, so need to check context's validity
 	if (!CheckAndLock(Device)) return;
 
-	LastChange = XMLGetFirstDocumentItem(VarDoc, "LastChange", true);
+	// Sonos household topology has changed
+	if (!strcmp(Device->Service[TOPOLOGY_IDX].SID, UpnpString_get_String(UpnpEvent_get_SID(Event)))) {
+		char *State = XMLGetFirstDocumentItem(VarDoc, "ZoneGroupState", true);
+		TopologyUpdate(Device, State);
+		NFREE(State);
+		pthread_mutex_unlock(&Device->Mutex);
+		return;
+	}
 
-	if ((!Device->Raop && !Device->Master) || !LastChange) {
+	if ((!Device->Raop && !Device->Master) || !XMLParseLastChange(VarDoc, &Change)) {
 		LOG_SDEBUG("no RAOP device (yet) or not change for %s", UpnpString_get_String(UpnpEvent_get_SID(Event)));
 		pthread_mutex_unlock(&Device->Mutex);
-		NFREE(LastChange);
 		return;
 	}
 
+	if (Change.CurrentTrackURI) {
+		LOG_SDEBUG("[%p]: current track %.*s", Device, (int) Change.CurrentTrackURILen, Change.CurrentTrackURI);
+	}
+
 	// Feedback volume to AirPlay controller
-	r = XMLGetChangeItem(VarDoc, "Volume", "channel", "Master", "val");
-	if (r) {
+	if (Change.Volume >= 0) {
 		struct sMR *Master = Device->Master ? Device->Master : Device;
-		double Volume = atoi(r), GroupVolume;
+		double Volume = Change.Volume, GroupVolume;
 		uint32_t now = gettime_ms();
 
 		if (Volume != (int) Device->Volume && now > Master->VolumeStampTx + 1000) {
@@ -449,12 +839,25 @@ static void ProcessEvent(Upnp_EventType EventType, const void *_Event, void *Coo
 			GroupVolume = CalcGroupVolume(Master);
 			LOG_INFO("[%p]: UPnP Volume local change %d:%d (%s)", Device, (int) Volume, (int) GroupVolume, Device->Master ? "slave": "master");
 			Volume = GroupVolume < 0 ? Volume / Device->Config.MaxVolume : GroupVolume / 100;
-			raopsr_notify(Master->Raop, RAOP_VOLUME, &Volume);
+			raopsr_notify(Master->Group ? Master->Group->Raop : Master->Raop, RAOP_VOLUME, &Volume);
 		}
 	}
 
-	NFREE(r);
-	NFREE(LastChange);
+	// transport state from AVTransport (only subscribed when requested) unless proven wrong
+	if (Change.HasTransportState && !Device->Master && Device->EventMismatch < MAX_EVENT_MISMATCH) {
+		enum eMRstate State = Change.TransportState;
+
+		if (!Device->TrustEvents) {
+			LOG_INFO("[%p]: using transport events", Device);
+			Device->StateInterval = Device->Config.PollMin;
+		}
+		Device->TrustEvents = true;
+		Device->EventState = State;
+		_SetTransportState(Device, State);
+
+		// we might have been idle
+		if (State != STOPPED) PollSchedule(Device, 0);
+	}
 
 	pthread_mutex_unlock(&Device->Mutex);
 }
@@ -476,6 +879,9 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 
 			LOG_SDEBUG("[%p]: ac %i %s (cookie %p)", p, EventType, UpnpString_get_String(UpnpActionComplete_get_CtrlUrl(Event)));
 
+			// volume or mute might have a newer value waiting for this one
+			CtrlActionComplete(p, Cookie);
+
 			// If waited action has been completed, proceed to next one if any
 			if (p->WaitCookie) {
 				const char *Resp = XMLGetLocalName(UpnpActionComplete_get_ActionResult(Event), 1);
@@ -486,14 +892,19 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 				if (Cookie != p->WaitCookie) break;
 
 				p->StartCookie = p->WaitCookie;
-				_ProcessQueue(p);
+
+				// nothing queued anymore, so let poller re-acquire state now
+				if (!_ProcessQueue(p)) PollSchedule(p, 0);
 
 				/* when play action has been completed, the state need to be re-acquired because we
 				 * might have missed a state in-between. For example, while seeking there is a very
 				 * stop/play so the STOPPED state will be missed and the PLAYING event will be as
 				 * well. This should not be done for stop/pause actions otherwise we might create a fake STOPPED event state and think
 				 * we stopped when in fact it's just the re-acquisition of current state */
-				if (Resp && !strcasecmp(Resp, "PlayResponse") && p->State == PLAYING) p->State = UNKNOWN;
+				if (Resp && !strcasecmp(Resp, "PlayResponse") && p->State == PLAYING) {
+					p->State = UNKNOWN;
+					p->StatePoll = gettime_ms();
+				}
 
 				break;
 			}
@@ -503,23 +914,38 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 
 			// transport state response
 			if ((r = XMLGetFirstDocumentItem(UpnpActionComplete_get_ActionResult(Event), "CurrentTransportState", true)) != NULL) {
-				if (!strcmp(r, "TRANSITIONING") && p->State != TRANSITIONING) {
-					p->State = TRANSITIONING;
-					LOG_INFO("[%p]: uPNP transition", p);
-				} else if (!strcmp(r, "STOPPED") && p->State != STOPPED) {
-					if (p->RaopState == RAOP_PLAY && !p->ExpectStop) raopsr_notify(p->Raop, RAOP_STOP, NULL);
-					p->State = STOPPED;
-					p->ExpectStop = false;
-					LOG_INFO("[%p]: uPNP stopped", p);
-				} else if (!strcmp(r, "PLAYING") && (p->State != PLAYING)) {
-					p->State = PLAYING;
-					if (p->RaopState != RAOP_PLAY) raopsr_notify(p->Raop, RAOP_PLAY, NULL);
-					LOG_INFO("[%p]: uPNP playing", p);
-				} else if (!strcmp(r, "PAUSED_PLAYBACK") && p->State != PAUSED) {
-					p->State = PAUSED;
-					if (p->RaopState == RAOP_PLAY) raopsr_notify(p->Raop, RAOP_PAUSE, NULL);
-					LOG_INFO("[%p]: uPNP pause", p);
+				enum eMRstate State = String2State(r);
+
+				/*
+				polled state must match what events told us. Each match doubles the
+				polling interval up to its limit, a mismatch brings it back to the
+				minimum and too many of them in a row means events are not trusted
+				*/
+				if (p->TrustEvents && State != TRANSITIONING && p->EventState != TRANSITIONING) {
+					p->StatePolls++;
+					if (State == p->EventState) {
+						p->EventMismatch = 0;
+						p->StateInterval = min(p->StateInterval * 2, p->Config.PollMax);
+					} else {
+						p->StateMismatches++;
+						p->StateInterval = p->Config.PollMin;
+						if (++p->EventMismatch >= MAX_EVENT_MISMATCH) {
+							p->TrustEvents = false;
+							LOG_WARN("[%p]: transport events unreliable, back to polling", p);
+						}
+					}
+					LOG_DEBUG("[%p]: state poll interval %u ms", p, p->StateInterval);
 				}
+
+				_SetTransportState(p, State);
+			}
+
+			NFREE(r);
+
+			// initial volume, requested in background when device was added
+			if (p->Volume < 0 && (r = XMLGetFirstDocumentItem(UpnpActionComplete_get_ActionResult(Event), "CurrentVolume", true)) != NULL) {
+				p->Volume = atoi(r);
+				LOG_INFO("[%p]: initial volume %d", p, (int) p->Volume);
 			}
 
 			NFREE(r);
@@ -549,6 +975,83 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 	return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+static void _SearchSend(const char *Reason) {
+	char SearchTopic[sizeof(MEDIA_RENDERER)+2];
+	int MX = glSearch.Burst ? SEARCH_BURST_MX : SEARCH_MX;
+
+	// cycle through UPnP versions, one per search
+	snprintf(SearchTopic, sizeof(SearchTopic), "%s:%i", MEDIA_RENDERER, (glSearch.Version++ % glMRConfig.UPnPMax) + 1);
+
+	glSearch.Reason = Reason;
+	glSearch.Sent = gettime_ms() / 1000;
+	glSearch.Count++;
+	glSearch.Busy = UpnpSearchAsync(glControlPointHandle, MX, SearchTopic, NULL) == UPNP_E_SUCCESS;
+
+	if (glSearch.Busy) {
+		LOG_INFO("search #%u for %s (%s, mx:%ds, pause:%us)", glSearch.Count, SearchTopic, Reason, MX, glSearch.Interval);
+	} else {
+		LOG_WARN("search #%u for %s (%s) failed, retrying in %us", glSearch.Count, SearchTopic, Reason, SEARCH_MIN);
+		glSearch.Due = glSearch.Sent + SEARCH_MIN;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void SearchRequest(const char *Reason, bool Burst) {
+	pthread_mutex_lock(&glSearch.Mutex);
+
+	// a burst restarts the backoff, an ongoing search will continue it
+	if (Burst) {
+		glSearch.Burst = SEARCH_BURST;
+		glSearch.Interval = SEARCH_MIN;
+	}
+
+	if (!glSearch.Busy && glMainRunning) _SearchSend(Reason);
+	else if (Burst) glSearch.Reason = Reason;
+
+	pthread_mutex_unlock(&glSearch.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void SearchChanged(void) {
+	pthread_mutex_lock(&glSearch.Mutex);
+	glSearch.Changed = true;
+	pthread_mutex_unlock(&glSearch.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void SearchDone(void) {
+	uint32_t now = gettime_ms() / 1000;
+
+	pthread_mutex_lock(&glSearch.Mutex);
+	glSearch.Busy = false;
+
+	if (glSearch.Burst && --glSearch.Burst) {
+		_SearchSend(glSearch.Reason);
+	} else {
+		// new or lost players keep searches frequent, otherwise back off
+		if (glSearch.Changed) glSearch.Interval = SEARCH_MIN;
+		else glSearch.Interval = min(glSearch.Interval * 2, SEARCH_MAX);
+		glSearch.Changed = false;
+		glSearch.Due = now + glSearch.Interval;
+	}
+
+	pthread_mutex_unlock(&glSearch.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void SearchTick(void) {
+	pthread_mutex_lock(&glSearch.Mutex);
+	if (!glSearch.Busy && (int32_t) (gettime_ms() / 1000 - glSearch.Due) >= 0) _SearchSend("interval");
+	pthread_mutex_unlock(&glSearch.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static uint32_t SearchPresence(void) {
+	// a player can miss one search without being removed
+	return max(PRESENCE_TIMEOUT, 2 * (glSearch.Interval + SEARCH_MX) + SEARCH_MX);
+}
+
 /*----------------------------------------------------------------------------*/
 int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) {
 	// this variable is not thread_safe and not supposed to be
@@ -561,44 +1064,30 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) {
 	recurse++;
 
 	switch ( EventType ) {
-		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE:
-			// probably not needed now as the search happens often enough and alive comes from many other devices
+		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE: {
+			// searches can be far apart so known players refresh their presence, others are just noise
+			const char *Location = UpnpString_get_String(UpnpDiscovery_get_Location(_Event));
+			if (DescURL2Device(Location)) QueueUpdate(DISCOVERY, Location);
 			break;
+		}
 		case UPNP_DISCOVERY_SEARCH_RESULT: {
-			tUpdate *Update = malloc(sizeof(tUpdate));
-
-			Update->Type = DISCOVERY;
-			Update->Data = strdup(UpnpString_get_String(UpnpDiscovery_get_Location(_Event)));
-			queue_insert(&glUpdateQueue, Update);
-			pthread_cond_signal(&glUpdateCond);
+			const char *Location = UpnpString_get_String(UpnpDiscovery_get_Location(_Event));
 
+			// reject by UDN or address before anything is downloaded (Sonos group announces are not players)
+			if (strstr(Location, "group_description") ||
+				!FilterPeer(UpnpString_get_String(UpnpDiscovery_get_DeviceID(_Event)), Location)) {
+				QueueUpdate(DISCOVERY, Location);
+			}
 			break;
 		}
-		case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE: {
-			tUpdate *Update = malloc(sizeof(tUpdate));
-
-			Update->Type = BYE_BYE;
-			Update->Data = strdup(UpnpString_get_String(UpnpDiscovery_get_DeviceID(_Event)));
-			queue_insert(&glUpdateQueue, Update);
-			pthread_cond_signal(&glUpdateCond);
-
+		case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE:
+			QueueUpdate(BYE_BYE, UpnpString_get_String(UpnpDiscovery_get_DeviceID(_Event)));
 			break;
-		}
 		case UPNP_DISCOVERY_SEARCH_TIMEOUT: {
-			tUpdate *Update = malloc(sizeof(tUpdate));
-
-			Update->Type = SEARCH_TIMEOUT;
-			Update->Data = NULL;
-			queue_insert(&glUpdateQueue, Update);
-			pthread_cond_signal(&glUpdateCond);
+			QueueUpdate(SEARCH_TIMEOUT, NULL);
 
 			// if there is a cookie, it's a targeted Sonos search
-			if (!Cookie) {
-				static int Version;
-				char SearchTopic[sizeof(MEDIA_RENDERER)+2];
-				snprintf(SearchTopic, sizeof(SearchTopic), "%s:%i", MEDIA_RENDERER, (Version++ % glMRConfig.UPnPMax) + 1);
-				UpnpSearchAsync(glControlPointHandle, DISCOVERY_TIME, SearchTopic, NULL);
-			}
+			if (!Cookie) SearchDone();
 
 			break;
 		}
@@ -613,10 +1102,20 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) {
 			if (!CheckAndLock(Device)) break;
 
 			s = EventURL2Service(UpnpEventSubscribe_get_PublisherUrl(_Event), Device->Service);
+
+			// cached topology is not refreshed by events anymore, re-claim household
+			if (s == Device->Service + TOPOLOGY_IDX) {
+				IndexSID(Device, s, "");
+				TopologyUnsubscribed(Device);
+				if (!TopologySubscribe(Device)) s = NULL;
+			}
+
 			if (s != NULL) {
 				UpnpSubscribeAsync(glControlPointHandle, s->EventURL, s->TimeOut,
 								   MasterHandler, (void*) strdup(Device->UDN));
 				LOG_INFO("[%p]: Auto-renewal failed, re-subscribing", Device);
+				// poll state until events come back
+				if (s == Device->Service + AVT_SRV_IDX) Device->TrustEvents = false;
 			}
 
 			pthread_mutex_unlock(&Device->Mutex);
@@ -636,7 +1135,7 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) {
 			if (s != NULL) {
 				if (UpnpEventSubscribe_get_ErrCode(_Event) == UPNP_E_SUCCESS) {
 					s->Failed = 0;
-					strcpy(s->SID, UpnpString_get_String(UpnpEventSubscribe_get_SID(_Event)));
+					IndexSID(Device, s, UpnpString_get_String(UpnpEventSubscribe_get_SID(_Event)));
 					s->TimeOut = UpnpEventSubscribe_get_TimeOut(_Event);
 					LOG_INFO("[%p]: subscribe success", Device);
 				} else if (s->Failed++ < 3) {
@@ -645,6 +1144,8 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) {
 									   MasterHandler, (void*) strdup(Device->UDN));
 				} else {
 					LOG_WARN("[%p]: subscribe fail, volume feedback will not work", Device);
+					// let another player of the household have a go
+					if (s == Device->Service + TOPOLOGY_IDX) TopologyUnsubscribed(Device);
 				}
 			}
 
@@ -673,6 +1174,123 @@ static void FreeUpdate(void *_Item) {
 	free(Item);
 }
 
+/*----------------------------------------------------------------------------*/
+static void QueueUpdate(int Type, const char *Data) {
+	uint32_t Hash = Data ? hash32((char*) Data) : Type;
+	tUpdate *Update;
+
+	pthread_mutex_lock(&glUpdateMutex);
+
+	for (Update = glUpdates.Buckets[Hash % UPDATE_BUCKETS]; Update; Update = Update->Next) {
+		if (Update->Type == Type && Update->Hash == Hash && (!Data || !strcmp(Update->Data, Data))) break;
+	}
+
+	if (Update) {
+		glUpdates.Coalesced++;
+	} else {
+		Update = malloc(sizeof(tUpdate));
+		Update->Type = Type;
+		Update->Data = Data ? strdup(Data) : NULL;
+		Update->Hash = Hash;
+		Update->Next = glUpdates.Buckets[Hash % UPDATE_BUCKETS];
+		glUpdates.Buckets[Hash % UPDATE_BUCKETS] = Update;
+
+		glUpdates.Queued++;
+		if (++glUpdates.Depth > glUpdates.MaxDepth) glUpdates.MaxDepth = glUpdates.Depth;
+
+		queue_insert(&glUpdateQueue, Update);
+		pthread_cond_signal(&glUpdateCond);
+	}
+
+	pthread_mutex_unlock(&glUpdateMutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static tUpdate *NextUpdate(void) {
+	tUpdate *Update, **p;
+
+	pthread_mutex_lock(&glUpdateMutex);
+
+	// once out of the chain, an identical update can be queued again
+	if ((Update = queue_extract(&glUpdateQueue)) != NULL) {
+		for (p = &glUpdates.Buckets[Update->Hash % UPDATE_BUCKETS]; *p != Update; p = &(*p)->Next);
+		*p = Update->Next;
+		glUpdates.Depth--;
+	}
+
+	pthread_mutex_unlock(&glUpdateMutex);
+
+	return Update;
+}
+
+/*----------------------------------------------------------------------------*/
+static void PresenceSweep(uint32_t now) {
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false), n = 0, Removed = 0;
+	uint32_t Start = gettime_ms();
+	char **URL = malloc(Count * sizeof(char*));
+	int *Alive = malloc(Count * sizeof(int));
+
+	// keep only suspects, leaving ones are not even probed
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
+		if (Device->Running && (Device->ErrorCount < 0 || Device->ErrorCount > MAX_ACTION_ERRORS ||
+			(Device->State == STOPPED && now - Device->LastSeen > SearchPresence()))) {
+			URL[n] = Device->Leaving ? NULL : Device->DescDocURL;
+			Devices[n++] = Device;
+		}
+	}
+
+	LOG_DEBUG("Presence checking %d/%d", n, Count);
+
+	if (n) SoapProbe(URL, Alive, n, PRESENCE_DEADLINE);
+
+	// apply all results now that the probes are done
+	for (int i = 0; i < n; i++) {
+		struct sMR *Device = Devices[i];
+
+		// we cannot probe that URL ourselves, so let libupnp do it (slow)
+		if (Alive[i] < 0) {
+			IXML_Document* DescDoc = NULL;
+			Alive[i] = UpnpDownloadXmlDoc(URL[i], &DescDoc) == UPNP_E_SUCCESS;
+			if (DescDoc) ixmlDocument_free(DescDoc);
+		}
+
+		if (!CheckAndLock(Device)) continue;
+
+		if (!Alive[i]) {
+			LOG_INFO("[%p]: removing unresponsive player (%s)", Device, Device->Config.Name);
+			raopsr_delete(Device->Raop);
+			// device's mutex returns unlocked
+			DelMRDevice(Device);
+			Removed++;
+		} else {
+			// device is in trouble, but let's renew grace period
+			Device->LastSeen = now;
+			Device->Leaving = false;
+			Device->ErrorCount = 0;
+			LOG_INFO("[%p]: %s mute to discovery, but answers UPnP, so keep it", Device, Device->Config.Name);
+			pthread_mutex_unlock(&Device->Mutex);
+		}
+	}
+
+	if (Removed) {
+		SearchChanged();
+		if (*glSnapshotName) SaveSnapshotLater(glSnapshotName);
+	}
+
+	glPresence.Sweeps++;
+	glPresence.Probed += n;
+	glPresence.Removed += Removed;
+	glPresence.Last = gettime_ms() - Start;
+	glPresence.Max = max(glPresence.Max, glPresence.Last);
+	if (n) LOG_INFO("presence sweep of %d player(s) took %u ms, %d removed", n, glPresence.Last, Removed);
+
+	free(Alive);
+	free(URL);
+	free(Devices);
+}
+
 /*----------------------------------------------------------------------------*/
 static void *UpdateThread(void *args) {
 	while (glMainRunning) {
@@ -680,40 +1298,16 @@ static void *UpdateThread(void *args) {
 		bool Updated = false;
 
 		pthread_mutex_lock(&glUpdateMutex);
-		pthread_cond_wait(&glUpdateCond, &glUpdateMutex);
+		if (!glUpdates.Depth) pthread_cond_wait(&glUpdateCond, &glUpdateMutex);
 		pthread_mutex_unlock(&glUpdateMutex);
 
-		for (; glMainRunning && (Update = queue_extract(&glUpdateQueue)) != NULL; queue_free_item(&glUpdateQueue, Update)) {
+		for (; glMainRunning && (Update = NextUpdate()) != NULL; queue_free_item(&glUpdateQueue, Update)) {
 			struct sMR *Device;
 			uint32_t now = gettime_ms() / 1000;
 
 			// UPnP end of search timer
 			if (Update->Type == SEARCH_TIMEOUT) {
-
-				LOG_DEBUG("Presence checking", NULL);
-
-				for (int i = 0; i < glMaxDevices; i++) {
-					Device = glMRDevices + i;
-					if (Device->Running && (Device->ErrorCount < 0 || Device->ErrorCount > MAX_ACTION_ERRORS ||
-						(Device->State == STOPPED && now - Device->LastSeen > PRESENCE_TIMEOUT))) {
-						// if device does not answer, try to download its DescDoc
-						IXML_Document* DescDoc = NULL;
-						if (Device->Leaving || UpnpDownloadXmlDoc(Device->DescDocURL, &DescDoc) != UPNP_E_SUCCESS) {
-							pthread_mutex_lock(&Device->Mutex);
-							LOG_INFO("[%p]: removing unresponsive player (%s)", Device, Device->Config.Name);
-							raopsr_delete(Device->Raop);
-							// device's mutex returns unlocked
-							DelMRDevice(Device);
-						} else {
-							// device is in trouble, but let's renew grace period
-							Device->LastSeen = now;
-							Device->Leaving = false;
-							Device->ErrorCount = 0;
-							LOG_INFO("[%p]: %s mute to discovery, but answers UPnP, so keep it", Device, Device->Config.Name);
-						}
-						if (DescDoc) ixmlDocument_free(DescDoc);
-					}
-				}
+				PresenceSweep(now);
 
 			// device removal request
 			} else if (Update->Type == BYE_BYE) {
@@ -722,156 +1316,619 @@ static void *UpdateThread(void *args) {
 				if (!CheckAndLock(Device)) continue;
 
 				// some stack sends (many) bye-bye when their SSDP stack restarts, try to search again 
-				if (!Device->Leaving) {
+				bool Leaving = !Device->Leaving;
+				if (Leaving) {
 					LOG_INFO("[%p]: renderer <%s> bye-bye, doing a targeted search", Device, Device->Config.Name);
-					Device->LastSeen = now - PRESENCE_TIMEOUT + BYE_TIMEOUT - 1;
+					Device->LastSeen = now - SearchPresence() + BYE_TIMEOUT - 1;
 					Device->Leaving = true;
 					UpnpSearchAsync(glControlPointHandle, BYE_TIMEOUT, Device->UDN, Device);
 				}
 
 				pthread_mutex_unlock(&Device->Mutex);
 
+				// it might come back with another address, so look around quickly
+				if (Leaving) SearchRequest("bye-bye", true);
+
 			// device keepalive or search response
 			} else if (Update->Type == DISCOVERY) {
 				IXML_Document *DescDoc = NULL;
-				char *UDN = NULL, *ModelName = NULL, *ModelNumber = NULL;
 
 				// it's a Sonos group announce, just do a targeted search and exit
 				if (strstr(Update->Data, "group_description")) {
-					for (int i = 0; i < glMaxDevices; i++) {
-   						Device = glMRDevices + i;
+					struct sMR **Devices;
+					int Count = RegistryList(&Devices, false);
+
+					TopologyInvalidate();
+					for (int i = 0; i < Count; i++) {
+						Device = Devices[i];
 						if (Device->Running && *Device->Service[TOPOLOGY_IDX].ControlURL)
 							UpnpSearchAsync(glControlPointHandle, 5, Device->UDN, Device);
 					}
+
+					free(Devices);
 					continue;
 				}
 
 				// existing device ?
-				for (int i = 0; i < glMaxDevices; i++) {
-					Device = glMRDevices + i;
-					if (Device->Running && !strcmp(Device->DescDocURL, Update->Data)) {
-						char *friendlyName = NULL;
-						struct sMR *Master = GetMaster(Device, &friendlyName);
-
-						Device->LastSeen = now;
-						Device->Leaving = false;
-						LOG_DEBUG("[%p] UPnP keep alive: %s", Device, Device->Config.Name);
-
-						// check for name change
-						UpnpDownloadXmlDoc(Update->Data, &DescDoc);
-						if (!friendlyName) friendlyName = XMLGetFirstDocumentItem(DescDoc, "friendlyName", true);
-
-						if (friendlyName && strcmp(friendlyName, Device->friendlyName)) {
-							char* autoName = NULL;
-							(void)!asprintf(&autoName, glNameFormat, Device->friendlyName);
-							if (!strcmp(autoName, Device->Config.Name)) {
-								LOG_INFO("[%p]: Device name change %s %s", Device, friendlyName, Device->friendlyName);
-								strcpy(Device->friendlyName, friendlyName);
-								sprintf(Device->Config.Name, glNameFormat, friendlyName);
-								raopsr_update(Device->Raop, Device->Config.Name, "airupnp");
-								Updated = true;
+				if ((Device = DescURL2Device(Update->Data)) != NULL && Device->Running) {
+					char *friendlyName = NULL;
+					struct sMR *Master = GetMaster(Device, &friendlyName);
+
+					Device->LastSeen = now;
+					Device->Leaving = Device->Restored = false;
+					LOG_DEBUG("[%p] UPnP keep alive: %s", Device, Device->Config.Name);
+
+					// household has lost its topology subscriber, take over
+					if (Device->Service[TOPOLOGY_IDX].TimeOut && TopologySubscribe(Device)) {
+						UpnpSubscribeAsync(glControlPointHandle, Device->Service[TOPOLOGY_IDX].EventURL,
+										   Device->Service[TOPOLOGY_IDX].TimeOut, MasterHandler,
+										   (void*) strdup(Device->UDN));
+					}
+
+					/*
+					check for name change, but description is only downloaded once its
+					TTL has expired and only parsed if its content has changed
+					*/
+					if (!friendlyName && now - Device->DescStamp > DESC_TTL) {
+						char *Body = NULL, ContentType[LINE_SIZE];
+
+						Device->DescStamp = now;
+						if (UpnpDownloadUrlItem(Update->Data, &Body, ContentType) == UPNP_E_SUCCESS) {
+							uint32_t Hash = hash32(Body);
+							if (Hash != Device->DescHash && (DescDoc = ixmlParseBuffer(Body)) != NULL) {
+								LOG_DEBUG("[%p]: description has changed", Device);
+								Device->DescHash = Hash;
+								friendlyName = XMLGetFirstDocumentItem(DescDoc, "friendlyName", true);
 							}
-							NFREE(autoName);
 						}
+						NFREE(Body);
+					}
 
-						// we are a master (or not a Sonos)
-						if (!Master && Device->Master) {
-							// slave becoming master again
-							LOG_INFO("[%p]: Sonos %s is now master", Device, Device->Config.Name);
-							pthread_mutex_lock(&Device->Mutex);
-							Device->Master = NULL;
-							Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
-								   "airupnp", Device->Config.mac, Device->Config.Codec,
-								   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
-								   Device->Config.Latency, Device,
-								   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
-								   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
-							pthread_mutex_unlock(&Device->Mutex);
-						} else if (Master && (!Device->Master || Device->Master == Device)) {
-							pthread_mutex_lock(&Device->Mutex);
-							LOG_INFO("[%p]: Sonos %s is now slave", Device, Device->Config.Name);
-							Device->Master = Master;
-							raopsr_delete(Device->Raop);
-							Device->Raop = NULL;
-							pthread_mutex_unlock(&Device->Mutex);
+					if (friendlyName && strcmp(friendlyName, Device->friendlyName)) {
+						char* autoName = NULL;
+						(void)!asprintf(&autoName, glNameFormat, Device->friendlyName);
+						if (!strcmp(autoName, Device->Config.Name)) {
+							LOG_INFO("[%p]: Device name change %s %s", Device, friendlyName, Device->friendlyName);
+							strcpy(Device->friendlyName, friendlyName);
+							sprintf(Device->Config.Name, glNameFormat, friendlyName);
+							raopsr_update(Device->Raop, Device->Config.Name, "airupnp");
+							Updated = true;
 						}
+						NFREE(autoName);
+					}
 
-						NFREE(friendlyName);
-						goto cleanup;
+					// we are a master (or not a Sonos)
+					if (!Master && Device->Master) {
+						// slave becoming master again
+						LOG_INFO("[%p]: Sonos %s is now master", Device, Device->Config.Name);
+						pthread_mutex_lock(&Device->Mutex);
+						Device->Master = NULL;
+						Updated = true;
+						Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+							   "airupnp", Device->Config.mac, Device->Config.Codec,
+							   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
+							   Device->Config.Latency, Device,
+							   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
+							   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
+						pthread_mutex_unlock(&Device->Mutex);
+					} else if (Master && (!Device->Master || Device->Master == Device)) {
+						pthread_mutex_lock(&Device->Mutex);
+						LOG_INFO("[%p]: Sonos %s is now slave", Device, Device->Config.Name);
+						Device->Master = Master;
+						Updated = true;
+						raopsr_delete(Device->Raop);
+						Device->Raop = NULL;
+						pthread_mutex_unlock(&Device->Mutex);
 					}
-				}
 
-				// this can take a very long time, too bad for the queue...
-				int rc;
-				if ((rc = UpnpDownloadXmlDoc(Update->Data, &DescDoc)) != UPNP_E_SUCCESS) {
-					LOG_DEBUG("Error obtaining description %s -- error = %d\n", Update->Data, rc);
+					NFREE(friendlyName);
 					goto cleanup;
 				}
 
-				// not a media renderer but maybe a Sonos group update
-				if (!XMLMatchDocumentItem(DescDoc, "deviceType", MEDIA_RENDERER, false)) {
-					goto cleanup;
+				// this can take a very long time, so let a worker do it
+				DescPoolSubmit(Update->Data);
+
+cleanup:
+				if (Updated && (glAutoSaveConfigFile || glDiscovery)) {
+					SaveConfigLater(glConfigName, &glConfigID);
 				}
 
-				ModelName = XMLGetFirstDocumentItem(DescDoc, "modelName", true);
-				ModelNumber = XMLGetFirstDocumentItem(DescDoc, "modelNumber", true);
-				UDN = XMLGetFirstDocumentItem(DescDoc, "UDN", true);
+				if (Updated && *glSnapshotName) SaveSnapshotLater(glSnapshotName);
 
-				// excluded device
-				if (isExcluded(ModelName, ModelNumber)) {
-					goto cleanup;
-				}
+				if (DescDoc) ixmlDocument_free(DescDoc);
+			}
+		}
+	}
 
-				// new device so search a free spot - as this function is not called
-				// recursively, no need to lock the device's mutex
-				for (Device = glMRDevices; Device->Running && Device < glMRDevices + glMaxDevices; Device++);
+	return NULL;
+}
 
-				// no more room !
-				if (Device == glMRDevices + glMaxDevices) {
-					LOG_ERROR("Too many uPNP devices (max:%u)", glMaxDevices);
-					goto cleanup;
-				}
-				
-				Updated = true;
-
-				if (AddMRDevice(Device, UDN, DescDoc, Update->Data) && !glDiscovery) {
-					// create a new AirPlay
-					Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
-									   "airupnp", Device->Config.mac, Device->Config.Codec,
-									   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
-									   Device->Config.Latency, Device,
-									   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
-									   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
-					if (!Device->Raop) {
-						LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
-						DelMRDevice(Device);
-					}
-				}
+/*----------------------------------------------------------------------------*/
+static void ProbeDevice(char *Location) {
+	IXML_Document *DescDoc = NULL;
+	char *UDN = NULL, *ModelName = NULL, *ModelNumber = NULL, *Manufacturer = NULL;
+	char *Body = NULL, ContentType[LINE_SIZE];
+	struct sMR *Device;
+	uint32_t Hash;
+	int rc;
+
+	// keep description's hash so that it is not parsed again until it changes
+	if ((rc = UpnpDownloadUrlItem(Location, &Body, ContentType)) != UPNP_E_SUCCESS) {
+		LOG_DEBUG("Error obtaining description %s -- error = %d\n", Location, rc);
+		return;
+	}
 
-cleanup:
-				if (Updated && (glAutoSaveConfigFile || glDiscovery)) {
-					LOG_DEBUG("Updating configuration %s", glConfigName);
-					SaveConfig(glConfigName, glConfigID, false);
-				}
+	Hash = hash32(Body);
+	DescDoc = ixmlParseBuffer(Body);
+	NFREE(Body);
 
-				NFREE(UDN);
-				NFREE(ModelName);
-				NFREE(ModelNumber);
-				if (DescDoc) ixmlDocument_free(DescDoc);
+	if (!DescDoc) {
+		LOG_DEBUG("Error parsing description %s", Location);
+		return;
+	}
+
+	// not a media renderer but maybe a Sonos group update
+	if (!XMLMatchDocumentItem(DescDoc, "deviceType", MEDIA_RENDERER, false)) {
+		goto cleanup;
+	}
+
+	ModelName = XMLGetFirstDocumentItem(DescDoc, "modelName", true);
+	ModelNumber = XMLGetFirstDocumentItem(DescDoc, "modelNumber", true);
+	Manufacturer = XMLGetFirstDocumentItem(DescDoc, "manufacturer", true);
+	UDN = XMLGetFirstDocumentItem(DescDoc, "UDN", true);
+
+	// excluded device
+	if (FilterDevice(UDN, Location, Manufacturer, ModelName, ModelNumber)) {
+		LOG_DEBUG("excluding %s (%s/%s)", Location, ModelName, ModelNumber);
+		goto cleanup;
+	}
+
+	// same player at another address (moved or restored from a stale snapshot)
+	if (UDN && (Device = UDN2Device(UDN)) != NULL && CheckAndLock(Device)) {
+		char *Former = strdup(Device->DescDocURL);
+		bool Moved = strcmp(Former, Location), Playing = Device->RaopState == RAOP_PLAY;
+		bool Restored = Device->Restored, Replaced = false;
+		int Alive = 0;
+
+		if (!Moved) Device->Restored = false;
+		pthread_mutex_unlock(&Device->Mutex);
+
+		/*
+		 a multi-homed player answers at several addresses, so it is only replaced
+		 if it is an unconfirmed snapshot or if its former address is silent, and
+		 never while it plays. Probe is done unlocked as it can take a while
+		*/
+		if (Moved && !Playing && !Restored) {
+			SoapProbe(&Former, &Alive, 1, PRESENCE_DEADLINE);
+			// we cannot probe that URL ourselves, so let libupnp do it (slow)
+			if (Alive < 0) {
+				IXML_Document* FormerDoc = NULL;
+				Alive = UpnpDownloadXmlDoc(Former, &FormerDoc) == UPNP_E_SUCCESS;
+				if (FormerDoc) ixmlDocument_free(FormerDoc);
 			}
 		}
+
+		if (Moved && !Playing && !Alive && CheckAndLock(Device)) {
+			// it might have changed while we were probing
+			if (!strcmp(Device->DescDocURL, Former) && Device->RaopState != RAOP_PLAY) {
+				LOG_INFO("[%p]: %s has moved to %s", Device, Device->Config.Name, Location);
+				raopsr_delete(Device->Raop);
+				// device's mutex returns unlocked
+				DelMRDevice(Device);
+				Replaced = true;
+			} else pthread_mutex_unlock(&Device->Mutex);
+		} else if (Moved) {
+			LOG_DEBUG("[%p]: %s also answers at %s", Device, Device->Config.Name, Location);
+		}
+
+		free(Former);
+		if (!Replaced) goto cleanup;
+	}
+
+	// new device so get a slot whose mutex is held until it is set
+	if ((Device = RegistryAcquire()) == NULL) {
+		LOG_ERROR("Too many uPNP devices (max:%u)", glMaxDevices);
+		goto cleanup;
+	}
+
+	if (!AddMRDevice(Device, UDN, DescDoc, Location, NULL)) {
+		// disabled player never went live
+		if (!Device->Running) RegistryRelease(Device);
+	} else if (!glDiscovery) {
+		// create a new AirPlay
+		pthread_mutex_lock(&glCommitMutex);
+		Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+						   "airupnp", Device->Config.mac, Device->Config.Codec,
+						   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
+						   Device->Config.Latency, Device,
+						   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
+						   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
+		pthread_mutex_unlock(&glCommitMutex);
+		if (!Device->Raop) {
+			LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+			// device's mutex returns unlocked
+			DelMRDevice(Device);
+			Device = NULL;
+		}
+	}
+
+	// a new player (even a slave) means the network has not settled yet
+	if (Device && Device->Running) {
+		Device->DescHash = Hash;
+		SearchChanged();
+	}
+	if (Device) pthread_mutex_unlock(&Device->Mutex);
+
+	if (glAutoSaveConfigFile || glDiscovery) {
+		SaveConfigLater(glConfigName, &glConfigID);
+	}
+
+	if (*glSnapshotName) SaveSnapshotLater(glSnapshotName);
+
+cleanup:
+	NFREE(UDN);
+	NFREE(ModelName);
+	NFREE(ModelNumber);
+	NFREE(Manufacturer);
+	ixmlDocument_free(DescDoc);
+}
+
+/*----------------------------------------------------------------------------*/
+static void *DescWorker(void *args) {
+	pthread_mutex_lock(&glDescPool.Mutex);
+
+	while (glDescPool.Running) {
+		char *Location;
+		int i;
+
+		// oldest request that nobody is working on yet
+		for (i = 0; i < glDescPool.Count && glDescPool.Pending[i].Busy; i++);
+
+		if (i == glDescPool.Count) {
+			pthread_cond_wait(&glDescPool.Cond, &glDescPool.Mutex);
+			continue;
+		}
+
+		glDescPool.Pending[i].Busy = true;
+		Location = glDescPool.Pending[i].URL;
+		pthread_mutex_unlock(&glDescPool.Mutex);
+
+		ProbeDevice(Location);
+
+		// entries might have moved while we were away
+		pthread_mutex_lock(&glDescPool.Mutex);
+		for (i = 0; glDescPool.Pending[i].URL != Location; i++);
+		memmove(glDescPool.Pending + i, glDescPool.Pending + i + 1, (--glDescPool.Count - i) * sizeof(glDescPool.Pending[0]));
+		free(Location);
+
+		// a newer probe might be waiting for its turn to publish
+		pthread_cond_broadcast(&glDescPool.Cond);
 	}
 
+	pthread_mutex_unlock(&glDescPool.Mutex);
+
 	return NULL;
 }
 
+/*----------------------------------------------------------------------------*/
+static void DescPoolSubmit(char *Location) {
+	int i;
+
+	pthread_mutex_lock(&glDescPool.Mutex);
+
+	for (i = 0; i < glDescPool.Count && strcmp(glDescPool.Pending[i].URL, Location); i++);
+
+	if (i != glDescPool.Count) {
+		LOG_SDEBUG("description %s already pending", Location);
+	} else if (glDescPool.Count == DESC_PENDING) {
+		LOG_WARN("too many pending descriptions, ignoring %s", Location);
+	} else {
+		glDescPool.Pending[glDescPool.Count].URL = strdup(Location);
+		glDescPool.Pending[glDescPool.Count++].Busy = false;
+		pthread_cond_signal(&glDescPool.Cond);
+	}
+
+	pthread_mutex_unlock(&glDescPool.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void DescPoolTurn(const char *Location) {
+	pthread_mutex_lock(&glDescPool.Mutex);
+
+	/*
+	Probes run concurrently but players are published in discovery order, so
+	wait until every older request is done. Those are all being processed (the
+	oldest is always picked first) and none of them needs what we hold
+	*/
+	while (glDescPool.Running) {
+		int i;
+		for (i = 0; i < glDescPool.Count && glDescPool.Pending[i].URL != Location; i++);
+		if (!i || i == glDescPool.Count) break;
+		pthread_cond_wait(&glDescPool.Cond, &glDescPool.Mutex);
+	}
+
+	pthread_mutex_unlock(&glDescPool.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void DescPoolInit(void) {
+	glDescPool.Running = true;
+	glDescPool.Count = 0;
+	pthread_mutex_init(&glDescPool.Mutex, 0);
+	pthread_cond_init(&glDescPool.Cond, 0);
+	for (int i = 0; i < DESC_WORKERS; i++) pthread_create(glDescPool.Thread + i, NULL, &DescWorker, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+static void DescPoolEnd(void) {
+	pthread_mutex_lock(&glDescPool.Mutex);
+	glDescPool.Running = false;
+	pthread_cond_broadcast(&glDescPool.Cond);
+	pthread_mutex_unlock(&glDescPool.Mutex);
+
+	// workers might be stuck in a download, nothing to do but wait
+	for (int i = 0; i < DESC_WORKERS; i++) pthread_join(glDescPool.Thread[i], NULL);
+
+	while (glDescPool.Count) free(glDescPool.Pending[--glDescPool.Count].URL);
+	pthread_mutex_destroy(&glDescPool.Mutex);
+	pthread_cond_destroy(&glDescPool.Cond);
+}
+
+/*----------------------------------------------------------------------------*/
+static void ApplyMRConfig(struct sMR *Device, tMRConfig *Config) {
+	// name and mac are computed at discovery unless forced by config
+	if (!*Config->Name) strcpy(Config->Name, Device->Config.Name);
+	if (!memcmp(Config->mac, "\0\0\0\0\0\0", 6)) memcpy(Config->mac, Device->Config.mac, 6);
+	if (Config->PollMax < Config->PollMin) Config->PollMax = Config->PollMin;
+
+	// codec policy might have changed, sink list has not
+	const char *Reason = CodecNegotiate(Device->Sink, Config->CodecPolicy, Config->Codec);
+	if (strcmp(Config->Codec, Device->Config.Codec)) LOG_INFO("[%p]: codec is now %s (%s)", Device, Config->Codec, Reason);
+
+	// these are given to the AirPlay instance at creation
+	bool Rebuild = strcmp(Config->Name, Device->Config.Name) || memcmp(Config->mac, Device->Config.mac, 6) ||
+				   strcmp(Config->Codec, Device->Config.Codec) || strcmp(Config->Latency, Device->Config.Latency) ||
+				   Config->Metadata != Device->Config.Metadata || Config->Drift != Device->Config.Drift ||
+				   Config->Flush != Device->Config.Flush || Config->HTTPLength != Device->Config.HTTPLength;
+
+	memcpy(&Device->Config, Config, sizeof(tMRConfig));
+
+	// everything else is read on the fly
+	Device->StateInterval = max(min(Device->StateInterval, Config->PollMax), Config->PollMin);
+	Device->MetaData.artwork = *Device->Config.ArtWork ? Device->Config.ArtWork : NULL;
+	SetProtocolInfo(Device);
+
+	// slaves have no AirPlay instance
+	if (Rebuild && Device->Raop) {
+		LOG_INFO("[%p]: re-creating AirPlay instance (%s)", Device, Device->Config.Name);
+		raopsr_delete(Device->Raop);
+		if (Device->RaopState == RAOP_PLAY || Device->Chained) {
+			AVTStop(Device);
+			Device->ExpectStop = true;
+			Device->Chained = false;
+		}
+		Device->RaopState = RAOP_STOP;
+		Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+						   "airupnp", Device->Config.mac, Device->Config.Codec,
+						   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
+						   Device->Config.Latency, Device,
+						   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
+						   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
+		if (!Device->Raop) LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void ReloadConfig(void) {
+	tMRConfig Common;
+	struct sMR **Devices;
+
+	// start again from defaults (common section is optional)
+	memcpy(&Common, &glMRDefaults, sizeof(tMRConfig));
+
+	pthread_mutex_lock(&glCommitMutex);
+	void *Doc = LoadConfig(glConfigName, &Common);
+	if (Doc) {
+		// command line still overrides config file
+		PlayerArgs(&Common);
+		FreeConfig(glConfigID);
+		glConfigID = Doc;
+		memcpy(&glMRConfig, &Common, sizeof(tMRConfig));
+	}
+	pthread_mutex_unlock(&glCommitMutex);
+
+	if (!Doc) {
+		LOG_WARN("cannot reload configuration %s, keeping current one", glConfigName);
+		return;
+	}
+
+	LOG_INFO("configuration %s changed, updating players", glConfigName);
+
+	int Count = RegistryList(&Devices, false);
+
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
+		tMRConfig Config;
+
+		// devices that do not have a <device> section might still see <common> changes
+		pthread_mutex_lock(&glCommitMutex);
+		memcpy(&Config, &glMRConfig, sizeof(tMRConfig));
+		LoadMRConfig(glConfigID, Device->UDN, &Config);
+		pthread_mutex_unlock(&glCommitMutex);
+
+		// sink list has not been read under fixed policy, do it unlocked
+		char *Sink = NULL;
+		if (strcasecmp(Config.CodecPolicy, "fixed") && !Device->Sink && *Device->Service[CNX_MGR_IDX].ControlURL) {
+			Sink = GetProtocolInfo(Device);
+		}
+
+		if (!CheckAndLock(Device)) {
+			NFREE(Sink);
+			continue;
+		}
+
+		if (Sink && !Device->Sink) Device->Sink = Sink;
+		else NFREE(Sink);
+
+		if (!Config.Enabled) {
+			LOG_INFO("[%p]: removing disabled player (%s)", Device, Device->Config.Name);
+			raopsr_delete(Device->Raop);
+			// device's mutex returns unlocked
+			DelMRDevice(Device);
+			continue;
+		}
+
+		ApplyMRConfig(Device, &Config);
+		pthread_mutex_unlock(&Device->Mutex);
+	}
+
+	free(Devices);
+}
+
+/*----------------------------------------------------------------------------*/
+static void Rebind(void) {
+	struct sMR **Devices;
+	char addr[128] = "", *iface = NULL;
+	int rc, Count;
+
+	// update thread and discovery workers use libupnp, so park them
+	glMainRunning = false;
+	pthread_cond_signal(&glUpdateCond);
+	pthread_join(glUpdateThread, NULL);
+	DescPoolEnd();
+
+	// so does the poller, and it must not run while players are reset
+	PollPause(true);
+
+	// players only lose what is bound to our address
+	Count = RegistryList(&Devices, false);
+
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
+		if (!CheckAndLock(Device)) continue;
+
+		if (Device->Raop) {
+			raopsr_delete(Device->Raop);
+			Device->Raop = NULL;
+			if (Device->RaopState == RAOP_PLAY || Device->Chained) {
+				AVTStop(Device);
+				Device->ExpectStop = true;
+				Device->Chained = false;
+			}
+			Device->RaopState = RAOP_STOP;
+		}
+
+		// subscriptions are tied to our callback URL, poll until they are back
+		for (int j = 0; j < NB_SRV; j++) {
+			IndexSID(Device, Device->Service + j, "");
+			Device->Service[j].Failed = 0;
+		}
+		TopologyUnsubscribed(Device);
+		Device->TrustEvents = false;
+
+		pthread_mutex_unlock(&Device->Mutex);
+	}
+
+	// groups are bound to our address as well
+	GroupsEnd();
+
+	// keep-alive connections use the old address and their fallback uses libupnp
+	SoapPause(true);
+
+	mdnsd_stop(glmDNSServer);
+	http_pico_close();
+	UpnpUnRegisterClient(glControlPointHandle);
+	UpnpFinish();
+
+	// sscanf does not capture empty strings
+	if (!strchr(glBinding, '?')) sscanf(glBinding, "%[^:]", addr);
+	glHost = get_interface(addr, &iface, NULL);
+
+	rc = UpnpInit2(iface, glPort);
+	LOG_INFO("Re-binding to iface %s:%hu [%s]", inet_ntoa(glHost), glPort, iface);
+	NFREE(iface);
+
+	if (rc == UPNP_E_SUCCESS) {
+		UpnpSetMaxContentLength(60000);
+		glPort = UpnpGetServerPort();
+		rc = UpnpRegisterClient(MasterHandler, NULL, &glControlPointHandle);
+	}
+
+	if (rc != UPNP_E_SUCCESS) LOG_ERROR("UPnP re-bind in %s failed: %d", inet_ntoa(glHost), rc);
+
+	glPicoPort = glPortBase;
+	http_pico_init(glHost, &glPicoPort, glPicoPort ? glPortRange : 1);
+
+	char hostname[STR_LEN];
+	gethostname(hostname, sizeof(hostname));
+	strcat(hostname, ".local");
+	if ((glmDNSServer = mdnsd_start(glHost, false)) != NULL) mdnsd_set_hostname(glmDNSServer, hostname, glHost);
+	else LOG_ERROR("cannot start mDNS server on %s", inet_ntoa(glHost));
+
+	glMainRunning = true;
+	pthread_create(&glUpdateThread, NULL, &UpdateThread, NULL);
+	DescPoolInit();
+
+	// AirPlay instances and subscriptions come back on the new address
+	for (int i = 0; i < Count; i++) {
+		struct sMR *Device = Devices[i];
+		if (!CheckAndLock(Device)) continue;
+
+		/*
+		whatever was queued or in flight (including the stop above) died with the
+		old libupnp and SOAP connections, so nothing is waited for anymore
+		*/
+		AVTActionFlush(Device);
+		Device->WaitCookie = Device->StartCookie = NULL;
+		Device->VolumeSlot.Busy = Device->MuteSlot.Busy = false;
+		Device->VolumeSlot.Pending = Device->MuteSlot.Pending = -1;
+
+		if (!Device->Master && glmDNSServer) {
+			pthread_mutex_lock(&glCommitMutex);
+			Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+							   "airupnp", Device->Config.mac, Device->Config.Codec,
+							   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
+							   Device->Config.Latency, Device,
+							   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
+							   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
+			pthread_mutex_unlock(&glCommitMutex);
+			if (!Device->Raop) LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+		}
+
+		Subscribe(Device);
+		pthread_mutex_unlock(&Device->Mutex);
+	}
+
+	free(Devices);
+
+	if (!glDiscovery) GroupsInit();
+
+	SoapPause(false);
+	PollPause(false);
+
+	// previous search died with libupnp
+	glSearch.Busy = false;
+	SearchRequest("rebind", true);
+}
+
 /*----------------------------------------------------------------------------*/
 static void *MainThread(void *args) {
+	uint32_t Last = gettime_ms();
+
 	while (glMainRunning) {
 
-		crossthreads_sleep(30*1000);				
+		crossthreads_sleep(CONFIG_WATCH*1000);
 		if (!glMainRunning) break;
 
+		// config file edits are applied without restarting
+		if (ConfigChanged()) ReloadConfig();
+
+		// might be time for a new search
+		SearchTick();
+
+		if (gettime_ms() - Last < 30*1000) continue;
+		Last = gettime_ms();
+
 		if (glLogFile && glLogLimit != - 1) {
 			uint32_t size = ftell(stderr);
 
@@ -902,9 +1959,7 @@ static void *MainThread(void *args) {
 			host = get_interface(!strchr(glBinding, '?') ? glBinding : NULL, NULL, NULL);
 			if (host.s_addr != INADDR_NONE && host.s_addr != glHost.s_addr) {
 				LOG_INFO("IP change detected %s", inet_ntoa(glHost));
-				Stop(false);
-				glMainRunning = true;
-				Start(false);
+				Rebind();
 			}
 		}
 	}
@@ -913,18 +1968,47 @@ static void *MainThread(void *args) {
 }
 
 /*----------------------------------------------------------------------------*/
-static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, const char *location) {
+static char *CodecProtocolInfo(char *Codec) {
+	if (strcasestr(Codec, "pcm")) return "http-get:*:audio/L16;rate=44100;channels=2:DLNA.ORG_PN=LPCM;DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
+	else if (strcasestr(Codec, "wav")) return "http-get:*:audio/wav:DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
+	else if (strcasestr(Codec, "aac")) return "http-get:*:audio/aac:DLNA.ORG_PN=AAC_ADTS;DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
+	else if (strcasestr(Codec, "mp3")) return "http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
+	else return "http-get:*:audio/flac:DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
+}
+
+/*----------------------------------------------------------------------------*/
+static void SetProtocolInfo(struct sMR *Device) {
+	// set protocolinfo (will be used for some HTTP response)
+	Device->ProtocolInfo = CodecProtocolInfo(Device->Config.Codec);
+}
+
+/*----------------------------------------------------------------------------*/
+static void Subscribe(struct sMR *Device) {
+	for (int i = 0; i < NB_SRV; i++) {
+		if (!Device->Service[i].TimeOut) continue;
+		// topology is the same for the whole household, one subscriber is enough
+		if (i == TOPOLOGY_IDX && !TopologySubscribe(Device)) continue;
+		UpnpSubscribeAsync(glControlPointHandle, Device->Service[i].EventURL,
+						   Device->Service[i].TimeOut, MasterHandler,
+						   (void*) strdup(Device->UDN));
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, const char *location, tSnapshot *Snap) {
 	char *friendlyName = NULL;
 	uint32_t now = gettime_ms();
 
-	// read parameters from default then config file
+	// read parameters from default then config file (both can be reloaded)
+	pthread_mutex_lock(&glCommitMutex);
 	memcpy(&Device->Config, &glMRConfig, sizeof(tMRConfig));
 	LoadMRConfig(glConfigID, UDN, &Device->Config);
+	pthread_mutex_unlock(&glCommitMutex);
 
 	if (!Device->Config.Enabled) return false;
 
 	// Read key elements from description document (NB: glMRConfig is fully initialized, including strings)
-	friendlyName = XMLGetFirstDocumentItem(DescDoc, "friendlyName", true);
+	friendlyName = Snap ? strdup(Snap->friendlyName) : XMLGetFirstDocumentItem(DescDoc, "friendlyName", true);
 	if (!friendlyName || !*friendlyName) friendlyName = strdup(UDN);
 
 	LOG_SDEBUG("UDN:\t%s\nFriendlyName:\t%s", UDN,  friendlyName);
@@ -933,25 +2017,48 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 	Device->RaopState	= RAOP_STOP;
 	Device->State 		= STOPPED;
 	Device->LastSeen	= now / 1000;
+	Device->DescStamp	= now / 1000;
+	Device->DescHash	= 0;			// set by caller when it has read the description
 	Device->Leaving		= false;
 	Device->VolumeStampRx = Device->VolumeStampTx = now - 2000;
 	Device->ExpectStop 	= false;
 	Device->TimeOut 	= false;
+	Device->Restored	= Snap != NULL;
 	Device->WaitCookie 	= Device->StartCookie = NULL;
 	Device->Raop 		= NULL;
 	Device->Elapsed		= 0;
 	Device->seqN		= NULL;
-	Device->TrackPoll 	= Device->StatePoll = 0;
+	Device->TrackPoll 	= Device->StatePoll = now;
 	Device->Volume 		= 0;
 	Device->Actions 	= NULL;
+	Device->VolumeSlot.Busy = Device->MuteSlot.Busy = false;
+	Device->VolumeSlot.Pending = Device->MuteSlot.Pending = -1;
+	Device->Superseded	= 0;
+	Device->Templates	= NULL;
+	Device->Sink		= NULL;
 	Device->Master		= NULL;
 	Device->ErrorCount = 0;
+	Device->TrustEvents = false;
+	Device->EventState = UNKNOWN;
+	Device->EventMismatch = 0;
+	Device->StatePolls = Device->StateMismatches = 0;
+	if (Device->Config.PollMax < Device->Config.PollMin) Device->Config.PollMax = Device->Config.PollMin;
+	Device->StateInterval = Device->Config.PollMin;
 
 	strcpy(Device->UDN, UDN);
 	strcpy(Device->DescDocURL, location);
 
 	memset(&Device->MetaData, 0, sizeof(Device->MetaData));
 	memset(&Device->Service, 0, sizeof(struct sService) * NB_SRV);
+	Device->NextURI = Device->Chained = false;
+	Device->Group = NULL;
+
+	/*
+	Nothing can reach this player before it is published, but a late callback for
+	the previous user of that slot would wait on its mutex, so network reads are
+	done without it
+	*/
+	pthread_mutex_unlock(&Device->Mutex);
 
 	/* find the different services */
 	for (int i = 0; i < NB_SRV; i++) {
@@ -959,7 +2066,15 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 		char *EventURL = NULL, *ControlURL = NULL, *ServiceURL = NULL;
 
 		strcpy(Device->Service[i].Id, "");
-		if (XMLFindAndParseService(DescDoc, location, cSearchedSRV[i].name, &ServiceType, &ServiceId, &EventURL, &ControlURL, &ServiceURL)) {
+		if (Snap) {
+			// snapshot has services already in place
+			if (*Snap->Service[cSearchedSRV[i].idx].ControlURL) {
+				struct sService *s = &Device->Service[cSearchedSRV[i].idx];
+				memcpy(s, Snap->Service + cSearchedSRV[i].idx, sizeof(struct sService));
+				*s->SID = '\0';
+				s->TimeOut = cSearchedSRV[i].TimeOut;
+			}
+		} else if (XMLFindAndParseService(DescDoc, location, cSearchedSRV[i].name, &ServiceType, &ServiceId, &EventURL, &ControlURL, &ServiceURL)) {
 			struct sService *s = &Device->Service[cSearchedSRV[i].idx];
 			LOG_SDEBUG("\tservice [%s] %s %s, %s, %s", cSearchedSRV[i].name, ServiceType, ServiceId, EventURL, ControlURL);
 
@@ -970,6 +2085,17 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 			s->TimeOut = cSearchedSRV[i].TimeOut;
 		}
 
+		// transport state can be evented instead of polled
+		if (cSearchedSRV[i].idx == AVT_SRV_IDX && Device->Config.TransportEvents && *Device->Service[AVT_SRV_IDX].EventURL) {
+			Device->Service[AVT_SRV_IDX].TimeOut = 120;
+		}
+
+		// gapless needs the next URI, check only once in service description
+		if (cSearchedSRV[i].idx == AVT_SRV_IDX && Device->Config.Gapless && (ServiceURL || Snap)) {
+			Device->NextURI = Snap ? Snap->NextURI : XMLFindAction(location, ServiceURL, "SetNextAVTransportURI");
+			LOG_INFO("[%p]: gapless transitions %s", Device, Device->NextURI ? "available" : "not supported");
+		}
+
 		NFREE(ServiceId);
 		NFREE(ServiceType);
 		NFREE(EventURL);
@@ -977,8 +2103,25 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 		NFREE(ServiceURL);
 	}
 
-	Device->Master = GetMaster(Device, &friendlyName);
-	Device->Volume = CtrlGetVolume(Device);
+	/*
+	Only description, topology and sink list are read before this player is
+	published. Volume will be read in background and subscriptions are made
+	asynchronously once the player is running
+	*/
+	if (Snap) {
+		// topology is checked again as soon as the player shows up
+		Device->Master = *Snap->Master ? UDN2Device(Snap->Master) : NULL;
+		if (*Snap->Master && !Device->Master) Device->Master = Device;
+	} else {
+		Device->Master = GetMaster(Device, &friendlyName);
+	}
+	Device->Volume = -1;
+
+	// sink list is read once (unless codec is fixed), decision is made again when config changes
+	if (Snap) Device->Sink = Snap->Sink ? strdup(Snap->Sink) : NULL;
+	else if (strcasecmp(Device->Config.CodecPolicy, "fixed") && *Device->Service[CNX_MGR_IDX].ControlURL) Device->Sink = GetProtocolInfo(Device);
+
+	pthread_mutex_lock(&Device->Mutex);
 
 	// set remaining items now that we are sure
 
@@ -989,7 +2132,7 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 		} else {
 			Device->MetaData.remote_title = "Streaming from AirConnect";
 		}
-		char* version = XMLGetFirstDocumentItem(DescDoc, "displayVersion", true);
+		char* version = Snap ? NULL : XMLGetFirstDocumentItem(DescDoc, "displayVersion", true);
 		LOG_INFO("[%p]: Sonos stream presented as '%s' (firmware %s)", Device, Device->Config.StreamType, version && *version ? version : "unknown");
 		NFREE(version);
 	} else {
@@ -998,18 +2141,23 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 
 	if (*Device->Config.ArtWork) Device->MetaData.artwork = Device->Config.ArtWork;
 
+	// snapshot is restored before discovery starts, otherwise wait for our turn
+	if (!Snap) DescPoolTurn(location);
+
 	Device->Running = true;
+	IndexDevice(Device);
+	RegistryPublish(Device);
 	// string is already zero-terminated
 	if (friendlyName) strncpy(Device->friendlyName, friendlyName, sizeof(Device->friendlyName) - 1);
 	if (!*Device->Config.Name) sprintf(Device->Config.Name, glNameFormat, friendlyName);
-	queue_init(&Device->ActionQueue, false, NULL);
 
-	// set protocolinfo (will be used for some HTTP response)
-	if (strcasestr(Device->Config.Codec, "pcm")) Device->ProtocolInfo = "http-get:*:audio/L16;rate=44100;channels=2:DLNA.ORG_PN=LPCM;DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
-	else if (strcasestr(Device->Config.Codec, "wav")) Device->ProtocolInfo = "http-get:*:audio/wav:DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
-	else if (strcasestr(Device->Config.Codec, "aac")) Device->ProtocolInfo = "http-get:*:audio/aac:DLNA.ORG_PN=AAC_ADTS;DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
-	else if (strcasestr(Device->Config.Codec, "mp3")) Device->ProtocolInfo = "http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
-	else Device->ProtocolInfo = "http-get:*:audio/flac:DLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=0d500000000000000000000000000000";
+	const char *Reason = CodecNegotiate(Device->Sink, Device->Config.CodecPolicy, Device->Config.Codec);
+	LOG_INFO("[%p]: using codec %s (%s)", Device, Device->Config.Codec, Reason);
+
+	SetProtocolInfo(Device);
+
+	// keep the mac we had so that AirPlay clients see the same player
+	if (Snap && !memcmp(Device->Config.mac, "\0\0\0\0\0\0", 6)) memcpy(Device->Config.mac, Snap->mac, 6);
 
 	if (!memcmp(Device->Config.mac, "\0\0\0\0\0\0", 6)) {
 		char ip[32];
@@ -1023,14 +2171,19 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 		memset(Device->Config.mac, 0xbb, 2);
 	}
 
-	// make sure MAC is unique	
-	for (int i = 0; i < glMaxDevices; i++) {
-		if (glMRDevices[i].Running && Device != glMRDevices + i && !memcmp(&glMRDevices[i].Config.mac, &Device->Config.mac, 6)) {
+	// make sure MAC is unique (other players might be added at the same time)
+	pthread_mutex_lock(&glCommitMutex);
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false);
+	for (int i = 0; i < Count; i++) {
+		if (Devices[i]->Running && Device != Devices[i] && !memcmp(&Devices[i]->Config.mac, &Device->Config.mac, 6)) {
 			memset(Device->Config.mac, 0xbb, 2);
 			*(uint32_t*)(Device->Config.mac + 2) = hash32(Device->UDN);
 			LOG_INFO("[%p]: duplicated mac ... updating", Device);
 		}
 	}
+	free(Devices);
+	pthread_mutex_unlock(&glCommitMutex);
 
 	if (Device->Master) {
 		LOG_INFO("[%p] skipping Sonos slave %s", Device, friendlyName);
@@ -1039,54 +2192,78 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 	}
 
 	NFREE(friendlyName);
-	pthread_create(&Device->Thread, NULL, &MRThread, Device);
 
 	/* subscribe here, not before */
-	for (int i = 0; i < NB_SRV; i++) if (Device->Service[i].TimeOut)
-		UpnpSubscribeAsync(glControlPointHandle, Device->Service[i].EventURL,
-						   Device->Service[i].TimeOut, MasterHandler,
-						   (void*) strdup(UDN));
+	Subscribe(Device);
+
+	// answer can only be processed once device is running and indexed
+	CtrlGetVolumeAsync(Device, Device->seqN++);
 
 	return (Device->Master == NULL);
 }
 
 /*----------------------------------------------------------------------------*/
-bool isExcluded(char *Model, char *ModelNumber) {
-	char item[STR_LEN];
-	char *p = glExcluded;
-	char *q = glExcludedModelNumber;
-	char *o = glIncludedModelNumbers;
-
-	if (glIncludedModelNumbers) {
-		if (!ModelNumber) {
-			if (strcasestr(glIncludedModelNumbers, "<NULL>")) return false;
-			else return true;
+static void RestoreSnapshot(void) {
+	tSnapshot *List;
+	int Count = LoadSnapshot(glSnapshotName, &List), Restored = 0;
+	uint32_t now = gettime_ms() / 1000;
+
+	// coordinators first so that their slaves can find them
+	for (int pass = 0; pass < 2; pass++) for (int i = 0; i < Count; i++) {
+		tSnapshot *Snap = List + i;
+		struct sMR *Device;
+
+		if ((pass == 0) != !*Snap->Master || UDN2Device(Snap->UDN)) continue;
+
+		if (FilterPeer(Snap->UDN, Snap->Location)) {
+			LOG_DEBUG("excluding snapshot of %s", Snap->Location);
+			continue;
 		}
-		do {
-			sscanf(o, "%[^,]", item);
-			if (!strcmp(ModelNumber, item)) return false;
-			o += strlen(item);
-		} while (*o++);
-		return true;
-	}
 
-	if (glExcluded && Model) {
-		do {
-			sscanf(p, "%[^,]", item);
-			if (strcasestr(Model, item)) return true;
-			p += strlen(item);
-		} while (*p++);
-	}
+		if ((Device = RegistryAcquire()) == NULL) {
+			LOG_ERROR("Too many uPNP devices (max:%u)", glMaxDevices);
+			break;
+		}
+
+		if (!AddMRDevice(Device, Snap->UDN, NULL, Snap->Location, Snap)) {
+			// disabled player never went live, slot goes back unlocked
+			if (!Device->Running) {
+				RegistryRelease(Device);
+				pthread_mutex_unlock(&Device->Mutex);
+				continue;
+			}
+		} else {
+			pthread_mutex_lock(&glCommitMutex);
+			Device->Raop = raopsr_create(glHost, glmDNSServer, Device->Config.Name,
+							   "airupnp", Device->Config.mac, Device->Config.Codec,
+							   Device->Config.Metadata, Device->Config.Drift, Device->Config.Flush,
+							   Device->Config.Latency, Device,
+							   HandleRAOP, HandleHTTP, glPortBase, glPortRange,
+							   Device->Config.HTTPLength ? Device->Config.HTTPLength : HTTP_FIXED_LENGTH);
+			pthread_mutex_unlock(&glCommitMutex);
+			if (!Device->Raop) {
+				LOG_ERROR("[%p]: cannot create RAOP instance (%s)", Device, Device->Config.Name);
+				// device's mutex returns unlocked
+				DelMRDevice(Device);
+				continue;
+			}
+		}
+
+		/*
+		Restored players are suspects until discovery sees them: the first presence
+		sweep probes those that did not answer and description is read again on the
+		first announce so that name and topology are reconciled
+		*/
+		Device->LastSeen = now - SearchPresence() - 1;
+		Device->DescStamp = now - DESC_TTL - 1;
+		Restored++;
 
-	if (glExcludedModelNumber && ModelNumber) {
-	    do {
-		    sscanf(q, "%[^,]", item);
-			if (strcasestr(ModelNumber, item)) return true;
-		    q += strlen(item);
-	    } while (*q++);
+		pthread_mutex_unlock(&Device->Mutex);
 	}
 
-	return false;
+	if (Count) LOG_INFO("restored %d/%d players from snapshot %s", Restored, Count, glSnapshotName);
+	for (int i = 0; i < Count; i++) NFREE(List[i].Sink);
+	NFREE(List);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -1127,9 +2304,15 @@ static bool Start(bool cold) {
 			goto Error;
 		}
 
-		// mutex should *always* be valid
-		glMRDevices = calloc(glMaxDevices, sizeof(struct sMR));
-		for (int i = 0; i < glMaxDevices; i++) pthread_mutex_init(&glMRDevices[i].Mutex, 0);
+		// device slots are allocated on demand, recycled on restart and only freed on exit
+		RegistryInit();
+		pthread_mutex_init(&glSearch.Mutex, 0);
+
+		// one poll thread for all renderers
+		PollInit(PollDevice);
+		IndexInit();
+		TopologyInit();
+		FilterInit(glExcluded, glExcludedModelNumber, glIncludedModelNumbers);
 
 		/* start the main thread */
 		pthread_create(&glMainThread, NULL, &MainThread, NULL);
@@ -1137,8 +2320,14 @@ static bool Start(bool cold) {
 
 	pthread_mutex_init(&glUpdateMutex, 0);
 	pthread_cond_init(&glUpdateCond, 0);
+	pthread_mutex_init(&glCommitMutex, 0);
+	SaveConfigInit(&glCommitMutex);
 	queue_init(&glUpdateQueue, true, FreeUpdate);
+	memset(glUpdates.Buckets, 0, sizeof(glUpdates.Buckets));
+	glUpdates.Depth = 0;
 	pthread_create(&glUpdateThread, NULL, &UpdateThread, NULL);
+	DescPoolInit();
+	SoapInit();
 
 	rc = UpnpRegisterClient(MasterHandler, NULL, &glControlPointHandle);
 	if (rc != UPNP_E_SUCCESS) {
@@ -1156,25 +2345,26 @@ static bool Start(bool cold) {
 	if ((glmDNSServer = mdnsd_start(glHost, false)) == NULL) goto Error;
 	mdnsd_set_hostname(glmDNSServer, hostname, glHost);
 
-	for (int i = 0; i < glMRConfig.UPnPMax; i++) {
-		char SearchTopic[sizeof(MEDIA_RENDERER)+2];
-		snprintf(SearchTopic, sizeof(SearchTopic), "%s:%i", MEDIA_RENDERER, i + 1);
-		UpnpSearchAsync(glControlPointHandle, DISCOVERY_TIME, SearchTopic, NULL);
-	}
+	// publish known players right away, discovery will sort them out
+	if (cold && *glSnapshotName) RestoreSnapshot();
+
+	// virtual groups only need to be announced, members come with discovery
+	if (cold && !glDiscovery) GroupsInit();
+
+	// previous searches (if any) died with libupnp
+	glSearch.Busy = glSearch.Changed = false;
+	SearchRequest(cold ? "start" : "restart", true);
 
 	return true;
 
 Error:
 	UpnpFinish();
-	NFREE(glMRDevices);
 	return false;
 
 }
 
 /*----------------------------------------------------------------------------*/
 static bool Stop(bool exit) {
-	int i;
-
 	glMainRunning = false;
 
 	if (glHost.s_addr != INADDR_ANY) {
@@ -1183,16 +2373,32 @@ static bool Stop(bool exit) {
 		pthread_cond_signal(&glUpdateCond);
 		pthread_join(glUpdateThread, NULL);
 
+		LOG_INFO("terminate discovery workers ...", NULL);
+		DescPoolEnd();
+
+		// write pending configuration while all renderers are still known
+		LOG_INFO("flush configuration ...", NULL);
+		SaveConfigEnd();
+
+		// groups first as they drive renderers
+		LOG_INFO("terminate groups ...", NULL);
+		GroupsEnd();
+
 		// remove devices and make sure that they are stopped to avoid libupnp lock
 		LOG_INFO("flush renderers ...", NULL);
 		FlushMRDevices();
 
+		// pending actions might still need libupnp
+		LOG_INFO("terminate SOAP workers ...", NULL);
+		SoapEnd();
+
 		LOG_INFO("terminate libupnp", NULL);
 		UpnpUnRegisterClient(glControlPointHandle);
 		UpnpFinish();
 
 		pthread_mutex_destroy(&glUpdateMutex);
 		pthread_cond_destroy(&glUpdateCond);
+		pthread_mutex_destroy(&glCommitMutex);
 
 		// remove discovered items
 		queue_flush(&glUpdateQueue);
@@ -1210,26 +2416,34 @@ static bool Stop(bool exit) {
 		crossthreads_wake();
 		pthread_join(glMainThread, NULL);
 
+		// all renderers have been flushed so poller is idle
+		PollEnd();
+		IndexEnd();
+		TopologyEnd();
+		FilterEnd();
+
 		// these are for sure unused now that libupnp cannot signal anything
-		for (i = 0; i < glMaxDevices; i++) pthread_mutex_destroy(&glMRDevices[i].Mutex);
+		RegistryEnd();
+		pthread_mutex_destroy(&glSearch.Mutex);
 
 		// terminate pico http server
 		http_pico_close();
 
-		if (glConfigID) ixmlDocument_free(glConfigID);
+		FreeConfig(glConfigID);
 		netsock_close();
 		cross_ssl_free();
 	}
 
-	free(glMRDevices);
 	return true;
 }
 
 /*---------------------------------------------------------------------------*/
 static void sighandler(int signum) {
 	if (!glGracefullShutdown) {
-		for (int i = 0; i < glMaxDevices; i++) {
-			struct sMR *p = &glMRDevices[i];
+		struct sMR **Devices;
+		int Count = RegistryList(&Devices, false);
+		for (int i = 0; i < Count; i++) {
+			struct sMR *p = Devices[i];
 			if (p->Running && p->State == PLAYING) AVTStop(p);
 		}
 		LOG_INFO("forced exit", NULL);
@@ -1240,6 +2454,56 @@ static void sighandler(int signum) {
 	exit(0);
 }
 
+/*---------------------------------------------------------------------------*/
+static int OptLength(char *opt, int optind, int argc) {
+	// 2 for an option with a value, 1 for a flag and 0 when unknown
+	if (strstr("abxdpifmnolcugNSw", opt) && optind < argc - 1) return 2;
+	if (strstr("tzZIkr", opt) || opt[0] == '-') return 1;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool PlayerOpt(char *opt, char *optarg, tMRConfig *Config) {
+	switch (opt[0]) {
+	case 'c':
+		strcpy(Config->Codec, optarg);
+		break;
+	case 'u':
+		Config->UPnPMax = atoi(optarg);
+		break;
+	case 'S':
+		strcpy(Config->StreamType, optarg);
+		break;
+	case 'r':
+		Config->Drift = true;
+		break;
+	case 'l':
+		strcpy(Config->Latency, optarg);
+		break;
+	case 'g':
+		Config->HTTPLength = atoi(optarg);
+		break;
+	case '-':
+		if (strcmp(opt + 1, "noflush")) return false;
+		Config->Flush = false;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void PlayerArgs(tMRConfig *Config) {
+	// same walk as ParseArgs (which has validated it), only for player options
+	for (int optind = 1, n; optind < glArgc && strlen(glArgv[optind]) >= 2 && glArgv[optind][0] == '-'; optind += n) {
+		char *opt = glArgv[optind] + 1;
+		if ((n = OptLength(opt, optind, glArgc)) == 0) break;
+		PlayerOpt(opt, n == 2 ? glArgv[optind + 1] : NULL, Config);
+	}
+}
+
 /*---------------------------------------------------------------------------*/
 bool ParseArgs(int argc, char **argv) {
 	char *optarg = NULL;
@@ -1253,17 +2517,19 @@ bool ParseArgs(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("abxdpifmnolcugNS", opt) && optind < argc - 1) {
-			optarg = argv[optind + 1];
-			optind += 2;
-		} else if (strstr("tzZIkr", opt) || opt[0] == '-') {
-			optarg = NULL;
-			optind += 1;
-		} else {
+		int n = OptLength(opt, optind, argc);
+
+		if (!n) {
 			printf("%s", usage);
 			return false;
 		}
 
+		optarg = n == 2 ? argv[optind + 1] : NULL;
+		optind += n;
+
+		// these are re-applied when config file is reloaded
+		if (PlayerOpt(opt, optarg, &glMRConfig)) continue;
+
 		switch (opt[0]) {
 		case 'b':
 			strcpy(glBinding, optarg);
@@ -1274,12 +2540,6 @@ bool ParseArgs(int argc, char **argv) {
 		case 'f':
 			glLogFile = optarg;
 			break;
-		case 'c':
-			strcpy(glMRConfig.Codec, optarg);
-			break;
-		case 'u':
-			glMRConfig.UPnPMax = atoi(optarg);
-			break;
 		case 'i':
 			strcpy(glConfigName, optarg);
 			glDiscovery = true;
@@ -1287,6 +2547,9 @@ bool ParseArgs(int argc, char **argv) {
 		case 'I':
 			glAutoSaveConfigFile = true;
 			break;
+		case 'w':
+			strncpy(glSnapshotName, optarg, STR_LEN - 1);
+			break;
 		case 'p':
 			glPidFile = optarg;
 			break;
@@ -1296,15 +2559,9 @@ bool ParseArgs(int argc, char **argv) {
 		case 'N':
 			glNameFormat = optarg;
 			break;
-		case 'S':
-			strcpy(glMRConfig.StreamType, optarg);
-			break;
 		case 'k':
 			glGracefullShutdown = false;
 			break;
-		case 'r':
-			glMRConfig.Drift = true;
-			break;
 		case 'm':
 			glExcluded = optarg;
 			break;
@@ -1314,12 +2571,6 @@ bool ParseArgs(int argc, char **argv) {
 		case 'o':
 			glIncludedModelNumbers = optarg;
 			break;
-		case 'l':
-			strcpy(glMRConfig.Latency, optarg);
-			break;
-		case 'g':
-			glMRConfig.HTTPLength = atoi(optarg);
-			break;
 #if LINUX || FREEBSD
 		case 'z':
 			glDaemonize = true;
@@ -1350,9 +2601,6 @@ bool ParseArgs(int argc, char **argv) {
 		case 't':
 			printf("%s", license);
 			return false;
-		case '-':
-			if (!strcmp(opt + 1, "noflush")) glMRConfig.Flush = false;
-			break;
 		default:
 			break;
 		}
@@ -1390,6 +2638,10 @@ int main(int argc, char *argv[]) {
 	}
 
 	// load config from xml file
+	// keep defaults to restart from them when config file is reloaded
+	memcpy(&glMRDefaults, &glMRConfig, sizeof(tMRConfig));
+	glArgc = argc;
+	glArgv = argv;
 	glConfigID = (void*) LoadConfig(glConfigName, &glMRConfig);
 
 	// potentially overwrite with some cmdline parameters
@@ -1398,6 +2650,10 @@ int main(int argc, char *argv[]) {
 	// make sure port range is correct
 	if (glPortBase && !glPortRange) glPortRange = glMaxDevices*4;
 
+	// snapshot lives next to config, but discovery mode must start from scratch
+	if (!*glSnapshotName) snprintf(glSnapshotName, STR_LEN, "%.*s.cache", STR_LEN - 7, glConfigName);
+	if (!strcmp(glSnapshotName, "-") || glDiscovery) *glSnapshotName = '\0';
+
 	if (glLogFile) {
 		if (!freopen(glLogFile, "a", stderr)) {
 			fprintf(stderr, "error opening logfile %s: %s\n", glLogFile, strerror(errno));
@@ -1488,24 +2744,57 @@ int main(int argc, char *argv[]) {
 		if (!strcmp(resp, "save"))	{
 			char name[128];
 			(void)! scanf("%s", name);
-			SaveConfig(name, glConfigID, true);
+			// document is used under the commit lock, taken by SaveConfig itself
+			SaveConfig(name, &glConfigID, true);
 		}
 
 		if (!strcmp(resp, "dump") || !strcmp(resp, "dumpall"))	{
 			uint32_t now = gettime_ms() / 1000;
 			bool all = !strcmp(resp, "dumpall");
 
-			for (int i = 0; i < glMaxDevices; i++) {
-				struct sMR *p = &glMRDevices[i];
+			uint32_t Sent, Reused, Fallback;
+
+			printf("updates [depth:%u] [max:%u] [queued:%u] [coalesced:%u]\n",
+					glUpdates.Depth, glUpdates.MaxDepth, glUpdates.Queued, glUpdates.Coalesced);
+
+			SoapStats(&Sent, &Reused, &Fallback);
+			printf("soap [sent:%u] [reused:%u] [libupnp:%u]\n", Sent, Reused, Fallback);
+
+			printf("presence [sweeps:%u] [probed:%u] [removed:%u] [last:%ums] [max:%ums]\n", glPresence.Sweeps,
+					glPresence.Probed, glPresence.Removed, glPresence.Last, glPresence.Max);
+
+			printf("search #%u [%s] [%us ago] [pause:%us] [presence:%us]\n", glSearch.Count,
+					glSearch.Reason ? glSearch.Reason : "none", now - glSearch.Sent, glSearch.Interval, SearchPresence());
+
+			for (int i = 0; i < glGroupCount; i++) {
+				int Consumers;
+				uint32_t Dropped;
+				uint64_t Bytes;
+
+				RelayStats(glGroups[i].Relay, &Consumers, &Dropped, &Bytes);
+				printf("group %s [members:%d] [s:%u] [consumers:%d] [dropped:%u] [kB:%u]\n",
+						glGroups[i].Config.Name, glGroups[i].Config.Count, glGroups[i].RaopState,
+						Consumers, Dropped, (uint32_t) (Bytes / 1024));
+			}
+
+			struct sMR **Devices;
+			int Count = RegistryList(&Devices, all);
+
+			for (int i = 0; i < Count; i++) {
+				struct sMR *p = Devices[i];
 
 				bool Locked = pthread_mutex_trylock(&p->Mutex);
 				if (!Locked) pthread_mutex_unlock(&p->Mutex);
 
 				if (!p->Running && !all) continue;
-				printf("%20.20s [r:%u] [l:%u] [s:%u] Last:%u eCnt:%u\n",
+				printf("%20.20s [r:%u] [l:%u] [s:%u] Last:%u eCnt:%u sup:%u poll:%u [%u/%u]\n",
 						p->Config.Name, p->Running, Locked, p->State,
-						now - p->LastSeen, p->ErrorCount);
+						now - p->LastSeen, p->ErrorCount, p->Superseded,
+						p->TrustEvents ? p->StateInterval : p->Config.PollMin,
+						p->StateMismatches, p->StatePolls);
 			}
+
+			free(Devices);
 		}
 
 	};
@@ -31,12 +31,20 @@
 
 #define MAX_PROTO		128
 #define MAX_RENDERERS	32
+#define MAX_MEMBERS		32		// Sonos groups cannot be larger
 #define MAGIC			0xAABBCCDD
 #define RESOURCE_LENGTH	250
 
 enum 	eMRstate { UNKNOWN, STOPPED, PLAYING, PAUSED, TRANSITIONING };
 enum 	{ AVT_SRV_IDX = 0, REND_SRV_IDX, CNX_MGR_IDX, TOPOLOGY_IDX, GRP_REND_SRV_IDX, NB_SRV };
 
+// rendering actions are sent one at a time, newest pending value wins (device's mutex must be held)
+typedef struct {
+	bool	Busy;
+	void	*Cookie;
+	int		Pending;		// -1 when nothing is waiting
+} tCtrlSlot;
+
 struct sService {
 	char Id			[RESOURCE_LENGTH];
 	char Type		[RESOURCE_LENGTH];
@@ -64,6 +72,11 @@ typedef struct sMRConfig
 	uint8_t		mac[6];
 	char		ArtWork[4*STR_LEN];
 	char		StreamType[STR_LEN];
+	bool		TransportEvents;
+	uint32_t	PollMin, PollMax;		// bounds of state polling interval (ms)
+	bool		Gapless;
+	bool		KeepAlive;
+	char		CodecPolicy[STR_LEN];	// fixed, cpu or bandwidth
 } tMRConfig;
 
 struct sMR {
@@ -75,32 +88,46 @@ struct sMR {
 	char friendlyName	[STR_LEN];
 	enum eMRstate 	State;
 	bool			ExpectStop;
+	bool			NextURI;				// renderer accepts SetNextAVTransportURI
+	bool			Chained;				// flushed without stop, next stream will follow
+	uint32_t		ChainDeadline;			// when a PLAY must have followed that flush
 	struct raopsr_s *Raop;
 	metadata_t		MetaData;
 	raopsr_event_t	RaopState;
 	uint32_t		Elapsed;
 	uint32_t		LastSeen;
+	uint32_t		DescStamp, DescHash;	// last description check and its content's hash
 	bool			Leaving;
+	bool			Restored;				// from snapshot and not yet seen at that address
 	uint8_t			*seqN;
 	void			*WaitCookie, *StartCookie;
-	cross_queue_t	ActionQueue;
-	unsigned		TrackPoll, StatePoll;
+	uint32_t		TrackPoll, StatePoll;	// next due time of each poll
+	uint32_t		PollDeadline;
+	int				PollIndex;				// position in poll scheduler, -1 when idle
 	struct sService Service[NB_SRV];
-	struct sAction	*Actions;
+	struct sAction	*Actions;				// transport actions waiting for WaitCookie
+	tCtrlSlot		VolumeSlot, MuteSlot;
+	uint32_t		Superseded;				// queued actions replaced by a newer one
+	struct sActionTemplate *Templates;	// pre-built actions, see avt_util.c
 	struct sMR		*Master;
-	pthread_mutex_t Mutex;
-	pthread_t 		Thread;
+	struct sGroup	*Group;					// virtual group driving this player, if any
+	pthread_mutex_t Mutex;					// a master's is always taken before its slaves'
 	double			Volume;		// to avoid int volume being stuck at 0
 	uint32_t		VolumeStampRx, VolumeStampTx;
 	int				ErrorCount;
+	bool			TrustEvents;			// transport state is evented, poll only to verify
+	enum eMRstate	EventState;
+	int				EventMismatch;
+	uint32_t		StateInterval;			// current state polling interval when events are trusted
+	uint32_t		StatePolls, StateMismatches;
 	bool			TimeOut;
 	char 			*ProtocolInfo;
+	char			*Sink;					// ConnectionManager sink list, read once
 };
 
 extern UpnpClient_Handle   	glControlPointHandle;
 extern int32_t				glLogLimit;
 extern tMRConfig			glMRConfig;
-extern struct sMR			*glMRDevices;
 extern int					glMaxDevices;
 extern char					glBinding[128];
 extern unsigned short		glPortBase, glPortRange;
@@ -8,11 +8,13 @@
  */
 
 #include <stdlib.h>
+#include <stdarg.h>
 
 #include "platform.h"
 #include "ixmlextra.h"
 #include "upnptools.h"
 #include "cross_log.h"
+#include "soap_util.h"
 #include "avt_util.h"
 
 /*
@@ -23,175 +25,287 @@ WARNING
 extern log_level	upnp_loglevel;
 static log_level 	*loglevel = &upnp_loglevel;
 
+#define MAX_TEMPLATE_ARGS	4
+
+/*
+An action is built once per device and service, then its arguments' text nodes
+are patched in place. SoapSendAsync serializes the document before it
+returns so the same DOM can be re-used right away. Values must not be empty so
+that each argument has a text node to patch
+*/
+typedef struct sActionTemplate {
+	struct sActionTemplate *Next;
+	int				Idx;
+	char			*Name;
+	IXML_Document	*Doc;
+	int				Count;
+	IXML_Node		*Values[MAX_TEMPLATE_ARGS];
+} tActionTemplate;
+
 static char *CreateDIDL(char *URI, char *ProtInfo, struct metadata_s *MetaData, struct sMRConfig *Config);
 
 /*----------------------------------------------------------------------------*/
-bool SubmitTransportAction(struct sMR *Device, IXML_Document *ActionNode) {
+static IXML_Node *NextElement(IXML_Node *Node) {
+	while (Node && ixmlNode_getNodeType(Node) != eELEMENT_NODE) Node = ixmlNode_getNextSibling(Node);
+	return Node;
+}
+
+/*----------------------------------------------------------------------------*/
+static IXML_Document *ActionTemplate(struct sMR *Device, int Idx, char *Name, ...) {
+	struct sService *Service = &Device->Service[Idx];
+	tActionTemplate *Template;
+	char *Arg, *Value;
+	va_list args;
+
+	for (Template = Device->Templates; Template; Template = Template->Next)
+		if (Template->Idx == Idx && !strcmp(Template->Name, Name)) break;
+
+	va_start(args, Name);
+
+	// already rendered, just update what has changed
+	if (Template) {
+		for (int i = 0; (Arg = va_arg(args, char*)) != NULL && i < Template->Count; i++) {
+			const char *Current = ixmlNode_getNodeValue(Template->Values[i]);
+			Value = va_arg(args, char*);
+			if (!Current || strcmp(Current, Value)) ixmlNode_setNodeValue(Template->Values[i], Value);
+		}
+		va_end(args);
+		return Template->Doc;
+	}
+
+	Template = calloc(1, sizeof(tActionTemplate));
+	Template->Idx = Idx;
+	Template->Name = strdup(Name);
+
+	if ((Template->Doc = UpnpMakeAction(Name, Service->Type, 0, NULL)) == NULL) {
+		va_end(args);
+		NFREE(Template->Name);
+		free(Template);
+		return NULL;
+	}
+
+	for (int i = 0; (Arg = va_arg(args, char*)) != NULL && i < MAX_TEMPLATE_ARGS; i++) {
+		Value = va_arg(args, char*);
+		UpnpAddToAction(&Template->Doc, Name, Service->Type, Arg, Value);
+	}
+
+	va_end(args);
+
+	// memorize where argument values are
+	IXML_Node *Node = NextElement(ixmlNode_getFirstChild((IXML_Node*) Template->Doc));
+	for (Node = NextElement(ixmlNode_getFirstChild(Node)); Node && Template->Count < MAX_TEMPLATE_ARGS;
+		 Node = NextElement(ixmlNode_getNextSibling(Node))) {
+		Template->Values[Template->Count++] = ixmlNode_getFirstChild(Node);
+	}
+
+	Template->Next = Device->Templates;
+	Device->Templates = Template;
+
+	LOG_DEBUG("[%p]: created %s template with %d argument(s)", Device, Name, Template->Count);
+
+	return Template->Doc;
+}
+
+/*----------------------------------------------------------------------------*/
+void AVTTemplateFlush(struct sMR *Device) {
+	while (Device->Templates) {
+		tActionTemplate *Template = Device->Templates;
+		Device->Templates = Template->Next;
+		ixmlDocument_free(Template->Doc);
+		free(Template->Name);
+		free(Template);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static bool Supersedes(const char *New, const char *Old) {
+	static const char *Transport[] = { "Play", "Pause", "Stop", NULL };
+	static const char *LatestWins[] = { "Seek", "SetPlayMode", "SetAVTransportURI", "SetNextAVTransportURI", NULL };
+	bool isNew = false, isOld = false;
+
+	// any transport command replaces another one
+	for (int i = 0; Transport[i]; i++) {
+		if (!strcmp(Transport[i], New)) isNew = true;
+		if (!strcmp(Transport[i], Old)) isOld = true;
+	}
+
+	if (isNew || isOld) return isNew && isOld;
+
+	// others only replace themselves
+	for (int i = 0; LatestWins[i]; i++) if (!strcmp(LatestWins[i], New)) return !strcmp(New, Old);
+
+	return false;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool ChangesURI(const char *Name) {
+	return !strcmp(Name, "SetAVTransportURI") || !strcmp(Name, "SetNextAVTransportURI");
+}
+
+/*----------------------------------------------------------------------------*/
+bool SubmitTransportAction(struct sMR *Device, char *Name, IXML_Document *ActionNode) {
 	struct sService *Service = &Device->Service[AVT_SRV_IDX];
 	int rc = 0;
 
+	if (!ActionNode) return false;
+
 	if (!Device->WaitCookie) {
 		Device->WaitCookie = Device->seqN++;
-		rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
-								 NULL, ActionNode, ActionHandler, Device->WaitCookie);
+		rc = SoapSendAsync(Device, Service, ActionNode, ActionHandler, Device->WaitCookie);
 
 		if (rc != UPNP_E_SUCCESS) {
-			LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+			LOG_ERROR("[%p]: Error in SoapSendAsync -- %d", Device, rc);
 		}
-
-		ixmlDocument_free(ActionNode);
 	} else {
-		tAction *Action = malloc(sizeof(tAction));
+		tAction **p, **Old = NULL, *Action;
+
+		/*
+		Newest replaces a pending one it supersedes but is always appended, so the
+		queue keeps the order of submission. Nothing is merged across a URI change
+		as what is queued after it applies to the new URI
+		*/
+		for (p = &Device->Actions; *p; p = &(*p)->Next) {
+			if (Supersedes(Name, (*p)->Name)) Old = p;
+			else if (ChangesURI(Name) || ChangesURI((*p)->Name)) Old = NULL;
+		}
+
+		if (Old) {
+			Action = *Old;
+			LOG_DEBUG("[%p]: %s supersedes queued %s", Device, Name, Action->Name);
+			*Old = Action->Next;
+			if (p == &Action->Next) p = Old;
+			ixmlDocument_free(Action->ActionNode);
+			free(Action->Name);
+			free(Action);
+			Device->Superseded++;
+		}
+
+		Action = *p = calloc(1, sizeof(tAction));
+
+		// template will change before we send it, so queue a copy
 		Action->Device = Device;
-		Action->ActionNode = ActionNode;
-		queue_insert(&Device->ActionQueue, Action);
+		Action->Name = strdup(Name);
+		Action->ActionNode = ixmlNode_cloneNode((IXML_Node*) ActionNode, true);
 	}
 
 	return (rc == 0);
 }
 
 /*----------------------------------------------------------------------------*/
-void AVTActionFlush(cross_queue_t *Queue) {
-	tAction *Action;
+int AVTActionFlush(struct sMR *Device) {
+	int Count = 0;
 
-	while ((Action = queue_extract(Queue)) != NULL) {
+	while (Device->Actions) {
+		tAction *Action = Device->Actions;
+		Device->Actions = Action->Next;
 		if (Action->ActionNode) ixmlDocument_free(Action->ActionNode);
+		free(Action->Name);
 		free(Action);
+		Count++;
 	}
+
+	return Count;
 }
 
 /*----------------------------------------------------------------------------*/
 
 bool AVTSetURI(struct sMR *Device, char *URI, struct metadata_s *MetaData, char *ProtoInfo) {
-	IXML_Document *ActionNode = NULL;
-	struct sService *Service = &Device->Service[AVT_SRV_IDX];
-	
+	IXML_Document *ActionNode;
+
 	char *DIDLData = CreateDIDL(URI, ProtoInfo, MetaData, &Device->Config);
 	LOG_INFO("[%p]: uPNP setURI %s (cookie %p)", Device, URI, Device->seqN);
 	LOG_DEBUG("[%p]: DIDL header: %s", Device, DIDLData);
 
-	if ((ActionNode = UpnpMakeAction("SetAVTransportURI", Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, "SetAVTransportURI", Service->Type, "InstanceID", "0");
-	UpnpAddToAction(&ActionNode, "SetAVTransportURI", Service->Type, "CurrentURI", URI);
-	UpnpAddToAction(&ActionNode, "SetAVTransportURI", Service->Type, "CurrentURIMetaData", DIDLData);
+	ActionNode = ActionTemplate(Device, AVT_SRV_IDX, "SetAVTransportURI", "InstanceID", "0",
+								"CurrentURI", URI, "CurrentURIMetaData", DIDLData, NULL);
 	free(DIDLData);
 
-	return SubmitTransportAction(Device, ActionNode);
+	return SubmitTransportAction(Device, "SetAVTransportURI", ActionNode);
 }
 
 /*----------------------------------------------------------------------------*/
 bool AVTSetNextURI(struct sMR *Device, char *URI, struct metadata_s *MetaData, char *ProtoInfo) {
-	IXML_Document *ActionNode = NULL;
-	struct sService *Service = &Device->Service[AVT_SRV_IDX];
+	IXML_Document *ActionNode;
 
 	char *DIDLData = CreateDIDL(URI, ProtoInfo, MetaData, &Device->Config);
 	LOG_INFO("[%p]: uPNP setNextURI %s (cookie %p)", Device, URI, Device->seqN);
 	LOG_DEBUG("[%p]: DIDL header: %s", Device, DIDLData);
 
-	if ((ActionNode = UpnpMakeAction("SetNextAVTransportURI", Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, "SetNextAVTransportURI", Service->Type, "InstanceID", "0");
-	UpnpAddToAction(&ActionNode, "SetNextAVTransportURI", Service->Type, "NextURI", URI);
-	UpnpAddToAction(&ActionNode, "SetNextAVTransportURI", Service->Type, "NextURIMetaData", DIDLData);
+	ActionNode = ActionTemplate(Device, AVT_SRV_IDX, "SetNextAVTransportURI", "InstanceID", "0",
+								"NextURI", URI, "NextURIMetaData", DIDLData, NULL);
 	free(DIDLData);
 
-	return SubmitTransportAction(Device, ActionNode);
+	return SubmitTransportAction(Device, "SetNextAVTransportURI", ActionNode);
 }
 
 /*----------------------------------------------------------------------------*/
 int AVTCallAction(struct sMR *Device, char *Action, void *Cookie) {
-	IXML_Document *ActionNode = NULL;
+	IXML_Document *ActionNode;
 	struct sService *Service = &Device->Service[AVT_SRV_IDX];
 
 	LOG_SDEBUG("[%p]: uPNP %s (cookie %p)", Device, Action, Cookie);
 
-	if ((ActionNode = UpnpMakeAction(Action, Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, Action, Service->Type, "InstanceID", "0");
+	if ((ActionNode = ActionTemplate(Device, AVT_SRV_IDX, Action, "InstanceID", "0", NULL)) == NULL) return UPNP_E_INVALID_ACTION;
 
-	int rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
-							 ActionNode, ActionHandler, Cookie);
+	int rc = SoapSendAsync(Device, Service, ActionNode, ActionHandler, Cookie);
 
-	if (rc != UPNP_E_SUCCESS) LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
-	ixmlDocument_free(ActionNode);
+	if (rc != UPNP_E_SUCCESS) LOG_ERROR("[%p]: Error in SoapSendAsync -- %d", Device, rc);
 
 	return rc;
 }
 
 /*----------------------------------------------------------------------------*/
 bool AVTPlay(struct sMR *Device) {
-	struct sService *Service = &Device->Service[AVT_SRV_IDX];
-	IXML_Document *ActionNode = NULL;
-
 	LOG_INFO("[%p]: uPNP play (cookie %p)", Device, Device->seqN);
 
-	if ((ActionNode =  UpnpMakeAction("Play", Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, "Play", Service->Type, "InstanceID", "0");
-	UpnpAddToAction(&ActionNode, "Play", Service->Type, "Speed", "1");
-
-	return SubmitTransportAction(Device, ActionNode);
+	return SubmitTransportAction(Device, "Play", ActionTemplate(Device, AVT_SRV_IDX, "Play",
+								 "InstanceID", "0", "Speed", "1", NULL));
 }
 
 /*----------------------------------------------------------------------------*/
 bool AVTSetPlayMode(struct sMR *Device) {
-	struct sService *Service = &Device->Service[AVT_SRV_IDX];
-	IXML_Document *ActionNode = NULL;
-
 	LOG_INFO("[%p]: uPNP set play mode (cookie %p)", Device, Device->seqN);
-	if ((ActionNode =  UpnpMakeAction("SetPlayMode", Service->Type, 0, NULL)) == NULL) return false;;
-	UpnpAddToAction(&ActionNode, "SetPlayMode", Service->Type, "InstanceID", "0");
-	UpnpAddToAction(&ActionNode, "SetPlayMode", Service->Type, "NewPlayMode", "NORMAL");
 
-	return SubmitTransportAction(Device, ActionNode);
+	return SubmitTransportAction(Device, "SetPlayMode", ActionTemplate(Device, AVT_SRV_IDX, "SetPlayMode",
+								 "InstanceID", "0", "NewPlayMode", "NORMAL", NULL));
 }
 
 /*----------------------------------------------------------------------------*/
 bool AVTSeek(struct sMR *Device, unsigned Interval) {
-	struct sService *Service = &Device->Service[AVT_SRV_IDX];
-	IXML_Document *ActionNode = NULL;
 	char	params[128];
 
 	LOG_INFO("[%p]: uPNP seek (%.2lf sec) (cookie %p)", Device, Interval / 1000.0, Device->seqN);
 
-	if ((ActionNode =  UpnpMakeAction("Seek", Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, "Seek", Service->Type, "InstanceID", "0");
 	sprintf(params, "%d", (int) (Interval / 1000 + 0.5));
-	UpnpAddToAction(&ActionNode, "Seek", Service->Type, "Unit", params);
-	UpnpAddToAction(&ActionNode, "Seek", Service->Type, "Target", "REL_TIME");
 
-	return SubmitTransportAction(Device, ActionNode);
+	return SubmitTransportAction(Device, "Seek", ActionTemplate(Device, AVT_SRV_IDX, "Seek",
+								 "InstanceID", "0", "Unit", params, "Target", "REL_TIME", NULL));
 }
 
 /*----------------------------------------------------------------------------*/
 bool AVTBasic(struct sMR *Device, char *Action) {
-	struct sService *Service = &Device->Service[AVT_SRV_IDX];
-	IXML_Document *ActionNode = NULL;
-
 	LOG_INFO("[%p]: uPNP %s (cookie %p)", Device, Action, Device->seqN);
 
-	if ((ActionNode = UpnpMakeAction(Action, Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, Action, Service->Type, "InstanceID", "0");
-
-	return SubmitTransportAction(Device, ActionNode);
+	return SubmitTransportAction(Device, Action, ActionTemplate(Device, AVT_SRV_IDX, Action, "InstanceID", "0", NULL));
 }
 
 /*----------------------------------------------------------------------------*/
 bool AVTStop(struct sMR *Device) {
 	struct sService *Service = &Device->Service[AVT_SRV_IDX];
-	IXML_Document *ActionNode = NULL;
+	IXML_Document *ActionNode;
 
 	LOG_INFO("[%p]: uPNP stop (cookie %p)", Device, Device->seqN);
 
-	if ((ActionNode = UpnpMakeAction("Stop", Service->Type, 0, NULL)) == NULL) return false;
-	UpnpAddToAction(&ActionNode, "Stop", Service->Type, "InstanceID", "0");
-	AVTActionFlush(&Device->ActionQueue);
+	if ((ActionNode = ActionTemplate(Device, AVT_SRV_IDX, "Stop", "InstanceID", "0", NULL)) == NULL) return false;
 
-	Device->WaitCookie = Device->seqN++;
-	int rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
-							 NULL, ActionNode, ActionHandler, Device->WaitCookie);
+	// whatever is queued is superseded by stop
+	Device->Superseded += AVTActionFlush(Device);
 
-	ixmlDocument_free(ActionNode);
+	Device->WaitCookie = Device->seqN++;
+	int rc = SoapSendAsync(Device, Service, ActionNode, ActionHandler, Device->WaitCookie);
 
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+		LOG_ERROR("[%p]: Error in SoapSendAsync -- %d", Device, rc);
 	}
 
 	return (rc == 0);
@@ -199,47 +313,103 @@ bool AVTStop(struct sMR *Device) {
 
 /*----------------------------------------------------------------------------*/
 int CtrlSetVolume(struct sMR *Device, uint8_t Volume, void *Cookie) {
-	IXML_Document *ActionNode = NULL;
+	// slot is also changed by CtrlActionComplete, so caller must own that device (not its master)
+	IXML_Document *ActionNode;
 	struct sService *Service = &Device->Service[REND_SRV_IDX];
 	char params[8];
-	
+
+	// one is already on the wire, only the newest value will follow it
+	if (Device->VolumeSlot.Busy) {
+		if (Device->VolumeSlot.Pending >= 0) Device->Superseded++;
+		Device->VolumeSlot.Pending = Volume;
+		LOG_DEBUG("[%p]: uPNP volume %d pending", Device, Volume);
+		return UPNP_E_SUCCESS;
+	}
+
 	LOG_INFO("[%p]: uPNP volume %d (cookie %p)", Device, Volume, Cookie);
 
-	ActionNode =  UpnpMakeAction("SetVolume", Service->Type, 0, NULL);
-	UpnpAddToAction(&ActionNode, "SetVolume", Service->Type, "InstanceID", "0");
-	UpnpAddToAction(&ActionNode, "SetVolume", Service->Type, "Channel", "Master");
 	sprintf(params, "%d", (int) Volume);
-	UpnpAddToAction(&ActionNode, "SetVolume", Service->Type, "DesiredVolume", params);
+	ActionNode = ActionTemplate(Device, REND_SRV_IDX, "SetVolume", "InstanceID", "0",
+								"Channel", "Master", "DesiredVolume", params, NULL);
+	if (!ActionNode) return UPNP_E_INVALID_ACTION;
 
-	int rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
-								 ActionNode, ActionHandler, Cookie);
+	int rc = SoapSendAsync(Device, Service, ActionNode, ActionHandler, Cookie);
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+		LOG_ERROR("[%p]: Error in SoapSendAsync -- %d", Device, rc);
+	} else {
+		Device->VolumeSlot.Busy = true;
+		Device->VolumeSlot.Cookie = Cookie;
 	}
 
-	if (ActionNode) ixmlDocument_free(ActionNode);
-
 	return rc;
 }
 
 /*----------------------------------------------------------------------------*/
 int CtrlSetMute(struct sMR *Device, bool Mute, void *Cookie) {
-	IXML_Document *ActionNode = NULL;
+	IXML_Document *ActionNode;
 	struct sService *Service = &Device->Service[REND_SRV_IDX];
 
+	if (Device->MuteSlot.Busy) {
+		if (Device->MuteSlot.Pending >= 0) Device->Superseded++;
+		Device->MuteSlot.Pending = Mute;
+		LOG_DEBUG("[%p]: uPNP mute %d pending", Device, Mute);
+		return UPNP_E_SUCCESS;
+	}
+
 	LOG_INFO("[%p]: uPNP mute %d (cookie %p)", Device, Mute, Cookie);
-	ActionNode =  UpnpMakeAction("SetMute", Service->Type, 0, NULL);
-	UpnpAddToAction(&ActionNode, "SetMute", Service->Type, "InstanceID", "0");
-	UpnpAddToAction(&ActionNode, "SetMute", Service->Type, "Channel", "Master");
-	UpnpAddToAction(&ActionNode, "SetMute", Service->Type, "DesiredMute", Mute ? "1" : "0");
+	ActionNode = ActionTemplate(Device, REND_SRV_IDX, "SetMute", "InstanceID", "0",
+								"Channel", "Master", "DesiredMute", Mute ? "1" : "0", NULL);
+	if (!ActionNode) return UPNP_E_INVALID_ACTION;
 
-	int rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
-							 ActionNode, ActionHandler, Cookie);
+	int rc = SoapSendAsync(Device, Service, ActionNode, ActionHandler, Cookie);
 
-	if (ActionNode) ixmlDocument_free(ActionNode);
+	if (rc != UPNP_E_SUCCESS) {
+		LOG_ERROR("[%p]: Error in SoapSendAsync -- %d", Device, rc);
+	} else {
+		Device->MuteSlot.Busy = true;
+		Device->MuteSlot.Cookie = Cookie;
+	}
+
+	return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+void CtrlActionComplete(struct sMR *Device, void *Cookie) {
+	// send the newest value that was held while previous one was on the wire
+	if (Device->VolumeSlot.Busy && Device->VolumeSlot.Cookie == Cookie) {
+		Device->VolumeSlot.Busy = false;
+		if (Device->VolumeSlot.Pending >= 0) {
+			uint8_t Volume = Device->VolumeSlot.Pending;
+			Device->VolumeSlot.Pending = -1;
+			CtrlSetVolume(Device, Volume, Device->seqN++);
+		}
+	}
+
+	if (Device->MuteSlot.Busy && Device->MuteSlot.Cookie == Cookie) {
+		Device->MuteSlot.Busy = false;
+		if (Device->MuteSlot.Pending >= 0) {
+			bool Mute = Device->MuteSlot.Pending;
+			Device->MuteSlot.Pending = -1;
+			CtrlSetMute(Device, Mute, Device->seqN++);
+		}
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+int CtrlGetVolumeAsync(struct sMR *Device, void *Cookie) {
+	IXML_Document *ActionNode;
+	struct sService *Service = &Device->Service[REND_SRV_IDX];
+
+	if (!*Service->ControlURL) return UPNP_E_INVALID_ACTION;
+
+	LOG_DEBUG("[%p]: uPNP get volume (cookie %p)", Device, Cookie);
+	ActionNode = ActionTemplate(Device, REND_SRV_IDX, "GetVolume", "InstanceID", "0", "Channel", "Master", NULL);
+	if (!ActionNode) return UPNP_E_INVALID_ACTION;
+
+	int rc = SoapSendAsync(Device, Service, ActionNode, ActionHandler, Cookie);
 
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+		LOG_ERROR("[%p]: Error in SoapSendAsync -- %d", Device, rc);
 	}
 
 	return rc;
@@ -323,72 +493,144 @@ char *GetProtocolInfo(struct sMR *Device) {
 	return ProtocolInfo;
 }
 
+/*----------------------------------------------------------------------------*/
+/*
+DIDL is written directly as text instead of building a DOM and printing it. The
+layout is exactly what ixmlNodetoString produces, i.e. a CRLF after a start tag
+followed by an element and after every end tag, and the same character escaping
+*/
+typedef struct {
+	char	*Buf;
+	size_t	Len, Size;
+} tDIDLWriter;
+
+static void _didlAppend(tDIDLWriter *w, const char *s, size_t len) {
+	if (w->Len + len + 1 > w->Size) {
+		while (w->Len + len + 1 > w->Size) w->Size *= 2;
+		w->Buf = realloc(w->Buf, w->Size);
+	}
+	memcpy(w->Buf + w->Len, s, len);
+	w->Len += len;
+	w->Buf[w->Len] = '\0';
+}
+
+#define _didlString(w, s) _didlAppend(w, s, strlen(s))
+
+static void _didlEscaped(tDIDLWriter *w, const char *s) {
+	const char *p;
+
+	if (!s) return;
+
+	for (p = s; *p; p++) {
+		const char *entity;
+
+		switch (*p) {
+		case '<': entity = "&lt;"; break;
+		case '>': entity = "&gt;"; break;
+		case '&': entity = "&amp;"; break;
+		case '"': entity = "&quot;"; break;
+		case '\'': entity = "&apos;"; break;
+		default: continue;
+		}
+
+		_didlAppend(w, s, p - s);
+		_didlString(w, entity);
+		s = p + 1;
+	}
+
+	_didlAppend(w, s, p - s);
+}
+
+static void _didlAttribute(tDIDLWriter *w, const char *Name, const char *Value) {
+	_didlString(w, " ");
+	_didlString(w, Name);
+	_didlString(w, "=\"");
+	_didlEscaped(w, Value);
+	_didlString(w, "\"");
+}
+
+static void _didlElement(tDIDLWriter *w, const char *Name, const char *Value) {
+	_didlString(w, "<");
+	_didlString(w, Name);
+	_didlString(w, ">");
+	_didlEscaped(w, Value);
+	_didlString(w, "</");
+	_didlString(w, Name);
+	_didlString(w, ">\r\n");
+}
+
+static void _didlNumber(tDIDLWriter *w, const char *Name, uint32_t Value, bool Attribute) {
+	char buf[16];
+
+	sprintf(buf, "%u", Value);
+	if (Attribute) _didlAttribute(w, Name, buf);
+	else _didlElement(w, Name, buf);
+}
+
 /*----------------------------------------------------------------------------*/
 char *CreateDIDL(char *URI, char *ProtoInfo, struct metadata_s *MetaData, struct sMRConfig *Config) {
-	IXML_Document *doc = ixmlDocument_createDocument();
-	IXML_Node	 *node, *root;
+	tDIDLWriter w = { NULL, 0, 1024 + strlen(URI) };
 
-	root = XMLAddNode(doc, NULL, "DIDL-Lite", NULL);
-	XMLAddAttribute(doc, root, "xmlns:dc", "http://purl.org/dc/elements/1.1/");
-	XMLAddAttribute(doc, root, "xmlns:upnp", "urn:schemas-upnp-org:metadata-1-0/upnp/");
-	XMLAddAttribute(doc, root, "xmlns", "urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/");
-	XMLAddAttribute(doc, root, "xmlns:dlna", "urn:schemas-dlna-org:metadata-1-0/");
+	w.Buf = malloc(w.Size);
 
-	node = XMLAddNode(doc, root, "item", NULL);
-	XMLAddAttribute(doc, node, "id", "1");
-	XMLAddAttribute(doc, node, "parentID", "0");
-	XMLAddAttribute(doc, node, "restricted", "1");
+	_didlString(&w, "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+					"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+					"xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+					"xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">\r\n"
+					"<item id=\"1\" parentID=\"0\" restricted=\"1\">\r\n");
 
 	if (MetaData->duration) {
 		div_t duration 	= div(MetaData->duration, 1000);
+		char buf[32];
 
 		if (Config->SendMetaData) {
-			XMLAddNode(doc, node, "dc:title", MetaData->title);
-			XMLAddNode(doc, node, "dc:creator", MetaData->artist);
-			XMLAddNode(doc, node, "upnp:genre", MetaData->genre);
-			XMLAddNode(doc, node, "upnp:artist", MetaData->artist);
-			XMLAddNode(doc, node, "upnp:album", MetaData->album);
-			if (MetaData->track) XMLAddNode(doc, node, "upnp:originalTrackNumber", "%d", MetaData->track);
-			if (MetaData->disc) XMLAddNode(doc, node, "upnp:originalDiscNumber", "%d", MetaData->disc);
-			if (MetaData->artwork) XMLAddNode(doc, node, "upnp:albumArtURI", "%s", MetaData->artwork);
+			_didlElement(&w, "dc:title", MetaData->title);
+			_didlElement(&w, "dc:creator", MetaData->artist);
+			_didlElement(&w, "upnp:genre", MetaData->genre);
+			_didlElement(&w, "upnp:artist", MetaData->artist);
+			_didlElement(&w, "upnp:album", MetaData->album);
+			if (MetaData->track) _didlNumber(&w, "upnp:originalTrackNumber", MetaData->track, false);
+			if (MetaData->disc) _didlNumber(&w, "upnp:originalDiscNumber", MetaData->disc, false);
+			if (MetaData->artwork) _didlElement(&w, "upnp:albumArtURI", MetaData->artwork);
 		}
 
-		XMLAddNode(doc, node, "upnp:class", "object.item.audioItem.musicTrack");
-		node = XMLAddNode(doc, node, "res", URI);
-		XMLAddAttribute(doc, node, "duration", "%1d:%02d:%02d.%03d",
-						duration.quot/3600, (duration.quot % 3600) / 60,
-						duration.quot % 60, duration.rem);
+		_didlElement(&w, "upnp:class", "object.item.audioItem.musicTrack");
+		_didlString(&w, "<res");
+		snprintf(buf, sizeof(buf), "%1d:%02d:%02d.%03d", duration.quot/3600, (duration.quot % 3600) / 60,
+				 duration.quot % 60, duration.rem);
+		_didlAttribute(&w, "duration", buf);
 	} else {
 		if (Config->SendMetaData) {
-			XMLAddNode(doc, node, "dc:title", MetaData->remote_title);
-			XMLAddNode(doc, node, "dc:creator", "");
-			XMLAddNode(doc, node, "upnp:album", "");
-			XMLAddNode(doc, node, "upnp:channelName", MetaData->remote_title);
-			XMLAddNode(doc, node, "upnp:channelNr", "%d", MetaData->track);
-			if (MetaData->artwork) XMLAddNode(doc, node, "upnp:albumArtURI", "%s", MetaData->artwork);
+			_didlElement(&w, "dc:title", MetaData->remote_title);
+			_didlElement(&w, "dc:creator", "");
+			_didlElement(&w, "upnp:album", "");
+			_didlElement(&w, "upnp:channelName", MetaData->remote_title);
+			_didlNumber(&w, "upnp:channelNr", MetaData->track, false);
+			if (MetaData->artwork) _didlElement(&w, "upnp:albumArtURI", MetaData->artwork);
 		}
 
-		XMLAddNode(doc, node, "upnp:class", "object.item.audioItem.audioBroadcast");
-		node = XMLAddNode(doc, node, "res", URI);
+		_didlElement(&w, "upnp:class", "object.item.audioItem.audioBroadcast");
+		_didlString(&w, "<res");
 	}
 
-	XMLAddAttribute(doc, node, "protocolInfo", ProtoInfo);
+	// protocolInfo is one of the per-codec strings set when device was created
+	_didlAttribute(&w, "protocolInfo", ProtoInfo);
 
 	// set optional parameters if we have them all (only happens with pcm)
 	if (MetaData->sample_rate && MetaData->sample_size && MetaData->channels) {
-		XMLAddAttribute(doc, node, "sampleFrequency", "%u", MetaData->sample_rate);
-		XMLAddAttribute(doc, node, "bitsPerSample", "%hhu", MetaData->sample_size);
-		XMLAddAttribute(doc, node, "nrAudioChannels", "%hhu", MetaData->channels);
+		_didlNumber(&w, "sampleFrequency", MetaData->sample_rate, true);
+		_didlNumber(&w, "bitsPerSample", MetaData->sample_size, true);
+		_didlNumber(&w, "nrAudioChannels", MetaData->channels, true);
 		if (MetaData->duration)
-			XMLAddAttribute(doc, node, "size", "%u", (uint32_t) ((MetaData->sample_rate *
-							MetaData->sample_size / 8 * MetaData->channels *
-							(uint64_t) MetaData->duration) / 1000));
+			_didlNumber(&w, "size", (uint32_t) ((MetaData->sample_rate * MetaData->sample_size / 8 *
+						MetaData->channels * (uint64_t) MetaData->duration) / 1000), true);
 	}
 
-	char *s = ixmlNodetoString((IXML_Node*) doc);
-	ixmlDocument_free(doc);
+	_didlString(&w, ">");
+	_didlEscaped(&w, URI);
+	_didlString(&w, "</res>\r\n</item>\r\n</DIDL-Lite>\r\n");
 
-	return s;
+	return w.Buf;
 }
 
 
@@ -16,7 +16,9 @@ struct sMRConfig;
 struct sMR;
 
 typedef struct sAction {
+	struct sAction *Next;
 	struct sMR *Device;
+	char   *Name;
 	void   *ActionNode;
 	union {
 		uint8_t Volume;
@@ -31,10 +33,13 @@ bool 	AVTSetPlayMode(struct sMR *Device);
 bool 	AVTSeek(struct sMR *Device, unsigned Interval);
 bool 	AVTBasic(struct sMR *Device, char *Action);
 bool 	AVTStop(struct sMR *Device);
-void	AVTActionFlush(cross_queue_t *Queue);
+int		AVTActionFlush(struct sMR *Device);
+void	AVTTemplateFlush(struct sMR *Device);
 int 	CtrlSetVolume(struct sMR *Device, uint8_t Volume, void *Cookie);
 int 	CtrlSetMute(struct sMR *Device, bool Mute, void *Cookie);
+void	CtrlActionComplete(struct sMR *Device, void *Cookie);
 int 	CtrlGetVolume(struct sMR *Device);
+int 	CtrlGetVolumeAsync(struct sMR *Device, void *Cookie);
 int 	CtrlGetGroupVolume(struct sMR *Device);
 char*	GetProtocolInfo(struct sMR *Device);
 
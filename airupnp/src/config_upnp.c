@@ -10,11 +10,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <sys/stat.h>
 
 #include "platform.h"
 #include "ixmlextra.h"
 #include "cross_log.h"
+#include "cross_thread.h"
 #include "airupnp.h"
+#include "mr_util.h"
 #include "config_upnp.h"
 
 /*----------------------------------------------------------------------------*/
@@ -25,11 +28,133 @@ extern log_level 	util_loglevel;
 extern log_level	raop_loglevel;
 extern log_level	upnp_loglevel;
 
+#define SAVE_DELAY		2000
+#define CONFIG_BUCKETS	64
+
+static log_level 	*loglevel = &main_loglevel;
+
+static struct {
+	pthread_t		Thread;
+	pthread_mutex_t	Mutex, *Lock;
+	pthread_cond_t	Cond;
+	bool			Running, Pending;
+	bool			Config, Snapshot;		// what is to be written when due
+	uint32_t		Due;
+	char			Name[STR_LEN], SnapName[STR_LEN];
+	void			**Ref;
+	uint32_t		Writes, Skipped, Coalesced;
+} glSaver;
+
+typedef struct sConfigEntry {
+	struct sConfigEntry *Next;
+	char		*UDN;			// belongs to the document
+	IXML_Node	*Node;
+} tConfigEntry;
+
+static struct {
+	IXML_Document	*Doc;
+	tConfigEntry	*Buckets[CONFIG_BUCKETS];
+} glIndex;
+
+static struct {
+	char		Name[STR_LEN];
+	bool		Exists;
+	time_t		MTime;
+	int64_t		Size;
+} glWatch;
+
+/*----------------------------------------------------------------------------*/
+static bool WatchStamp(void) {
+	struct stat st;
+	bool Exists = !stat(glWatch.Name, &st);
+	bool Changed = Exists != glWatch.Exists || (Exists && (st.st_mtime != glWatch.MTime || st.st_size != glWatch.Size));
+
+	glWatch.Exists = Exists;
+	glWatch.MTime = Exists ? st.st_mtime : 0;
+	glWatch.Size = Exists ? st.st_size : 0;
+
+	return Changed;
+}
+
+/*----------------------------------------------------------------------------*/
+static int WriteConfig(char *name, char *s) {
+	size_t len = strlen(s);
+	bool same = false;
+
+	// do not wear out storage when nothing has changed
+	FILE *file = fopen(name, "rb");
+	if (file) {
+		char *buf = malloc(len + 1);
+		same = buf && fread(buf, 1, len + 1, file) == len && !memcmp(buf, s, len);
+		NFREE(buf);
+		fclose(file);
+	}
+
+	if (same) return 0;
+
+	// write aside then swap so that a power cut never leaves a truncated file
+	char *tmp = malloc(strlen(name) + 5);
+	sprintf(tmp, "%s.tmp", name);
+
+	bool ok = (file = fopen(tmp, "wb")) != NULL;
+	if (ok) {
+		ok = fwrite(s, 1, len, file) == len && !fflush(file);
+#if !WIN
+		ok = ok && !fsync(fileno(file));
+#endif
+		ok = !fclose(file) && ok;
+	}
+
+#if WIN
+	ok = ok && MoveFileExA(tmp, name, MOVEFILE_REPLACE_EXISTING);
+#else
+	ok = ok && !rename(tmp, name);
+#endif
+
+	if (!ok) {
+		LOG_ERROR("cannot write configuration %s (%s)", name, strerror(errno));
+		remove(tmp);
+	} else if (!strcmp(name, glWatch.Name)) {
+		// our own writes must not be taken as an edit
+		WatchStamp();
+	}
+
+	free(tmp);
+	return ok ? 1 : -1;
+}
+
 /*----------------------------------------------------------------------------*/
-void SaveConfig(char *name, void *ref, bool full) {
-	struct sMR *p;
+void SaveConfig(char *name, void **ref, bool full) {
+	struct {
+		char	UDN[RESOURCE_LENGTH], Name[STR_LEN];
+		uint8_t	mac[6];
+		bool	Enabled;
+	} *Players;
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false), n = 0;
+
+	/*
+	A player's lock is taken before the commit lock elsewhere, so what is needed
+	from players is copied first, one player at a time, and the document after
+	*/
+	Players = malloc(Count * sizeof(*Players));
+	for (int i = 0; i < Count; i++) {
+		struct sMR *p = Devices[i];
+		if (!CheckAndLock(p)) continue;
+		strcpy(Players[n].UDN, p->UDN);
+		strcpy(Players[n].Name, p->Config.Name);
+		memcpy(Players[n].mac, p->Config.mac, 6);
+		Players[n].Enabled = p->Config.Enabled;
+		pthread_mutex_unlock(&p->Mutex);
+		n++;
+	}
+	free(Devices);
+
+	// reference document might be swapped by a reload
+	if (glSaver.Lock) pthread_mutex_lock(glSaver.Lock);
+
 	IXML_Document *doc = ixmlDocument_createDocument();
-	IXML_Document *old_doc = ref;
+	IXML_Document *old_doc = *ref;
 	IXML_Node *root, *common;
 	IXML_Element* old_root = ixmlDocument_getElementById(old_doc, "airupnp");
 
@@ -70,25 +195,28 @@ void SaveConfig(char *name, void *ref, bool full) {
 	XMLUpdateNode(doc, common, false, "artwork", "%s", glMRConfig.ArtWork);
 	XMLUpdateNode(doc, common, false, "latency", glMRConfig.Latency);
 	XMLUpdateNode(doc, common, false, "drift", "%d", glMRConfig.Drift);
+	XMLUpdateNode(doc, common, false, "transport_events", "%d", glMRConfig.TransportEvents);
+	XMLUpdateNode(doc, common, false, "poll_interval", "%u:%u", glMRConfig.PollMin, glMRConfig.PollMax);
+	XMLUpdateNode(doc, common, false, "gapless", "%d", glMRConfig.Gapless);
+	XMLUpdateNode(doc, common, false, "keep_alive", "%d", glMRConfig.KeepAlive);
+	XMLUpdateNode(doc, common, false, "codec_policy", "%s", glMRConfig.CodecPolicy);
 
-	// mutex is locked here so no risk of a player being destroyed in our back
-	for (int i = 0; i < glMaxDevices; i++) {
+	for (int i = 0; i < n; i++) {
 		IXML_Node *dev_node;
 
-		if (!glMRDevices[i].Running) continue;
-		else p = &glMRDevices[i];
-
 		// new device, add nodes
-		if (!old_doc || !FindMRConfig(old_doc, p->UDN)) {
+		if (!old_doc || !FindMRConfig(old_doc, Players[i].UDN)) {
 			dev_node = XMLAddNode(doc, root, "device", NULL);
-			XMLAddNode(doc, dev_node, "udn", p->UDN);
-			XMLAddNode(doc, dev_node, "name", p->Config.Name);
-			XMLAddNode(doc, dev_node, "mac", "%02x:%02x:%02x:%02x:%02x:%02x", p->Config.mac[0],
-						p->Config.mac[1], p->Config.mac[2], p->Config.mac[3], p->Config.mac[4], p->Config.mac[5]);
-			XMLAddNode(doc, dev_node, "enabled", "%d", (int) p->Config.Enabled);
+			XMLAddNode(doc, dev_node, "udn", Players[i].UDN);
+			XMLAddNode(doc, dev_node, "name", Players[i].Name);
+			XMLAddNode(doc, dev_node, "mac", "%02x:%02x:%02x:%02x:%02x:%02x", Players[i].mac[0],
+						Players[i].mac[1], Players[i].mac[2], Players[i].mac[3], Players[i].mac[4], Players[i].mac[5]);
+			XMLAddNode(doc, dev_node, "enabled", "%d", (int) Players[i].Enabled);
 		}
 	}
 
+	free(Players);
+
 	// add devices in old XML file that has not been discovered
 	IXML_NodeList* list = ixmlDocument_getElementsByTagName((IXML_Document*) old_root, "device");
 	for (int i = 0; i < (int) ixmlNodeList_length(list); i++) {
@@ -106,15 +234,278 @@ void SaveConfig(char *name, void *ref, bool full) {
 	}
 	if (list) ixmlNodeList_free(list);
 
-	FILE* file = fopen(name, "wb");
 	char *s = ixmlDocumenttoString(doc);
-	fwrite(s, 1, strlen(s), file);
-	fclose(file);
+	int rc = WriteConfig(name, s);
+	if (rc > 0) glSaver.Writes++;
+	else if (!rc) glSaver.Skipped++;
 	free(s);
 
+	if (glSaver.Lock) pthread_mutex_unlock(glSaver.Lock);
+
 	ixmlDocument_free(doc);
 }
 
+/*----------------------------------------------------------------------------*/
+static void *SaveThread(void *args) {
+	pthread_mutex_lock(&glSaver.Mutex);
+
+	while (glSaver.Running || glSaver.Pending) {
+		if (!glSaver.Pending) {
+			pthread_cond_wait(&glSaver.Cond, &glSaver.Mutex);
+			continue;
+		}
+
+		// let a burst of discovery updates settle, unless we are asked to leave
+		int32_t wait = glSaver.Due - gettime_ms();
+		if (glSaver.Running && wait > 0) {
+			pthread_cond_reltimedwait(&glSaver.Cond, &glSaver.Mutex, wait);
+			continue;
+		}
+
+		char name[STR_LEN], snapshot[STR_LEN];
+		void **ref = glSaver.Ref;
+		bool config = glSaver.Config, snap = glSaver.Snapshot;
+		strcpy(name, glSaver.Name);
+		strcpy(snapshot, glSaver.SnapName);
+		glSaver.Pending = glSaver.Config = glSaver.Snapshot = false;
+		pthread_mutex_unlock(&glSaver.Mutex);
+
+		// both lock players one by one, so the commit lock is only taken by SaveConfig
+		if (config) {
+			LOG_DEBUG("Updating configuration %s", name);
+			SaveConfig(name, ref, false);
+		}
+		if (snap) {
+			LOG_DEBUG("Updating snapshot %s", snapshot);
+			SaveSnapshot(snapshot);
+		}
+
+		pthread_mutex_lock(&glSaver.Mutex);
+	}
+
+	pthread_mutex_unlock(&glSaver.Mutex);
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void SaveConfigInit(pthread_mutex_t *Lock) {
+	pthread_mutex_init(&glSaver.Mutex, 0);
+	pthread_cond_init(&glSaver.Cond, 0);
+	glSaver.Lock = Lock;
+	glSaver.Pending = glSaver.Config = glSaver.Snapshot = false;
+	glSaver.Running = true;
+	pthread_create(&glSaver.Thread, NULL, &SaveThread, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+void SaveConfigEnd(void) {
+	// a pending save is written before the thread exits
+	pthread_mutex_lock(&glSaver.Mutex);
+	glSaver.Running = false;
+	pthread_cond_signal(&glSaver.Cond);
+	pthread_mutex_unlock(&glSaver.Mutex);
+
+	pthread_join(glSaver.Thread, NULL);
+	pthread_cond_destroy(&glSaver.Cond);
+	pthread_mutex_destroy(&glSaver.Mutex);
+
+	LOG_INFO("configuration saved %u times (%u unchanged, %u coalesced)",
+			 glSaver.Writes, glSaver.Skipped, glSaver.Coalesced);
+}
+
+/*----------------------------------------------------------------------------*/
+void SaveConfigLater(char *name, void **ref) {
+	pthread_mutex_lock(&glSaver.Mutex);
+
+	// first request of a burst sets the deadline, others just ride along
+	if (glSaver.Pending) glSaver.Coalesced++;
+	else glSaver.Due = gettime_ms() + SAVE_DELAY;
+
+	strncpy(glSaver.Name, name, STR_LEN - 1);
+	glSaver.Ref = ref;
+	glSaver.Pending = glSaver.Config = true;
+
+	pthread_cond_signal(&glSaver.Cond);
+	pthread_mutex_unlock(&glSaver.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void SaveSnapshotLater(char *name) {
+	pthread_mutex_lock(&glSaver.Mutex);
+
+	// shares the configuration's deadline, both are usually due to the same event
+	if (glSaver.Pending) glSaver.Coalesced++;
+	else glSaver.Due = gettime_ms() + SAVE_DELAY;
+
+	strncpy(glSaver.SnapName, name, STR_LEN - 1);
+	glSaver.Pending = glSaver.Snapshot = true;
+
+	pthread_cond_signal(&glSaver.Cond);
+	pthread_mutex_unlock(&glSaver.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void SaveSnapshot(char *name) {
+	IXML_Document *doc = ixmlDocument_createDocument();
+	IXML_Node *root = XMLAddNode(doc, NULL, "snapshot", NULL);
+	struct sMR **Devices;
+
+	int Count = RegistryList(&Devices, false);
+
+	// a player can be removed at any time, so each one is read under its lock
+	for (int i = 0; i < Count; i++) {
+		struct sMR *p = Devices[i];
+		if (!CheckAndLock(p)) continue;
+
+		IXML_Node *dev_node = XMLAddNode(doc, root, "device", NULL);
+		XMLAddNode(doc, dev_node, "udn", "%s", p->UDN);
+		XMLAddNode(doc, dev_node, "location", "%s", p->DescDocURL);
+		XMLAddNode(doc, dev_node, "friendly_name", "%s", p->friendlyName);
+		XMLAddNode(doc, dev_node, "mac", "%02x:%02x:%02x:%02x:%02x:%02x", p->Config.mac[0],
+					p->Config.mac[1], p->Config.mac[2], p->Config.mac[3], p->Config.mac[4], p->Config.mac[5]);
+		XMLAddNode(doc, dev_node, "next_uri", "%d", (int) p->NextURI);
+		if (p->Master) XMLAddNode(doc, dev_node, "master", "%s", p->Master->UDN);
+		if (p->Sink) XMLAddNode(doc, dev_node, "sink", "%s", p->Sink);
+
+		for (int j = 0; j < NB_SRV; j++) {
+			struct sService *Service = p->Service + j;
+			if (!*Service->ControlURL) continue;
+
+			IXML_Node *srv_node = XMLAddNode(doc, dev_node, "service", NULL);
+			XMLAddNode(doc, srv_node, "index", "%d", j);
+			XMLAddNode(doc, srv_node, "id", "%s", Service->Id);
+			XMLAddNode(doc, srv_node, "type", "%s", Service->Type);
+			XMLAddNode(doc, srv_node, "control", "%s", Service->ControlURL);
+			XMLAddNode(doc, srv_node, "event", "%s", Service->EventURL);
+		}
+
+		pthread_mutex_unlock(&p->Mutex);
+	}
+
+	free(Devices);
+
+	char *s = ixmlDocumenttoString(doc);
+	WriteConfig(name, s);
+	free(s);
+
+	ixmlDocument_free(doc);
+}
+
+/*----------------------------------------------------------------------------*/
+static void LoadSnapshotItem(tSnapshot *Snap, struct sService *Service, char *name, char *val) {
+	if (!val) return;
+
+	if (Service) {
+		if (!strcmp(name, "id")) strncpy(Service->Id, val, RESOURCE_LENGTH - 1);
+		if (!strcmp(name, "type")) strncpy(Service->Type, val, RESOURCE_LENGTH - 1);
+		if (!strcmp(name, "control")) strncpy(Service->ControlURL, val, RESOURCE_LENGTH - 1);
+		if (!strcmp(name, "event")) strncpy(Service->EventURL, val, RESOURCE_LENGTH - 1);
+		return;
+	}
+
+	if (!strcmp(name, "udn")) strncpy(Snap->UDN, val, RESOURCE_LENGTH - 1);
+	if (!strcmp(name, "location")) strncpy(Snap->Location, val, RESOURCE_LENGTH - 1);
+	if (!strcmp(name, "friendly_name")) strncpy(Snap->friendlyName, val, STR_LEN - 1);
+	if (!strcmp(name, "master")) strncpy(Snap->Master, val, RESOURCE_LENGTH - 1);
+	if (!strcmp(name, "next_uri")) Snap->NextURI = atoi(val);
+	if (!strcmp(name, "sink") && !Snap->Sink) Snap->Sink = strdup(val);
+	if (!strcmp(name, "mac"))  {
+		unsigned mac[6] = { 0 };
+		sscanf(val,"%2x:%2x:%2x:%2x:%2x:%2x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+		for (int i = 0; i < 6; i++) Snap->mac[i] = mac[i];
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+int LoadSnapshot(char *name, tSnapshot **List) {
+	IXML_Document* doc = ixmlLoadDocument(name);
+	int Count = 0;
+
+	*List = NULL;
+	if (!doc) return 0;
+
+	IXML_NodeList* list = ixmlDocument_getElementsByTagName(doc, "device");
+	*List = calloc(ixmlNodeList_length(list) + 1, sizeof(tSnapshot));
+
+	for (unsigned i = 0; i < ixmlNodeList_length(list); i++) {
+		IXML_NodeList* l1_node_list = ixmlNode_getChildNodes(ixmlNodeList_item(list, i));
+		tSnapshot *Snap = *List + Count;
+
+		for (unsigned j = 0; j < ixmlNodeList_length(l1_node_list); j++) {
+			IXML_Node* l1_node = ixmlNodeList_item(l1_node_list, j);
+			char* n = (char*) ixmlNode_getNodeName(l1_node);
+
+			// services are stored at their index, unknown ones are ignored
+			if (!strcmp(n, "service")) {
+				char *index = XMLGetFirstElementItem((IXML_Element*) l1_node, "index");
+				int idx = index ? atoi(index) : -1;
+				NFREE(index);
+				if (idx < 0 || idx >= NB_SRV) continue;
+
+				IXML_NodeList* l2_node_list = ixmlNode_getChildNodes(l1_node);
+				for (unsigned k = 0; k < ixmlNodeList_length(l2_node_list); k++) {
+					IXML_Node* l2_node = ixmlNodeList_item(l2_node_list, k);
+					char *v = (char*) ixmlNode_getNodeValue(ixmlNode_getFirstChild(l2_node));
+					LoadSnapshotItem(Snap, Snap->Service + idx, (char*) ixmlNode_getNodeName(l2_node), v);
+				}
+				if (l2_node_list) ixmlNodeList_free(l2_node_list);
+			} else {
+				char *v = (char*) ixmlNode_getNodeValue(ixmlNode_getFirstChild(l1_node));
+				LoadSnapshotItem(Snap, NULL, n, v);
+			}
+		}
+		if (l1_node_list) ixmlNodeList_free(l1_node_list);
+
+		// an entry we cannot reach is worthless
+		if (*Snap->UDN && *Snap->Location) Count++;
+		else {
+			NFREE(Snap->Sink);
+			memset(Snap, 0, sizeof(tSnapshot));
+		}
+	}
+
+	if (list) ixmlNodeList_free(list);
+	ixmlDocument_free(doc);
+
+	return Count;
+}
+
+/*----------------------------------------------------------------------------*/
+int LoadGroups(void *ref, tGroupConfig **List) {
+	IXML_Element* elm = ixmlDocument_getElementById(ref, "airupnp");
+	int Count = 0;
+
+	*List = NULL;
+	if (!elm) return 0;
+
+	IXML_NodeList* list = ixmlDocument_getElementsByTagName((IXML_Document*) elm, "group");
+	*List = calloc(ixmlNodeList_length(list) + 1, sizeof(tGroupConfig));
+
+	for (unsigned i = 0; i < ixmlNodeList_length(list); i++) {
+		IXML_NodeList* l1_node_list = ixmlNode_getChildNodes(ixmlNodeList_item(list, i));
+		tGroupConfig *Group = *List + Count;
+
+		for (unsigned j = 0; j < ixmlNodeList_length(l1_node_list); j++) {
+			IXML_Node* l1_node = ixmlNodeList_item(l1_node_list, j);
+			char* n = (char*) ixmlNode_getNodeName(l1_node);
+			char *v = (char*) ixmlNode_getNodeValue(ixmlNode_getFirstChild(l1_node));
+
+			if (!v) continue;
+			if (!strcmp(n, "name")) strncpy(Group->Name, v, STR_LEN - 1);
+			if (!strcmp(n, "member") && Group->Count < GROUP_MEMBERS) strncpy(Group->Members[Group->Count++], v, RESOURCE_LENGTH - 1);
+		}
+		if (l1_node_list) ixmlNodeList_free(l1_node_list);
+
+		// a group needs a name to be announced and at least one player
+		if (*Group->Name && Group->Count) Count++;
+		else memset(Group, 0, sizeof(tGroupConfig));
+	}
+
+	if (list) ixmlNodeList_free(list);
+
+	return Count;
+}
+
 /*----------------------------------------------------------------------------*/
 static void LoadConfigItem(tMRConfig *Conf, char *name, char *val) {
 	if (!val) return;
@@ -131,6 +522,11 @@ static void LoadConfigItem(tMRConfig *Conf, char *name, char *val) {
 	if (!strcmp(name, "artwork")) strcpy(Conf->ArtWork, val);
 	if (!strcmp(name, "latency")) strcpy(Conf->Latency, val);
 	if (!strcmp(name, "drift")) Conf->Drift = atoi(val);
+	if (!strcmp(name, "transport_events")) Conf->TransportEvents = atoi(val);
+	if (!strcmp(name, "poll_interval")) sscanf(val, "%u:%u", &Conf->PollMin, &Conf->PollMax);
+	if (!strcmp(name, "gapless")) Conf->Gapless = atoi(val);
+	if (!strcmp(name, "keep_alive")) Conf->KeepAlive = atoi(val);
+	if (!strcmp(name, "codec_policy")) strcpy(Conf->CodecPolicy, val);
 	if (!strcmp(name, "name")) strcpy(Conf->Name, val);
 	if (!strcmp(name, "mac"))  {
 		unsigned mac[6];
@@ -155,8 +551,47 @@ static void LoadGlobalItem(char *name, char *val) {
 	if (!strcmp(name, "ports")) sscanf(val, "%hu:%hu", &glPortBase, &glPortRange);
  }
 
+/*----------------------------------------------------------------------------*/
+static void IndexBuild(IXML_Document *doc) {
+	for (int i = 0; i < CONFIG_BUCKETS; i++) {
+		while (glIndex.Buckets[i]) {
+			tConfigEntry *Entry = glIndex.Buckets[i];
+			glIndex.Buckets[i] = Entry->Next;
+			free(Entry);
+		}
+	}
+
+	glIndex.Doc = doc;
+	if (!doc) return;
+
+	IXML_Element* elm = ixmlDocument_getElementById(doc, "airupnp");
+	IXML_NodeList* l1_node_list = ixmlDocument_getElementsByTagName((IXML_Document*) elm, "udn");
+
+	for (unsigned i = 0; i < ixmlNodeList_length(l1_node_list); i++) {
+		IXML_Node* l1_node = ixmlNodeList_item(l1_node_list, i);
+		char* v = (char*) ixmlNode_getNodeValue(ixmlNode_getFirstChild(l1_node));
+		if (!v) continue;
+
+		tConfigEntry *Entry = malloc(sizeof(tConfigEntry));
+		uint32_t Bucket = hash32(v) % CONFIG_BUCKETS;
+		Entry->UDN = v;
+		Entry->Node = ixmlNode_getParentNode(l1_node);
+		Entry->Next = glIndex.Buckets[Bucket];
+		glIndex.Buckets[Bucket] = Entry;
+	}
+
+	if (l1_node_list) ixmlNodeList_free(l1_node_list);
+}
+
 /*----------------------------------------------------------------------------*/
 void *FindMRConfig(void *ref, char *UDN) {
+	// loaded document is indexed, others (while saving) are scanned
+	if (ref && ref == glIndex.Doc) {
+		tConfigEntry *Entry = glIndex.Buckets[hash32(UDN) % CONFIG_BUCKETS];
+		for (; Entry && strcmp(Entry->UDN, UDN); Entry = Entry->Next);
+		return Entry ? Entry->Node : NULL;
+	}
+
 	IXML_Node	*device = NULL;
 	IXML_Document *doc = (IXML_Document*) ref;
 	IXML_Element* elm = ixmlDocument_getElementById(doc, "airupnp");
@@ -197,6 +632,10 @@ void *LoadMRConfig(void *ref, char *UDN, tMRConfig *Conf) {
 
 /*----------------------------------------------------------------------------*/
 void *LoadConfig(char *name, tMRConfig *Conf) {
+	// stamp before reading so that an edit made in between is not missed
+	strncpy(glWatch.Name, name, STR_LEN - 1);
+	WatchStamp();
+
 	IXML_Document* doc = ixmlLoadDocument(name);
 	if (!doc) return NULL;
 
@@ -221,7 +660,7 @@ void *LoadConfig(char *name, tMRConfig *Conf) {
 			char* n = (char*) ixmlNode_getNodeName(l1_node);
 			IXML_Node* l1_1_node = ixmlNode_getFirstChild(l1_node);
 			char *v = (char*) ixmlNode_getNodeValue(l1_1_node);
-			LoadConfigItem(&glMRConfig, n, v);
+			LoadConfigItem(Conf, n, v);
 		}
 		if (l1_node_list) ixmlNodeList_free(l1_node_list);
 	}
@@ -234,14 +673,23 @@ void *LoadConfig(char *name, tMRConfig *Conf) {
 			char* n = (char*) ixmlNode_getNodeName(l1_node);
 			IXML_Node* l1_1_node = ixmlNode_getFirstChild(l1_node);
 			char* v = (char*) ixmlNode_getNodeValue(l1_1_node);
-			LoadConfigItem(&glMRConfig, n, v);
+			LoadConfigItem(Conf, n, v);
 		}
 		if (l1_node_list) ixmlNodeList_free(l1_node_list);
 	}
 
 
+	IndexBuild(doc);
 	return doc;
 }
 
+/*----------------------------------------------------------------------------*/
+void FreeConfig(void *ref) {
+	if (ref == glIndex.Doc) IndexBuild(NULL);
+	if (ref) ixmlDocument_free(ref);
+}
 
-
+/*----------------------------------------------------------------------------*/
+bool ConfigChanged(void) {
+	return *glWatch.Name && WatchStamp();
+}
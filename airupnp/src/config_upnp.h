@@ -14,8 +14,39 @@
 #include <stdio.h>
 
 #include "ixml.h" /* for IXML_Document, IXML_Element */
+#include "airupnp.h"
 
-void	  	SaveConfig(char *name, void *ref, bool full);
+// what is needed to publish a renderer before it is discovered again
+typedef struct sSnapshot {
+	char		UDN[RESOURCE_LENGTH];
+	char		Location[RESOURCE_LENGTH];
+	char		Master[RESOURCE_LENGTH];
+	char		friendlyName[STR_LEN];
+	uint8_t		mac[6];
+	bool		NextURI;
+	char		*Sink;
+	struct sService Service[NB_SRV];
+} tSnapshot;
+
+#define GROUP_MEMBERS	16
+
+// a virtual group is announced once and relayed to all its members
+typedef struct sGroupConfig {
+	char		Name[STR_LEN];
+	char		Members[GROUP_MEMBERS][RESOURCE_LENGTH];
+	int			Count;
+} tGroupConfig;
+
+void	  	SaveConfig(char *name, void **ref, bool full);
+void		SaveConfigLater(char *name, void **ref);
+void		SaveConfigInit(pthread_mutex_t *Lock);
+void		SaveConfigEnd(void);
+void		SaveSnapshot(char *name);
+void		SaveSnapshotLater(char *name);
+int			LoadSnapshot(char *name, tSnapshot **List);
+int			LoadGroups(void *ref, tGroupConfig **List);
 void*		LoadConfig(char *name, struct sMRConfig *Conf);
 void*		FindMRConfig(void *ref, char *UDN);
 void*		LoadMRConfig(void *ref, char *UDN, struct sMRConfig *Conf);
+void		FreeConfig(void *ref);
+bool		ConfigChanged(void);
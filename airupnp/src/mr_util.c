@@ -8,6 +8,8 @@
  */
 
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 
 #include "platform.h"
 #include "ixml.h"
@@ -16,23 +18,93 @@
 #include "cross_thread.h"
 #include "cross_log.h"
 #include "avt_util.h"
+#include "soap_util.h"
 #include "mr_util.h"
+#include "registry.h"
 
 extern log_level	util_loglevel;
 static log_level 	*loglevel = &util_loglevel;
 
-static IXML_Node*	_getAttributeNode(IXML_Node *node, char *SearchAttr);
+static struct sMR*	_indexFind(int Type, const char *Key);
 int 				_voidHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) { return 0; }
 
+/*
+ all renderers share one poll thread, each device being in a binary heap sorted
+ by its next deadline. Devices that have nothing to poll are simply not in the
+ heap so they cost nothing. Locking order is device's mutex then poller's mutex
+*/
+static struct {
+	bool			Running, Paused, Busy;
+	struct sMR		**Heap;
+	int				Count, Size;
+	uint32_t		(*Handler)(struct sMR *Device);
+	pthread_t		Thread;
+	pthread_mutex_t	Mutex;
+	pthread_cond_t	Cond;
+} glPoller;
+
+/*
+ devices are indexed by UDN, control URL, SID and description URL so that libupnp callbacks do
+ not have to scan the whole table. Keys are copied, so the index never reads a
+ device's strings and lookups only hold the read lock. Table doubles in size
+ as soon as it has more entries than buckets
+*/
+enum { INDEX_UDN, INDEX_CURL, INDEX_SID, INDEX_DESC };
+
+typedef struct sIndexEntry {
+	struct sIndexEntry	*Next;
+	uint32_t		Hash;
+	int				Type;
+	struct sMR		*Device;
+	char			Key[];
+} tIndexEntry;
+
+static struct {
+	pthread_rwlock_t Lock;
+	tIndexEntry		**Buckets;
+	int				Count, Size;
+} glIndex;
+
+/*
+ Sonos topology is the same for all players of a household, so it is cached
+ as a flat list of members, one list per household. Only one player of each
+ household (the Subscriber) subscribes to topology events
+*/
+#define TOPOLOGY_TTL	(60*1000)
+
+struct sZoneMember {
+	char	*UUID, *Coordinator, *ZoneName;
+};
+
+typedef struct sHousehold {
+	struct sHousehold	*Next;
+	struct sZoneMember	*Members;
+	int					Count;
+	uint32_t			Stamp;
+	char				*Subscriber;
+	bool				Evented, Stale;
+} tHousehold;
+
+static struct {
+	pthread_mutex_t	Mutex;
+	tHousehold		*List;
+} glTopology;
+
+// a libupnp or RAOP callback's device is always one that CheckAndLock can verify
+static registry_t	glRegistry;
+
 /*----------------------------------------------------------------------------*/
 int CalcGroupVolume(struct sMR *Device) {
-	int i, n = 0;
+	struct sMR *Members[MAX_MEMBERS];
+	int n = 0, Count;
 	double GroupVolume = 0;
 
 	if (!*Device->Service[GRP_REND_SRV_IDX].ControlURL) return -1;
 
-	for (i = 0; i < glMaxDevices; i++) {
-		struct sMR *p = glMRDevices + i;
+	Count = GroupMembers(Device, Members, MAX_MEMBERS);
+
+	for (int i = 0; i < Count; i++) {
+		struct sMR *p = Members[i];
 		if (p->Running && (p == Device || p->Master == Device)) {
 			if (p->Volume == -1) p->Volume = CtrlGetVolume(p);
 
@@ -48,15 +120,184 @@ int CalcGroupVolume(struct sMR *Device) {
 }
 
 /*----------------------------------------------------------------------------*/
-struct sMR *GetMaster(struct sMR *Device, char **Name)
-{
-	IXML_Document *ActionNode = NULL, *Response;
-	char *Body;
-	struct sMR *Master = NULL;
-	struct sService *Service = &Device->Service[TOPOLOGY_IDX];
-	bool done = false;
+static tHousehold *_parseTopology(const char *State) {
+	IXML_Document *Doc = ixmlParseBuffer(State);
+	IXML_NodeList *GroupList;
+	tHousehold *Household;
+
+	if (!Doc) return NULL;
+
+	Household = calloc(1, sizeof(tHousehold));
+	GroupList = ixmlDocument_getElementsByTagName(Doc, "ZoneGroup");
+
+	for (int i = 0; GroupList && i < (int) ixmlNodeList_length(GroupList); i++) {
+		IXML_Node* Group = ixmlNodeList_item(GroupList, i);
+		const char* Coordinator = ixmlElement_getAttribute((IXML_Element*) Group, "Coordinator");
+		IXML_NodeList* MemberList = ixmlDocument_getElementsByTagName((IXML_Document*) Group, "ZoneGroupMember");
+
+		for (int j = 0; j < (int) ixmlNodeList_length(MemberList); j++) {
+			IXML_Node* Member = ixmlNodeList_item(MemberList, j);
+			const char* UUID = ixmlElement_getAttribute((IXML_Element*) Member, "UUID");
+			const char* ZoneName = ixmlElement_getAttribute((IXML_Element*) Member, "ZoneName");
+			struct sZoneMember *p;
+
+			if (!UUID) continue;
+
+			Household->Members = realloc(Household->Members, (Household->Count + 1) * sizeof(struct sZoneMember));
+			p = Household->Members + Household->Count++;
+			p->UUID = strdup(UUID);
+			p->Coordinator = Coordinator ? strdup(Coordinator) : NULL;
+			p->ZoneName = ZoneName ? strdup(ZoneName) : NULL;
+		}
+
+		if (MemberList) ixmlNodeList_free(MemberList);
+	}
+
+	if (GroupList) ixmlNodeList_free(GroupList);
+	ixmlDocument_free(Doc);
+
+	return Household;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _freeHousehold(tHousehold *Household) {
+	for (int i = 0; i < Household->Count; i++) {
+		NFREE(Household->Members[i].UUID);
+		NFREE(Household->Members[i].Coordinator);
+		NFREE(Household->Members[i].ZoneName);
+	}
+	NFREE(Household->Members);
+	NFREE(Household->Subscriber);
+	free(Household);
+}
+
+/*----------------------------------------------------------------------------*/
+static struct sZoneMember *_findMember(const char *UUID, tHousehold **Household) {
+	for (*Household = glTopology.List; *Household; *Household = (*Household)->Next) {
+		for (int i = 0; i < (*Household)->Count; i++) {
+			if (!strcasecmp((*Household)->Members[i].UUID, UUID)) return (*Household)->Members + i;
+		}
+	}
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _replaceHousehold(tHousehold *Household, bool Evented) {
+	Household->Stamp = gettime_ms();
+	Household->Evented = Evented;
+
+	// a household is identified by its members, replace any that shares one
+	for (tHousehold **p = &glTopology.List; *p;) {
+		bool Shared = false;
+
+		for (int i = 0; !Shared && i < (*p)->Count; i++) {
+			for (int j = 0; !Shared && j < Household->Count; j++) {
+				Shared = !strcasecmp((*p)->Members[i].UUID, Household->Members[j].UUID);
+			}
+		}
+
+		if (Shared) {
+			tHousehold *Old = *p;
+			// subscription is still alive, it just carries a new list
+			if (Old->Subscriber && !Household->Subscriber) {
+				Household->Subscriber = Old->Subscriber;
+				Household->Evented |= Old->Evented;
+				Old->Subscriber = NULL;
+			}
+			*p = Old->Next;
+			_freeHousehold(Old);
+		} else p = &(*p)->Next;
+	}
+
+	Household->Next = glTopology.List;
+	glTopology.List = Household;
+}
+
+/*----------------------------------------------------------------------------*/
+void TopologyUpdate(struct sMR *Device, const char *State) {
+	tHousehold *Household = State && *State ? _parseTopology(State) : NULL;
+
+	pthread_mutex_lock(&glTopology.Mutex);
+
+	if (Household) {
+		LOG_DEBUG("[%p]: topology event with %d members", Device, Household->Count);
+		_replaceHousehold(Household, true);
+	} else {
+		char UUID[RESOURCE_LENGTH] = "";
+		struct sZoneMember *Member;
+
+		// event without the state, will have to ask for it
+		sscanf(Device->UDN, "uuid:%s", UUID);
+		if ((Member = _findMember(UUID, &Household)) != NULL) Household->Stale = true;
+	}
+
+	pthread_mutex_unlock(&glTopology.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+bool TopologySubscribe(struct sMR *Device) {
+	char UUID[RESOURCE_LENGTH] = "";
+	tHousehold *Household;
+	bool Claimed = false;
+
+	sscanf(Device->UDN, "uuid:%s", UUID);
+	pthread_mutex_lock(&glTopology.Mutex);
+
+	// unknown household will be claimed once GetMaster has fetched it
+	if (_findMember(UUID, &Household) && !Household->Subscriber) {
+		Household->Subscriber = strdup(Device->UDN);
+		Claimed = true;
+	}
 
-	if (!*Service->ControlURL) return NULL;
+	pthread_mutex_unlock(&glTopology.Mutex);
+
+	return Claimed;
+}
+
+/*----------------------------------------------------------------------------*/
+void TopologyUnsubscribed(struct sMR *Device) {
+	pthread_mutex_lock(&glTopology.Mutex);
+
+	for (tHousehold *p = glTopology.List; p; p = p->Next) {
+		if (!p->Subscriber || strcasecmp(p->Subscriber, Device->UDN)) continue;
+		// no more events, so cached list now expires like a fetched one
+		NFREE(p->Subscriber);
+		p->Evented = false;
+	}
+
+	pthread_mutex_unlock(&glTopology.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void TopologyInvalidate(void) {
+	pthread_mutex_lock(&glTopology.Mutex);
+	for (tHousehold *p = glTopology.List; p; p = p->Next) p->Stale = true;
+	pthread_mutex_unlock(&glTopology.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void TopologyInit(void) {
+	glTopology.List = NULL;
+	pthread_mutex_init(&glTopology.Mutex, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+void TopologyEnd(void) {
+	while (glTopology.List) {
+		tHousehold *p = glTopology.List;
+		glTopology.List = p->Next;
+		_freeHousehold(p);
+	}
+	pthread_mutex_destroy(&glTopology.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static tHousehold *_fetchTopology(struct sMR *Device) {
+	IXML_Document *ActionNode = NULL, *Response = NULL;
+	struct sService *Service = &Device->Service[TOPOLOGY_IDX];
+	tHousehold *Household;
+	char *Body;
 
 	ActionNode = UpnpMakeAction("GetZoneGroupState", Service->Type, 0, NULL);
 
@@ -68,88 +309,84 @@ struct sMR *GetMaster(struct sMR *Device, char **Name)
 	Body = XMLGetFirstDocumentItem(Response, "ZoneGroupState", true);
 	if (Response) ixmlDocument_free(Response);
 
-	Response = ixmlParseBuffer(Body);
+	Household = Body ? _parseTopology(Body) : NULL;
 	NFREE(Body);
 
-	if (Response) {
-		char myUUID[RESOURCE_LENGTH] = "";
-		IXML_NodeList *GroupList = ixmlDocument_getElementsByTagName(Response, "ZoneGroup");
-		bool inGroup = false;
-		int i;
-
-		sscanf(Device->UDN, "uuid:%s", myUUID);
-
-		/* Only the coordinator of the group *we* belong to can be our master.
-+		   Scanning every group's coordinator against every known device (as was
-+		   done here) latches onto the first already-discovered coordinator of an
-+		   unrelated group, which silently demotes this player to a slave and
-+		   stops it being published at all - non-deterministically, since it
-+		   depends on discovery order. */
-		for (i = 0; !inGroup && GroupList && i < (int)ixmlNodeList_length(GroupList); i++) {
-			IXML_Node* Group = ixmlNodeList_item(GroupList, i);
-			const char* Coordinator = ixmlElement_getAttribute((IXML_Element*)Group, "Coordinator");
-			IXML_NodeList* MemberList = ixmlDocument_getElementsByTagName((IXML_Document*)Group, "ZoneGroupMember");
-			int j;
-
-			// are we a member of this group?
-			for (j = 0; !inGroup && j < (int)ixmlNodeList_length(MemberList); j++) {
-				IXML_Node* Member = ixmlNodeList_item(MemberList, j);
-				const char* UUID = ixmlElement_getAttribute((IXML_Element*)Member, "UUID");
-				const char* ZoneName;
-
-				if (!UUID || strcasecmp(myUUID, UUID)) continue;
-				inGroup = true;
-				ZoneName = ixmlElement_getAttribute((IXML_Element*)Member, "ZoneName");
-				if (ZoneName) {
-					NFREE(*Name);
-					*Name = strdup(ZoneName);
-				}
-			}
-		
-			if (inGroup && Coordinator) {
-				if (!strcasecmp(myUUID, Coordinator)) {
-					// we are the coordinator, so we are our own master
-					done = true;
-				} else {
-					for (int k = 0; !done && k < glMaxDevices; k++) {
-						if (glMRDevices[k].Running && strcasestr(glMRDevices[k].UDN, Coordinator)) {
-							Master = glMRDevices + k;
-							LOG_DEBUG("Found Master %s %s", myUUID, Master->UDN);
-							done = true;
-						}
-					}
-				}
-			}
+	return Household;
+}
+
+/*----------------------------------------------------------------------------*/
+struct sMR *GetMaster(struct sMR *Device, char **Name)
+{
+	char myUUID[RESOURCE_LENGTH] = "";
+	struct sMR *Master = NULL;
+	struct sZoneMember *Member;
+	tHousehold *Household;
+
+	if (!*Device->Service[TOPOLOGY_IDX].ControlURL) return NULL;
+
+	sscanf(Device->UDN, "uuid:%s", myUUID);
+
+	/*
+	All players of a household share the same topology so it is only requested
+	when we don't know it or it is old. It is refreshed by ZoneGroupTopology
+	events as well, in which case it is not allowed to age
+	*/
+	pthread_mutex_lock(&glTopology.Mutex);
+	Member = _findMember(myUUID, &Household);
+
+	if (!Member || Household->Stale || (!Household->Evented && gettime_ms() - Household->Stamp > TOPOLOGY_TTL)) {
+		pthread_mutex_unlock(&glTopology.Mutex);
+
+		if ((Household = _fetchTopology(Device)) == NULL) return NULL;
+		LOG_DEBUG("[%p]: topology requested (%d members)", Device, Household->Count);
 
-			ixmlNodeList_free(MemberList);
+		pthread_mutex_lock(&glTopology.Mutex);
+		_replaceHousehold(Household, false);
+		Member = _findMember(myUUID, &Household);
+	}
+
+	/* Only the coordinator of the group *we* belong to can be our master.
+	   Scanning every group's coordinator against every known device latches
+	   onto the first already-discovered coordinator of an unrelated group,
+	   which silently demotes this player to a slave and stops it being
+	   published at all - non-deterministically, since it depends on discovery
+	   order. */
+	if (!Member) {
+		// Not listed in any group: it cannot be anyone's slave, so treat it as standalone
+		LOG_INFO("[%p]: not in any zone group, treating as standalone", Device);
+	} else {
+		if (Member->ZoneName) {
+			NFREE(*Name);
+			*Name = strdup(Member->ZoneName);
 		}
 
-		if (!done) {
-			LOG_INFO("[%p]: Master not discovered yet, assigning to self", Device);
-			if (inGroup) {
+		if (Member->Coordinator && strcasecmp(myUUID, Member->Coordinator)) {
+			char UDN[RESOURCE_LENGTH];
+
+			snprintf(UDN, sizeof(UDN), "uuid:%s", Member->Coordinator);
+			if ((Master = UDN2Device(UDN)) != NULL) {
+				LOG_DEBUG("Found Master %s %s", myUUID, Master->UDN);
+			} else {
 				// we are a slave but the coordinator is not discovered yet
-				Master = Device;
 				LOG_INFO("[%p]: Master not discovered yet, assigning to self", Device);
-				
-			}
-			else {
-				/* Not listed in any group: it cannot be anyone's slave, so treat
-				   it as standalone rather than hiding it forever. */
-				LOG_INFO("[%p]: not in any zone group, treating as standalone", Device);
+				Master = Device;
 			}
 		}
-
-		ixmlNodeList_free(GroupList);
-		ixmlDocument_free(Response);
 	}
 
+	pthread_mutex_unlock(&glTopology.Mutex);
+
 	return Master;
 }
 
 /*----------------------------------------------------------------------------*/
 void FlushMRDevices(void) {
-	for (int i = 0; i < glMaxDevices; i++) {
-		struct sMR *p = &glMRDevices[i];
+	struct sMR **Devices;
+	int Count = RegistryList(&Devices, false);
+
+	for (int i = 0; i < Count; i++) {
+		struct sMR *p = Devices[i];
 		pthread_mutex_lock(&p->Mutex);
 		if (p->Running) {
 			// critical to stop the device otherwise libupnp might wait forever
@@ -159,6 +396,8 @@ void FlushMRDevices(void) {
 			DelMRDevice(p);
 		} else pthread_mutex_unlock(&p->Mutex);
 	}
+
+	free(Devices);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -166,46 +405,35 @@ void DelMRDevice(struct sMR *p) {
 	// try to unsubscribe but missing players will not succeed and as a result
 	// terminating the libupnp takes a while ...
 	for (int i = 0; i < NB_SRV; i++) {
-		if (p->Service[i].TimeOut) {
+		if (p->Service[i].TimeOut && *p->Service[i].SID) {
 			UpnpUnSubscribeAsync(glControlPointHandle, p->Service[i].SID, _voidHandler, NULL);
 		}
 	}
 
-	p->Running = false;
+	// another player of the household will take over topology events
+	TopologyUnsubscribed(p);
 
-	// kick-up all sleepers and join player's thread
-	crossthreads_wake();
+	// poll thread checks Running once it has the mutex, so no need to wait for it
+	PollCancel(p);
+	SoapFlush(p);
+	AVTActionFlush(p);
+	AVTTemplateFlush(p);
+	UnIndexDevice(p);
+	NFREE(p->Sink);
+	p->Running = false;
+	RegistryRelease(p);
 
 	pthread_mutex_unlock(&p->Mutex);
-	pthread_join(p->Thread, NULL);
 }
 
 /*----------------------------------------------------------------------------*/
 struct sMR* CURL2Device(const UpnpString *CtrlURL) {
-	for (int i = 0; i < glMaxDevices; i++) {
-		if (!glMRDevices[i].Running) continue;
-		for (int j = 0; j < NB_SRV; j++) {
-			if (!strcmp(glMRDevices[i].Service[j].ControlURL, UpnpString_get_String(CtrlURL))) {
-				return &glMRDevices[i];
-			}
-		}
-	}
-
-	return NULL;
+	return _indexFind(INDEX_CURL, UpnpString_get_String(CtrlURL));
 }
 
 /*----------------------------------------------------------------------------*/
 struct sMR* SID2Device(const UpnpString *SID) {
-	for (int i = 0; i < glMaxDevices; i++) {
-		if (!glMRDevices[i].Running) continue;
-		for (int j = 0; j < NB_SRV; j++) {
-			if (!strcmp(glMRDevices[i].Service[j].SID, UpnpString_get_String(SID))) {
-				return &glMRDevices[i];
-			}
-		}
-	}
-
-	return NULL;
+	return _indexFind(INDEX_SID, UpnpString_get_String(SID));
 }
 
 /*----------------------------------------------------------------------------*/
@@ -219,11 +447,12 @@ struct sService *EventURL2Service(const UpnpString *URL, struct sService *s) {
 
 /*----------------------------------------------------------------------------*/
 struct sMR* UDN2Device(const char *UDN) {
-	for (int i = 0; i < glMaxDevices; i++) {
-		if (glMRDevices[i].Running && !strcmp(glMRDevices[i].UDN, UDN)) return &glMRDevices[i];
-	}
+	return _indexFind(INDEX_UDN, UDN);
+}
 
-	return NULL;
+/*----------------------------------------------------------------------------*/
+struct sMR* DescURL2Device(const char *URL) {
+	return _indexFind(INDEX_DESC, URL);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -244,6 +473,190 @@ bool CheckAndLock(struct sMR *Device) {
 }
 
 
+/*----------------------------------------------------------------------------*/
+/* 																			  */
+/* Poll scheduler															  */
+/* 																			  */
+/*----------------------------------------------------------------------------*/
+
+#define DEADLINE_BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+/*----------------------------------------------------------------------------*/
+static void _heapSwap(int i, int j) {
+	struct sMR *p = glPoller.Heap[i];
+
+	glPoller.Heap[i] = glPoller.Heap[j];
+	glPoller.Heap[j] = p;
+	glPoller.Heap[i]->PollIndex = i;
+	glPoller.Heap[j]->PollIndex = j;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _heapUp(int i) {
+	while (i && DEADLINE_BEFORE(glPoller.Heap[i]->PollDeadline, glPoller.Heap[(i - 1) / 2]->PollDeadline)) {
+		_heapSwap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void _heapDown(int i) {
+	while (true) {
+		int next = i, child = 2 * i + 1;
+
+		if (child < glPoller.Count && DEADLINE_BEFORE(glPoller.Heap[child]->PollDeadline, glPoller.Heap[next]->PollDeadline)) next = child;
+		child++;
+		if (child < glPoller.Count && DEADLINE_BEFORE(glPoller.Heap[child]->PollDeadline, glPoller.Heap[next]->PollDeadline)) next = child;
+		if (next == i) break;
+
+		_heapSwap(i, next);
+		i = next;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void _heapRemove(int i) {
+	struct sMR *p = glPoller.Heap[i];
+
+	if (i != --glPoller.Count) {
+		glPoller.Heap[i] = glPoller.Heap[glPoller.Count];
+		glPoller.Heap[i]->PollIndex = i;
+		_heapDown(i);
+		_heapUp(i);
+	}
+
+	p->PollIndex = -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void *PollThread(void *args) {
+	pthread_mutex_lock(&glPoller.Mutex);
+
+	while (glPoller.Running) {
+		struct sMR *Device;
+		uint32_t Delay, now = gettime_ms();
+
+		// nothing to do, sleep until a device is (re)scheduled or we resume
+		if (!glPoller.Count || glPoller.Paused) {
+			pthread_cond_wait(&glPoller.Cond, &glPoller.Mutex);
+			continue;
+		}
+
+		Device = glPoller.Heap[0];
+
+		// not due yet, sleep until first deadline or until heap is modified
+		if (DEADLINE_BEFORE(now, Device->PollDeadline)) {
+			struct timespec ts;
+			uint32_t wait = Device->PollDeadline - now;
+
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_sec += wait / 1000;
+			ts.tv_nsec += (wait % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+
+			pthread_cond_timedwait(&glPoller.Cond, &glPoller.Mutex, &ts);
+			continue;
+		}
+
+		_heapRemove(0);
+		glPoller.Busy = true;
+		pthread_mutex_unlock(&glPoller.Mutex);
+
+		// device might have been removed in our back (mutexes are never destroyed)
+		if (CheckAndLock(Device)) {
+			if ((Delay = glPoller.Handler(Device)) != 0) PollSchedule(Device, Delay);
+			pthread_mutex_unlock(&Device->Mutex);
+		}
+
+		pthread_mutex_lock(&glPoller.Mutex);
+		glPoller.Busy = false;
+		// PollPause might be waiting for us
+		pthread_cond_broadcast(&glPoller.Cond);
+	}
+
+	pthread_mutex_unlock(&glPoller.Mutex);
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void PollInit(uint32_t (*Handler)(struct sMR *Device)) {
+	glPoller.Handler = Handler;
+	glPoller.Count = 0;
+	glPoller.Size = 16;
+	glPoller.Heap = calloc(glPoller.Size, sizeof(struct sMR*));
+	glPoller.Running = true;
+	glPoller.Paused = glPoller.Busy = false;
+
+	pthread_mutex_init(&glPoller.Mutex, 0);
+	pthread_cond_init(&glPoller.Cond, 0);
+	pthread_create(&glPoller.Thread, NULL, &PollThread, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+void PollEnd(void) {
+	pthread_mutex_lock(&glPoller.Mutex);
+	glPoller.Running = false;
+	pthread_cond_signal(&glPoller.Cond);
+	pthread_mutex_unlock(&glPoller.Mutex);
+
+	pthread_join(glPoller.Thread, NULL);
+	pthread_mutex_destroy(&glPoller.Mutex);
+	pthread_cond_destroy(&glPoller.Cond);
+	NFREE(glPoller.Heap);
+}
+
+/*----------------------------------------------------------------------------*/
+void PollSchedule(struct sMR *Device, uint32_t Delay) {
+	uint32_t Deadline = gettime_ms() + Delay;
+
+	pthread_mutex_lock(&glPoller.Mutex);
+
+	// already scheduled, only move it earlier
+	if (Device->PollIndex >= 0) {
+		if (DEADLINE_BEFORE(Deadline, Device->PollDeadline)) {
+			Device->PollDeadline = Deadline;
+			_heapUp(Device->PollIndex);
+		}
+	} else {
+		if (glPoller.Count == glPoller.Size) {
+			glPoller.Size *= 2;
+			glPoller.Heap = realloc(glPoller.Heap, glPoller.Size * sizeof(struct sMR*));
+		}
+		Device->PollDeadline = Deadline;
+		Device->PollIndex = glPoller.Count;
+		glPoller.Heap[glPoller.Count++] = Device;
+		_heapUp(Device->PollIndex);
+	}
+
+	// only need to wake-up poller if we are the new first one
+	if (glPoller.Heap[0] == Device) pthread_cond_signal(&glPoller.Cond);
+
+	pthread_mutex_unlock(&glPoller.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void PollPause(bool Pause) {
+	pthread_mutex_lock(&glPoller.Mutex);
+
+	// devices stay scheduled, but no handler runs once this returns
+	glPoller.Paused = Pause;
+	if (Pause) while (glPoller.Busy) pthread_cond_wait(&glPoller.Cond, &glPoller.Mutex);
+	else pthread_cond_broadcast(&glPoller.Cond);
+
+	pthread_mutex_unlock(&glPoller.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void PollCancel(struct sMR *Device) {
+	pthread_mutex_lock(&glPoller.Mutex);
+	if (Device->PollIndex >= 0) _heapRemove(Device->PollIndex);
+	pthread_mutex_unlock(&glPoller.Mutex);
+}
+
 /*----------------------------------------------------------------------------*/
 /* 																			  */
 /* XML utils															  */
@@ -386,68 +799,104 @@ bool XMLFindAction(const char* base, char* service, char* action) {
 }
 
 /*----------------------------------------------------------------------------*/
-char *XMLGetChangeItem(IXML_Document *doc, char *Tag, char *SearchAttr, char *SearchVal, char *RetAttr) {
-	char *ret = NULL;
+static enum eMRstate _slice2State(const char *State, size_t Len) {
+	if (Len == 7 && !strncmp(State, "PLAYING", Len)) return PLAYING;
+	if (Len == 7 && !strncmp(State, "STOPPED", Len)) return STOPPED;
+	if (Len == 15 && !strncmp(State, "PAUSED_PLAYBACK", Len)) return PAUSED;
+	if (Len == 13 && !strncmp(State, "TRANSITIONING", Len)) return TRANSITIONING;
+	return UNKNOWN;
+}
 
-	IXML_Element* LastChange = ixmlDocument_getElementById(doc, "LastChange");
-	if (!LastChange) return NULL;
+/*----------------------------------------------------------------------------*/
+bool XMLParseLastChange(IXML_Document *doc, tLastChange *Change) {
+	IXML_Element *LastChange = ixmlDocument_getElementById(doc, "LastChange");
+	IXML_Node *node;
+	const char *p;
 
-	IXML_Node* node = ixmlNode_getFirstChild((IXML_Node*) LastChange);
-	if (!node) return NULL;
+	memset(Change, 0, sizeof(tLastChange));
+	Change->Volume = Change->Mute = -1;
 
-	char* buf = (char*) ixmlNode_getNodeValue(node);
-	if (!buf) return NULL;
+	if (!LastChange || (node = ixmlNode_getFirstChild((IXML_Node*) LastChange)) == NULL) return false;
+	if ((p = ixmlNode_getNodeValue(node)) == NULL) return false;
 
-	IXML_Document* ItemDoc = ixmlParseBuffer(buf);
-	if (!ItemDoc) return NULL;
+	/*
+	LastChange is an XML document of its own, already un-escaped by libupnp. It
+	is flat, every variable being <Name [channel="x"] val="y"/>, so there is no
+	need to build a DOM, just scan it once and keep pointers to the values
+	*/
+	while ((p = strchr(p, '<')) != NULL) {
+		const char *Name, *Channel = NULL, *Val = NULL;
+		size_t NameLen, ChannelLen = 0, ValLen = 0;
 
-	IXML_NodeList* List = ixmlDocument_getElementsByTagName(ItemDoc, Tag);
-	if (!List) {
-		ixmlDocument_free(ItemDoc);
-		return NULL;
-	}
+		// closing tags, comments and declarations
+		if (*++p == '/' || *p == '!' || *p == '?') continue;
 
-	for (unsigned i = 0; i < ixmlNodeList_length(List); i++) {
-		IXML_Node *node = ixmlNodeList_item(List, i);
-		IXML_Node *attr = _getAttributeNode(node, SearchAttr);
+		for (Name = p; *p && !isspace((unsigned char) *p) && *p != '/' && *p != '>'; p++) {
+			if (*p == ':') Name = p + 1;
+		}
+		NameLen = p - Name;
 
-		if (!attr) continue;
+		while (*p && *p != '>') {
+			const char *Attr, *Value;
+			size_t AttrLen;
+			char Quote;
 
-		if (!strcasecmp(ixmlNode_getNodeValue(attr), SearchVal)) {
-			if ((node = ixmlNode_getNextSibling(attr)) == NULL)
-				if ((node = ixmlNode_getPreviousSibling(attr)) == NULL) continue;
-			if (!strcasecmp(ixmlNode_getNodeName(node), "val")) {
-				ret = strdup(ixmlNode_getNodeValue(node));
-				break;
-			}
-		}
-	}
+			while (isspace((unsigned char) *p) || *p == '/') p++;
+			if (!*p || *p == '>') break;
 
-	ixmlNodeList_free(List);
-	ixmlDocument_free(ItemDoc);
+			for (Attr = p; *p && *p != '=' && *p != '>' && !isspace((unsigned char) *p); p++);
+			AttrLen = p - Attr;
 
-	return ret;
-}
+			while (isspace((unsigned char) *p)) p++;
+			if (*p != '=') continue;
+			for (p++; isspace((unsigned char) *p); p++);
+			if (*p != '"' && *p != '\'') continue;
 
-/*----------------------------------------------------------------------------*/
-static IXML_Node *_getAttributeNode(IXML_Node *node, char *SearchAttr) {
-	IXML_Node *ret = NULL;
-	IXML_NamedNodeMap *map = ixmlNode_getAttributes(node);
-	
-	/*
-	supposed to act like but case insensitive
-	ixmlElement_getAttributeNode((IXML_Element*) node, SearchAttr);
-	*/
+			for (Quote = *p++, Value = p; *p && *p != Quote; p++);
+			if (!*p) break;
+
+			if (AttrLen == 7 && !strncasecmp(Attr, "channel", AttrLen)) {
+				Channel = Value;
+				ChannelLen = p - Value;
+			} else if (AttrLen == 3 && !strncasecmp(Attr, "val", AttrLen)) {
+				Val = Value;
+				ValLen = p - Value;
+			}
 
-	for (int i = 0; i < ixmlNamedNodeMap_getLength(map); i++) {
-		ret = ixmlNamedNodeMap_item(map, i);
-		if (strcasecmp(ixmlNode_getNodeName(ret), SearchAttr)) ret = NULL;
-		else break;
+			p++;
+		}
+
+		if (!Val) continue;
+
+#define IS_TAG(t) (NameLen == sizeof(t) - 1 && !strncmp(Name, t, NameLen))
+#define IS_MASTER (ChannelLen == 6 && !strncasecmp(Channel, "Master", ChannelLen))
+
+		// only first occurence counts
+		if (IS_TAG("Volume") && IS_MASTER && Change->Volume < 0) {
+			Change->Volume = atoi(Val);
+		} else if (IS_TAG("Mute") && IS_MASTER && Change->Mute < 0) {
+			Change->Mute = *Val == '1' || !strncasecmp(Val, "true", 4);
+		} else if (IS_TAG("TransportState") && !Change->HasTransportState) {
+			Change->TransportState = _slice2State(Val, ValLen);
+			Change->HasTransportState = true;
+		} else if (IS_TAG("CurrentTrackURI") && !Change->CurrentTrackURI) {
+			Change->CurrentTrackURI = Val;
+			Change->CurrentTrackURILen = ValLen;
+		} else if (IS_TAG("AVTransportURI") && !Change->AVTransportURI) {
+			Change->AVTransportURI = Val;
+			Change->AVTransportURILen = ValLen;
+		}
+
+#undef IS_TAG
+#undef IS_MASTER
 	}
 
-	ixmlNamedNodeMap_free(map);
+	return true;
+}
 
-	return ret;
+/*----------------------------------------------------------------------------*/
+enum eMRstate String2State(const char *State) {
+	return _slice2State(State, strlen(State));
 }
 
 /*----------------------------------------------------------------------------*/
@@ -489,3 +938,511 @@ char *uPNPEvent2String(Upnp_EventType S) {
 
 	return "";
 }
+
+
+/*----------------------------------------------------------------------------*/
+/* 																			  */
+/* Device index																  */
+/* 																			  */
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+static uint32_t _indexHash(int Type, const char *Key) {
+	return hash32((char*) Key) ^ (Type * 0x9e3779b9);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _indexAdd(int Type, const char *Key, struct sMR *Device) {
+	tIndexEntry *Entry;
+
+	if (!Key || !*Key) return;
+
+	Entry = malloc(sizeof(tIndexEntry) + strlen(Key) + 1);
+	Entry->Hash = _indexHash(Type, Key);
+	Entry->Type = Type;
+	Entry->Device = Device;
+	strcpy(Entry->Key, Key);
+
+	pthread_rwlock_wrlock(&glIndex.Lock);
+
+	// grow before we get chains
+	if (glIndex.Count >= glIndex.Size) {
+		int Size = glIndex.Size * 2;
+		tIndexEntry **Buckets = calloc(Size, sizeof(tIndexEntry*));
+
+		for (int i = 0; i < glIndex.Size; i++) {
+			while (glIndex.Buckets[i]) {
+				tIndexEntry *p = glIndex.Buckets[i];
+				glIndex.Buckets[i] = p->Next;
+				p->Next = Buckets[p->Hash & (Size - 1)];
+				Buckets[p->Hash & (Size - 1)] = p;
+			}
+		}
+
+		free(glIndex.Buckets);
+		glIndex.Buckets = Buckets;
+		glIndex.Size = Size;
+		LOG_DEBUG("device index resized to %d", Size);
+	}
+
+	Entry->Next = glIndex.Buckets[Entry->Hash & (glIndex.Size - 1)];
+	glIndex.Buckets[Entry->Hash & (glIndex.Size - 1)] = Entry;
+	glIndex.Count++;
+
+	pthread_rwlock_unlock(&glIndex.Lock);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _indexDel(int Type, const char *Key, struct sMR *Device) {
+	tIndexEntry **p;
+	uint32_t Hash;
+
+	if (!Key || !*Key) return;
+
+	Hash = _indexHash(Type, Key);
+	pthread_rwlock_wrlock(&glIndex.Lock);
+
+	for (p = &glIndex.Buckets[Hash & (glIndex.Size - 1)]; *p; p = &(*p)->Next) {
+		if ((*p)->Hash == Hash && (*p)->Type == Type && (*p)->Device == Device && !strcmp((*p)->Key, Key)) {
+			tIndexEntry *Entry = *p;
+			*p = Entry->Next;
+			free(Entry);
+			glIndex.Count--;
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&glIndex.Lock);
+}
+
+/*----------------------------------------------------------------------------*/
+static struct sMR *_indexFind(int Type, const char *Key) {
+	struct sMR *Device = NULL;
+	uint32_t Hash;
+
+	if (!Key || !*Key) return NULL;
+
+	Hash = _indexHash(Type, Key);
+	pthread_rwlock_rdlock(&glIndex.Lock);
+
+	for (tIndexEntry *p = glIndex.Buckets[Hash & (glIndex.Size - 1)]; p; p = p->Next) {
+		if (p->Hash == Hash && p->Type == Type && !strcmp(p->Key, Key)) {
+			Device = p->Device;
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&glIndex.Lock);
+
+	return Device;
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexInit(void) {
+	// must be a power of 2, grows with the number of devices
+	glIndex.Size = 64;
+	glIndex.Buckets = calloc(glIndex.Size, sizeof(tIndexEntry*));
+	glIndex.Count = 0;
+	pthread_rwlock_init(&glIndex.Lock, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexEnd(void) {
+	for (int i = 0; i < glIndex.Size; i++) {
+		while (glIndex.Buckets[i]) {
+			tIndexEntry *p = glIndex.Buckets[i];
+			glIndex.Buckets[i] = p->Next;
+			free(p);
+		}
+	}
+
+	NFREE(glIndex.Buckets);
+	pthread_rwlock_destroy(&glIndex.Lock);
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexDevice(struct sMR *Device) {
+	_indexAdd(INDEX_UDN, Device->UDN, Device);
+	_indexAdd(INDEX_DESC, Device->DescDocURL, Device);
+	for (int i = 0; i < NB_SRV; i++) _indexAdd(INDEX_CURL, Device->Service[i].ControlURL, Device);
+}
+
+/*----------------------------------------------------------------------------*/
+void UnIndexDevice(struct sMR *Device) {
+	_indexDel(INDEX_UDN, Device->UDN, Device);
+	_indexDel(INDEX_DESC, Device->DescDocURL, Device);
+	for (int i = 0; i < NB_SRV; i++) {
+		_indexDel(INDEX_CURL, Device->Service[i].ControlURL, Device);
+		_indexDel(INDEX_SID, Device->Service[i].SID, Device);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexSID(struct sMR *Device, struct sService *s, const char *SID) {
+	_indexDel(INDEX_SID, s->SID, Device);
+	strncpy(s->SID, SID, sizeof(Upnp_SID) - 1);
+	_indexAdd(INDEX_SID, s->SID, Device);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _createDevice(void *Item) {
+	struct sMR *Device = Item;
+	pthread_mutex_init(&Device->Mutex, 0);
+	Device->PollIndex = -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _destroyDevice(void *Item) {
+	pthread_mutex_destroy(&((struct sMR*) Item)->Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void RegistryInit(void) {
+	registry_init(&glRegistry, sizeof(struct sMR), _createDevice, _destroyDevice);
+}
+
+/*----------------------------------------------------------------------------*/
+void RegistryEnd(void) {
+	registry_end(&glRegistry);
+}
+
+/*----------------------------------------------------------------------------*/
+struct sMR *RegistryAcquire(void) {
+	struct sMR *Device = registry_acquire(&glRegistry, glMaxDevices);
+
+	// a late callback might still be checking that slot
+	if (Device) pthread_mutex_lock(&Device->Mutex);
+
+	return Device;
+}
+
+/*----------------------------------------------------------------------------*/
+void RegistryPublish(struct sMR *Device) {
+	registry_publish(&glRegistry, Device);
+}
+
+/*----------------------------------------------------------------------------*/
+void RegistryRelease(struct sMR *Device) {
+	registry_release(&glRegistry, Device);
+}
+
+/*----------------------------------------------------------------------------*/
+int RegistryList(struct sMR ***List, bool All) {
+	return registry_list(&glRegistry, (void***) List, All);
+}
+
+/*----------------------------------------------------------------------------*/
+int GroupMembers(struct sMR *Master, struct sMR **List, int Size) {
+	struct sMR **Live;
+	int n = 0, Count = registry_lock(&glRegistry, (void***) &Live);
+
+	// members must be locked (by caller) to confirm they still belong to master
+	for (int i = 0; i < Count && n < Size; i++) {
+		if (Live[i] == Master || Live[i]->Master == Master) List[n++] = Live[i];
+	}
+
+	registry_unlock(&glRegistry);
+
+	return n;
+}
+
+/*----------------------------------------------------------------------------*/
+/* 																			  */
+/* Discovery filter															  */
+/* 																			  */
+/*----------------------------------------------------------------------------*/
+
+/*
+ include/exclude lists are compiled once. Tokens can be prefixed by the field
+ they apply to (model:, number:, mfr:, udn: or ip:). Model, number and
+ manufacturer tokens are lowercase substrings, UDN and included model numbers
+ are exact values in a small hash set and IP are network/mask pairs
+*/
+enum { FILTER_MODEL, FILTER_NUMBER, FILTER_MFR, FILTER_UDN, FILTER_IP, FILTER_FIELDS };
+
+#define FILTER_BUCKETS	64
+
+typedef struct sFilterKey {
+	struct sFilterKey *Next;
+	uint32_t		Hash;
+	int				Field;
+	char			Value[];
+} tFilterKey;
+
+typedef struct {
+	char			**Tokens[FILTER_FIELDS];
+	int				Count[FILTER_FIELDS];
+	tFilterKey		*Keys[FILTER_BUCKETS];
+	struct { in_addr_t Net, Mask; } *Nets;
+	int				nNets, Items;
+	bool			Null;			// <NULL> is for players without model number
+	bool			Deep;			// some items can only be checked with description
+} tFilterList;
+
+static struct {
+	tFilterList		Include, Exclude;
+} glFilter;
+
+static const char *cFilterPrefix[FILTER_FIELDS] = { "model:", "number:", "mfr:", "udn:", "ip:" };
+
+/*----------------------------------------------------------------------------*/
+static char *_filterUDN(const char *UDN) {
+	// compare without "uuid:" as users do not always type it
+	if (!strncasecmp(UDN, "uuid:", 5)) UDN += 5;
+	char *p, *Value = strdup(UDN);
+	for (p = Value; *p; p++) *p = tolower(*p);
+	return Value;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _filterCompile(tFilterList *List, const char *Spec, int Default, bool Exact) {
+	while (Spec && *Spec) {
+		size_t len = strcspn(Spec, ",");
+		char *Token = malloc(len + 1), *Value = Token;
+		int Field = Default;
+
+		memcpy(Token, Spec, len);
+		Token[len] = '\0';
+
+		Spec += len + (Spec[len] == ',');
+
+		for (int i = 0; i < FILTER_FIELDS; i++) {
+			if (!strncasecmp(Token, cFilterPrefix[i], strlen(cFilterPrefix[i]))) {
+				Field = i;
+				Value += strlen(cFilterPrefix[i]);
+				break;
+			}
+		}
+
+		if (!*Value) {
+			free(Token);
+			continue;
+		}
+
+		if (Field == FILTER_IP) {
+			char Addr[32] = "";
+			unsigned Bits = 32;
+			sscanf(Value, "%31[^/]/%u", Addr, &Bits);
+			if (inet_addr(Addr) != INADDR_NONE) {
+				List->Nets = realloc(List->Nets, (List->nNets + 1) * sizeof(*List->Nets));
+				List->Nets[List->nNets].Mask = Bits ? htonl(0xffffffff << (32 - min(Bits, 32))) : 0;
+				List->Nets[List->nNets].Net = inet_addr(Addr) & List->Nets[List->nNets].Mask;
+				List->nNets++;
+				List->Items++;
+			} else {
+				LOG_WARN("invalid address in filter %s", Value);
+			}
+		} else if (Field == FILTER_NUMBER && Exact && !strcmp(Value, "<NULL>")) {
+			List->Null = List->Deep = true;
+			List->Items++;
+		} else if (Field == FILTER_UDN || (Field == FILTER_NUMBER && Exact)) {
+			char *Key = Field == FILTER_UDN ? _filterUDN(Value) : strdup(Value);
+			tFilterKey *Entry = malloc(sizeof(tFilterKey) + strlen(Key) + 1);
+			Entry->Hash = hash32(Key);
+			Entry->Field = Field;
+			strcpy(Entry->Value, Key);
+			Entry->Next = List->Keys[Entry->Hash % FILTER_BUCKETS];
+			List->Keys[Entry->Hash % FILTER_BUCKETS] = Entry;
+			List->Deep |= Field != FILTER_UDN;
+			List->Items++;
+			free(Key);
+		} else {
+			for (char *p = Value; *p; p++) *p = tolower(*p);
+			List->Tokens[Field] = realloc(List->Tokens[Field], (List->Count[Field] + 1) * sizeof(char*));
+			List->Tokens[Field][List->Count[Field]++] = strdup(Value);
+			List->Deep = true;
+			List->Items++;
+		}
+
+		free(Token);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void _filterFree(tFilterList *List) {
+	for (int i = 0; i < FILTER_FIELDS; i++) {
+		while (List->Count[i]) free(List->Tokens[i][--List->Count[i]]);
+		NFREE(List->Tokens[i]);
+	}
+
+	for (int i = 0; i < FILTER_BUCKETS; i++) {
+		while (List->Keys[i]) {
+			tFilterKey *Entry = List->Keys[i];
+			List->Keys[i] = Entry->Next;
+			free(Entry);
+		}
+	}
+
+	NFREE(List->Nets);
+	memset(List, 0, sizeof(tFilterList));
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _filterKey(tFilterList *List, int Field, const char *Value) {
+	char *Key = Field == FILTER_UDN ? _filterUDN(Value) : strdup(Value);
+	uint32_t Hash = hash32(Key);
+	tFilterKey *Entry = List->Keys[Hash % FILTER_BUCKETS];
+
+	for (; Entry; Entry = Entry->Next) {
+		if (Entry->Hash == Hash && Entry->Field == Field && !strcmp(Entry->Value, Key)) break;
+	}
+
+	free(Key);
+	return Entry != NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _filterMatch(tFilterList *List, const char *UDN, const char *Location, char *Values[], bool Partial) {
+	if (UDN && *UDN && _filterKey(List, FILTER_UDN, UDN)) return true;
+
+	if (List->nNets && Location) {
+		char Host[32] = "";
+		in_addr_t Addr;
+
+		sscanf(Location, "http://%31[^:/]", Host);
+		if ((Addr = inet_addr(Host)) != INADDR_NONE) {
+			for (int i = 0; i < List->nNets; i++) {
+				if ((Addr & List->Nets[i].Mask) == List->Nets[i].Net) return true;
+			}
+		}
+	}
+
+	// description items are not known yet
+	if (Partial) return false;
+
+	if (!Values[FILTER_NUMBER]) {
+		if (List->Null) return true;
+	} else if (_filterKey(List, FILTER_NUMBER, Values[FILTER_NUMBER])) {
+		return true;
+	}
+
+	for (int i = 0; i < FILTER_FIELDS; i++) {
+		if (!List->Count[i] || !Values[i]) continue;
+
+		// lowercase the subject once, then it's just a strstr per token
+		char *p, *Subject = strdup(Values[i]);
+		for (p = Subject; *p; p++) *p = tolower(*p);
+
+		for (int j = 0; j < List->Count[i]; j++) {
+			if (strstr(Subject, List->Tokens[i][j])) {
+				free(Subject);
+				return true;
+			}
+		}
+
+		free(Subject);
+	}
+
+	return false;
+}
+
+/*----------------------------------------------------------------------------*/
+void FilterInit(const char *ExcludedModels, const char *ExcludedNumbers, const char *IncludedNumbers) {
+	memset(&glFilter, 0, sizeof(glFilter));
+	_filterCompile(&glFilter.Exclude, ExcludedModels, FILTER_MODEL, false);
+	_filterCompile(&glFilter.Exclude, ExcludedNumbers, FILTER_NUMBER, false);
+	_filterCompile(&glFilter.Include, IncludedNumbers, FILTER_NUMBER, true);
+	LOG_INFO("discovery filter with %d include and %d exclude items", glFilter.Include.Items, glFilter.Exclude.Items);
+}
+
+/*----------------------------------------------------------------------------*/
+void FilterEnd(void) {
+	_filterFree(&glFilter.Include);
+	_filterFree(&glFilter.Exclude);
+}
+
+/*----------------------------------------------------------------------------*/
+bool FilterPeer(const char *UDN, const char *Location) {
+	// include list overrides exclusions, but can only reject when it has no description items
+	if (glFilter.Include.Items) return !glFilter.Include.Deep && !_filterMatch(&glFilter.Include, UDN, Location, NULL, true);
+	return glFilter.Exclude.Items && _filterMatch(&glFilter.Exclude, UDN, Location, NULL, true);
+}
+
+/*----------------------------------------------------------------------------*/
+bool FilterDevice(const char *UDN, const char *Location, char *Manufacturer, char *Model, char *ModelNumber) {
+	char *Values[FILTER_FIELDS] = { Model, ModelNumber, Manufacturer };
+
+	if (glFilter.Include.Items) return !_filterMatch(&glFilter.Include, UDN, Location, Values, false);
+	return glFilter.Exclude.Items && _filterMatch(&glFilter.Exclude, UDN, Location, Values, false);
+}
+
+/*----------------------------------------------------------------------------*/
+/* 																			  */
+/* Codec negotiation														  */
+/* 																			  */
+/*----------------------------------------------------------------------------*/
+
+/*
+ Policies rank codecs from cheapest to most expensive: "cpu" prefers raw PCM
+ that needs no encoding at all, "bandwidth" prefers the smallest stream (at
+ default bitrates). The first one the player lists as a sink wins
+*/
+static const struct {
+	char	*Codec;
+	char	*Mime[4];
+} cCodecs[] = {	{ "pcm", { "audio/l16" } },
+				{ "wav", { "audio/wav", "audio/x-wav", "audio/wave" } },
+				{ "flac", { "audio/flac", "audio/x-flac" } },
+				{ "mp3", { "audio/mpeg", "audio/mp3", "audio/x-mpeg" } },
+				{ "aac", { "audio/aac", "audio/x-aac" } },		// sent as ADTS, not in an mp4 container
+			};
+
+static const struct {
+	char	*Name, *Reason;
+	int		Rank[5];
+} cPolicies[] = { { "cpu", "cheapest to encode", { 0, 1, 2, 3, 4 } },
+				  { "bandwidth", "smallest stream", { 4, 3, 2, 1, 0 } },
+				};
+
+/*----------------------------------------------------------------------------*/
+static bool _sinkAccepts(const char *Sink, int Codec) {
+	for (const char *p = Sink; p && *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+		const char *Format = p, *End;
+
+		while (*p == ' ') p++;
+		if (strncasecmp(p, "http-get:", 9)) continue;
+
+		// protocol:network:contentFormat:additionalInfo
+		if ((Format = strchr(p + 9, ':')) == NULL) continue;
+		Format++;
+		if ((End = strpbrk(Format, ":,")) == NULL) End = Format + strlen(Format);
+
+		for (int i = 0; i < 4 && cCodecs[Codec].Mime[i]; i++) {
+			size_t len = strlen(cCodecs[Codec].Mime[i]);
+			if (strncasecmp(Format, cCodecs[Codec].Mime[i], len) || (Format[len] != ';' && Format + len != End)) continue;
+
+			// raw PCM is only sent as 44.1kHz stereo, sink must not say otherwise
+			if (Codec == 0) {
+				char Params[128] = "";
+				snprintf(Params, sizeof(Params), "%.*s", (int) (End - Format), Format);
+				if (strcasestr(Params, "rate=") && !strcasestr(Params, "rate=44100")) continue;
+				if (strcasestr(Params, "channels=") && !strcasestr(Params, "channels=2")) continue;
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*----------------------------------------------------------------------------*/
+const char *CodecNegotiate(const char *Sink, const char *Policy, char *Codec) {
+	int p, Pick = -1;
+
+	for (p = 0; p < (int) (sizeof(cPolicies) / sizeof(*cPolicies)) && strcasecmp(Policy, cPolicies[p].Name); p++);
+
+	if (p == sizeof(cPolicies) / sizeof(*cPolicies)) return "set by config";
+	if (!Sink || !*Sink) return "player has no sink list, set by config";
+
+	for (int i = 0; i < 5 && Pick < 0; i++) {
+		if (_sinkAccepts(Sink, cPolicies[p].Rank[i])) Pick = cPolicies[p].Rank[i];
+	}
+
+	if (Pick < 0) return "no known format in sink list, set by config";
+
+	// keep configured parameters (bitrate, compression) when the codec is the same
+	if (strncasecmp(Codec, cCodecs[Pick].Codec, strlen(cCodecs[Pick].Codec))) strcpy(Codec, cCodecs[Pick].Codec);
+
+	return cPolicies[p].Reason;
+}
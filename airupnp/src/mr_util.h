@@ -11,24 +11,68 @@
 
 #include "airupnp.h"
 
+// values of interest from a LastChange event, strings are not terminated
+typedef struct {
+	int				Volume, Mute;		// -1 when not in event
+	bool			HasTransportState;
+	enum eMRstate	TransportState;
+	const char		*CurrentTrackURI, *AVTransportURI;
+	size_t			CurrentTrackURILen, AVTransportURILen;
+} tLastChange;
+
 void 		FlushMRDevices(void);
 void 		DelMRDevice(struct sMR *p);
 struct sMR *GetMaster(struct sMR *Device, char **Name);
+void		TopologyInit(void);
+void		TopologyEnd(void);
+void		TopologyUpdate(struct sMR *Device, const char *State);
+void		TopologyInvalidate(void);
+bool		TopologySubscribe(struct sMR *Device);
+void		TopologyUnsubscribed(struct sMR *Device);
 int 		CalcGroupVolume(struct sMR *Master);
 bool		CheckAndLock(struct sMR *Device);
 double		GetLocalGroupVolume(struct sMR *Member, int *count);
 
+void		PollInit(uint32_t (*Handler)(struct sMR *Device));
+void		PollEnd(void);
+void		PollSchedule(struct sMR *Device, uint32_t Delay);
+void		PollCancel(struct sMR *Device);
+void		PollPause(bool Pause);
+
+void		RegistryInit(void);
+void		RegistryEnd(void);
+struct sMR *RegistryAcquire(void);
+void		RegistryPublish(struct sMR *Device);
+void		RegistryRelease(struct sMR *Device);
+int			RegistryList(struct sMR ***List, bool All);
+int			GroupMembers(struct sMR *Master, struct sMR **List, int Size);
+
+void		IndexInit(void);
+void		IndexEnd(void);
+void		IndexDevice(struct sMR *Device);
+void		UnIndexDevice(struct sMR *Device);
+void		IndexSID(struct sMR *Device, struct sService *s, const char *SID);
+
+void		FilterInit(const char *ExcludedModels, const char *ExcludedNumbers, const char *IncludedNumbers);
+void		FilterEnd(void);
+bool		FilterPeer(const char *UDN, const char *Location);
+bool		FilterDevice(const char *UDN, const char *Location, char *Manufacturer, char *Model, char *ModelNumber);
+
+const char*	CodecNegotiate(const char *Sink, const char *Policy, char *Codec);
+
 struct sMR*  SID2Device(const UpnpString *SID);
 struct sMR*  CURL2Device(const UpnpString *CtrlURL);
 struct sMR*  PURL2Device(const UpnpString *URL);
 struct sMR*  UDN2Device(const char *SID);
+struct sMR*  DescURL2Device(const char *URL);
 
 struct sService* EventURL2Service(const UpnpString *URL, struct sService *s);
 
 int  XMLFindAndParseService(IXML_Document* DescDoc, const char* location, const char* serviceTypeBase, char** serviceType, 
                             char** serviceId, char** eventURL, char** controlURL, char** serviceURL);
 bool  XMLFindAction(const char* base, char* service, char* action);
-char* XMLGetChangeItem(IXML_Document *doc, char *Tag, char *SearchAttr, char *SearchVal, char *RetAttr);
+bool  XMLParseLastChange(IXML_Document *doc, tLastChange *Change);
 
 char* uPNPEvent2String(Upnp_EventType S);
+enum eMRstate String2State(const char *State);
 
@@ -0,0 +1,472 @@
+/*
+ *  HTTP stream relay for virtual groups
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ *  See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "platform.h"
+#include "cross_util.h"
+#include "cross_net.h"
+#include "cross_thread.h"
+#include "cross_log.h"
+#include "soap_util.h"
+#include "relay_util.h"
+
+/*
+ A relay pulls one encoded HTTP stream (from the group's AirPlay instance) and
+ serves it to as many players as needed, so audio is decoded and encoded once
+ whatever the size of the group. Data is kept in a ring buffer and each player
+ has its own read cursor. Players that connect early start from the beginning
+ of the stream. Later ones are first sent the codec's header (the prologue, i.e.
+ flac metadata or wav chunks up to data, kept aside when the stream starts) and
+ then continue from a frame boundary shortly before the live position. A player
+ that falls more than the size of the ring behind is dropped, the source is
+ never slowed down. One thread per relay does everything in a single select()
+ loop
+*/
+
+#define RELAY_SIZE		(2*1024*1024)
+#define RELAY_CONSUMERS	16
+#define RELAY_HEADERS	2048
+#define RELAY_REQUEST	1024
+#define RELAY_CHUNK		16384
+#define RELAY_TICK		50
+#define RELAY_PROLOGUE	8192
+#define RELAY_BACKLOG	(256*1024)		// late players start that far from live
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+extern log_level	raop_loglevel;
+static log_level 	*loglevel = &raop_loglevel;
+
+typedef struct {
+	int			Sock;
+	enum { CONSUMER_REQUEST, CONSUMER_HEADERS, CONSUMER_PROLOGUE, CONSUMER_STREAM } State;
+	bool		Head, Align;				// Align until cursor is on a frame boundary
+	char		Request[RELAY_REQUEST];
+	int			Len, Sent;
+	uint64_t	Cursor;
+} tConsumer;
+
+struct sRelay {
+	pthread_t		Thread;
+	pthread_mutex_t	Mutex;
+	bool			Running;
+	int				Generation, Applied;	// Start/Stop requests and the last one applied
+	char			*Source;				// NULL when stopped
+	int				Listener;
+	uint16_t		Port;
+	// below is only used by relay's thread
+	char			*URL, Host[64];			// copy of Source being relayed
+	const char		*Path;
+	struct sockaddr_in Addr;
+	int				SourceSock;
+	enum { SOURCE_IDLE, SOURCE_CONNECT, SOURCE_HEADERS, SOURCE_BODY, SOURCE_DONE } SourceState;
+	char			Headers[RELAY_HEADERS];
+	int				HeadersLen;
+	uint8_t			*Ring;
+	uint64_t		Total;
+	enum { PROLOGUE_UNKNOWN, PROLOGUE_KNOWN, PROLOGUE_TOO_LARGE } PrologueState;
+	enum { STREAM_RAW, STREAM_FRAMED, STREAM_FLAC } Kind;
+	uint8_t			Prologue[RELAY_PROLOGUE];
+	int				PrologueLen;
+	tConsumer		Consumers[RELAY_CONSUMERS];
+	int				Count;
+	uint32_t		Dropped;
+};
+
+/*----------------------------------------------------------------------------*/
+static void _consumerClose(struct sRelay *Relay, int i) {
+	closesocket(Relay->Consumers[i].Sock);
+	// order does not matter
+	Relay->Consumers[i] = Relay->Consumers[--Relay->Count];
+}
+
+/*----------------------------------------------------------------------------*/
+static void _reset(struct sRelay *Relay) {
+	while (Relay->Count) _consumerClose(Relay, 0);
+	if (Relay->SourceSock >= 0) closesocket(Relay->SourceSock);
+
+	Relay->SourceSock = -1;
+	Relay->SourceState = SOURCE_IDLE;
+	Relay->HeadersLen = 0;
+	Relay->Total = 0;
+	Relay->PrologueState = PROLOGUE_UNKNOWN;
+	Relay->PrologueLen = 0;
+	NFREE(Relay->URL);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _prologue(struct sRelay *Relay) {
+	uint8_t *p = Relay->Ring;
+	int64_t Len = -1, Limit = min(Relay->Total, RELAY_PROLOGUE);
+
+	// called until found, ring has not wrapped by then
+	if (Relay->Total < 4) return;
+
+	if (!memcmp(p, "fLaC", 4)) {
+		// metadata blocks up to the one flagged as last
+		Relay->Kind = STREAM_FLAC;
+		for (int64_t Pos = 4; Pos + 4 <= Limit; ) {
+			int64_t Next = Pos + 4 + ((p[Pos + 1] << 16) | (p[Pos + 2] << 8) | p[Pos + 3]);
+			if (p[Pos] & 0x80) {
+				Len = Next;
+				break;
+			}
+			Pos = Next;
+		}
+	} else if (!memcmp(p, "RIFF", 4)) {
+		// chunks up to data's header, samples are 4 bytes (16 bits stereo)
+		Relay->Kind = STREAM_RAW;
+		for (int64_t Pos = 12; Pos + 8 <= Limit; ) {
+			uint32_t Size = p[Pos + 4] | (p[Pos + 5] << 8) | (p[Pos + 6] << 16) | ((uint32_t) p[Pos + 7] << 24);
+			if (!memcmp(p + Pos, "data", 4)) {
+				Len = Pos + 8;
+				break;
+			}
+			Pos += 8 + Size + (Size & 1);
+		}
+	} else {
+		// mp3 and aac are made of self-contained frames and raw pcm has no header
+		Relay->Kind = (p[0] == 0xff && (p[1] & 0xe0) == 0xe0) || !memcmp(p, "ID3", 3) ? STREAM_FRAMED : STREAM_RAW;
+		Len = 0;
+	}
+
+	if (Len > RELAY_PROLOGUE || (Len < 0 && Relay->Total >= RELAY_PROLOGUE)) {
+		LOG_WARN("[%p]: codec header is too large, late players will be refused", Relay);
+		Relay->PrologueState = PROLOGUE_TOO_LARGE;
+	} else if (Len >= 0 && Len <= (int64_t) Relay->Total) {
+		memcpy(Relay->Prologue, p, Len);
+		Relay->PrologueLen = Len;
+		Relay->PrologueState = PROLOGUE_KNOWN;
+		LOG_DEBUG("[%p]: prologue is %d bytes (kind %d)", Relay, Relay->PrologueLen, Relay->Kind);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _align(struct sRelay *Relay, tConsumer *p) {
+	uint8_t Mask = Relay->Kind == STREAM_FLAC ? 0xfe : 0xe0;
+	uint8_t Sync = Relay->Kind == STREAM_FLAC ? 0xf8 : 0xe0;
+
+	if (Relay->Kind == STREAM_RAW) {
+		p->Cursor -= (p->Cursor - Relay->PrologueLen) % 4;
+		p->Align = false;
+		return true;
+	}
+
+	// frames start with a sync word, cursor stays on last byte until it is found
+	for (; p->Cursor + 1 < Relay->Total; p->Cursor++) {
+		if (Relay->Ring[p->Cursor % RELAY_SIZE] == 0xff && (Relay->Ring[(p->Cursor + 1) % RELAY_SIZE] & Mask) == Sync) {
+			p->Align = false;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _sourceConnect(struct sRelay *Relay) {
+	// Source can be changed at any time, so keep our own copy
+	Relay->URL = strdup(Relay->Source);
+
+	if ((Relay->SourceSock = HttpConnect(Relay->URL, &Relay->Addr, Relay->Host, &Relay->Path)) < 0) {
+		LOG_ERROR("[%p]: cannot relay %s", Relay, Relay->URL);
+		Relay->SourceState = SOURCE_DONE;
+		return;
+	}
+
+	Relay->SourceState = SOURCE_CONNECT;
+	LOG_INFO("[%p]: relaying %s", Relay, Relay->URL);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _sourceProcess(struct sRelay *Relay, bool Readable, bool Writable) {
+	if (Relay->SourceState == SOURCE_CONNECT && Writable) {
+		if (!HttpGet(Relay->SourceSock, &Relay->Addr, Relay->Host, Relay->Path, "getcontentFeatures.dlna.org: 1\r\n")) {
+			LOG_ERROR("[%p]: cannot connect to %s", Relay, Relay->URL);
+			Relay->SourceState = SOURCE_DONE;
+		} else {
+			Relay->SourceState = SOURCE_HEADERS;
+		}
+	} else if (Relay->SourceState == SOURCE_HEADERS && Readable) {
+		int n = recv(Relay->SourceSock, Relay->Headers + Relay->HeadersLen, RELAY_HEADERS - Relay->HeadersLen - 1, 0);
+		char *End;
+
+		if (n <= 0) {
+			Relay->SourceState = SOURCE_DONE;
+			return;
+		}
+
+		Relay->HeadersLen += n;
+		Relay->Headers[Relay->HeadersLen] = '\0';
+
+		if ((End = strstr(Relay->Headers, "\r\n\r\n")) != NULL) {
+			int Body = Relay->Headers + Relay->HeadersLen - (End + 4);
+
+			// whatever came with headers is the beginning of the stream
+			Relay->HeadersLen -= Body;
+			memcpy(Relay->Ring, End + 4, Body);
+			Relay->Total = Body;
+			Relay->SourceState = SOURCE_BODY;
+			_prologue(Relay);
+			LOG_DEBUG("[%p]: source headers\n%.*s", Relay, Relay->HeadersLen, Relay->Headers);
+		} else if (Relay->HeadersLen == RELAY_HEADERS - 1) {
+			LOG_ERROR("[%p]: source headers too large", Relay);
+			Relay->SourceState = SOURCE_DONE;
+		}
+	} else if (Relay->SourceState == SOURCE_BODY && Readable) {
+		size_t Pos = Relay->Total % RELAY_SIZE;
+		int n = recv(Relay->SourceSock, (char*) Relay->Ring + Pos, min(RELAY_CHUNK, RELAY_SIZE - Pos), 0);
+
+		if (n > 0) Relay->Total += n;
+		else Relay->SourceState = SOURCE_DONE;
+
+		if (n > 0 && Relay->PrologueState == PROLOGUE_UNKNOWN) _prologue(Relay);
+	}
+
+	if (Relay->SourceState == SOURCE_DONE) {
+		LOG_INFO("[%p]: source ended after %" PRIu64 " bytes", Relay, Relay->Total);
+		closesocket(Relay->SourceSock);
+		Relay->SourceSock = -1;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _consumerProcess(struct sRelay *Relay, tConsumer *p, bool Readable, bool Writable) {
+	if (p->State == CONSUMER_REQUEST && Readable) {
+		int n = recv(p->Sock, p->Request + p->Len, RELAY_REQUEST - p->Len - 1, 0);
+		if (n <= 0) return false;
+
+		p->Len += n;
+		p->Request[p->Len] = '\0';
+		if (!strstr(p->Request, "\r\n\r\n")) return p->Len < RELAY_REQUEST - 1;
+
+		// player would miss codec's header
+		if (Relay->PrologueState == PROLOGUE_TOO_LARGE && Relay->Total > RELAY_BACKLOG) {
+			const char *Refuse = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+			LOG_WARN("[%p]: player joined too late", Relay);
+			send(p->Sock, Refuse, strlen(Refuse), MSG_NOSIGNAL);
+			return false;
+		}
+
+		p->Head = !strncasecmp(p->Request, "HEAD", 4);
+		p->State = CONSUMER_HEADERS;
+		p->Sent = 0;
+	} else if (p->State == CONSUMER_HEADERS && Writable) {
+		int n = send(p->Sock, Relay->Headers + p->Sent, Relay->HeadersLen - p->Sent, MSG_NOSIGNAL);
+		if (n <= 0) return false;
+
+		p->Sent += n;
+		if (p->Sent == Relay->HeadersLen) {
+			if (p->Head) return false;
+
+			if (Relay->Total <= RELAY_BACKLOG) {
+				p->State = CONSUMER_STREAM;
+				p->Cursor = 0;
+			} else if (Relay->PrologueState == PROLOGUE_KNOWN) {
+				LOG_INFO("[%p]: player joined late, starting near live position", Relay);
+				p->State = Relay->PrologueLen ? CONSUMER_PROLOGUE : CONSUMER_STREAM;
+				p->Cursor = max(Relay->Total - RELAY_BACKLOG, (uint64_t) Relay->PrologueLen);
+				p->Align = true;
+				p->Sent = 0;
+			} else {
+				LOG_WARN("[%p]: player joined too late", Relay);
+				return false;
+			}
+		}
+	} else if (p->State == CONSUMER_PROLOGUE && Writable) {
+		int n = send(p->Sock, (char*) Relay->Prologue + p->Sent, Relay->PrologueLen - p->Sent, MSG_NOSIGNAL);
+		if (n <= 0) return false;
+
+		p->Sent += n;
+		if (p->Sent == Relay->PrologueLen) p->State = CONSUMER_STREAM;
+	} else if (p->State == CONSUMER_STREAM && Writable) {
+		size_t Pos;
+
+		if (p->Align && !_align(Relay, p)) return true;
+
+		Pos = p->Cursor % RELAY_SIZE;
+		int n = send(p->Sock, (char*) Relay->Ring + Pos, min(RELAY_SIZE - Pos, Relay->Total - p->Cursor), MSG_NOSIGNAL);
+		if (n <= 0) return false;
+		p->Cursor += n;
+	}
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static void *RelayThread(void *args) {
+	struct sRelay *Relay = (struct sRelay*) args;
+
+	while (Relay->Running) {
+		struct timeval timeout = { 0, RELAY_TICK * 1000 };
+		fd_set rfds, wfds;
+		int MaxSock = Relay->Listener;
+
+		// apply latest Start/Stop request
+		pthread_mutex_lock(&Relay->Mutex);
+		if (Relay->Applied != Relay->Generation) {
+			Relay->Applied = Relay->Generation;
+			_reset(Relay);
+			if (Relay->Source) _sourceConnect(Relay);
+		}
+		pthread_mutex_unlock(&Relay->Mutex);
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(Relay->Listener, &rfds);
+
+		if (Relay->SourceState == SOURCE_CONNECT) FD_SET(Relay->SourceSock, &wfds);
+		else if (Relay->SourceState == SOURCE_HEADERS || Relay->SourceState == SOURCE_BODY) FD_SET(Relay->SourceSock, &rfds);
+		if (Relay->SourceSock >= 0) MaxSock = max(MaxSock, Relay->SourceSock);
+
+		for (int i = 0; i < Relay->Count; i++) {
+			tConsumer *p = Relay->Consumers + i;
+			if (p->State == CONSUMER_REQUEST) FD_SET(p->Sock, &rfds);
+			else if ((p->State == CONSUMER_HEADERS && Relay->SourceState >= SOURCE_BODY && Relay->HeadersLen) ||
+					 p->State == CONSUMER_PROLOGUE ||
+					 (p->State == CONSUMER_STREAM && p->Cursor + p->Align < Relay->Total)) FD_SET(p->Sock, &wfds);
+			MaxSock = max(MaxSock, p->Sock);
+		}
+
+		if (select(MaxSock + 1, &rfds, &wfds, NULL, &timeout) < 0) continue;
+
+		if (FD_ISSET(Relay->Listener, &rfds)) {
+			int Sock = accept(Relay->Listener, NULL, NULL);
+			if (Sock >= 0 && Relay->Count < RELAY_CONSUMERS && Relay->SourceState != SOURCE_IDLE) {
+				tConsumer *p = Relay->Consumers + Relay->Count++;
+				memset(p, 0, sizeof(tConsumer));
+				p->Sock = Sock;
+				set_nonblock(Sock);
+				set_nosigpipe(Sock);
+				LOG_INFO("[%p]: player connected (%d)", Relay, Relay->Count);
+			} else if (Sock >= 0) {
+				closesocket(Sock);
+			}
+		}
+
+		if (Relay->SourceSock >= 0) {
+			_sourceProcess(Relay, FD_ISSET(Relay->SourceSock, &rfds), FD_ISSET(Relay->SourceSock, &wfds));
+		}
+
+		for (int i = Relay->Count - 1; i >= 0; i--) {
+			tConsumer *p = Relay->Consumers + i;
+			bool Keep = false;
+
+			// ring has been overwritten where that player is, nothing valid to send
+			if (p->State == CONSUMER_STREAM && Relay->Total - p->Cursor > RELAY_SIZE) {
+				LOG_WARN("[%p]: player is too slow, dropping it", Relay);
+				Relay->Dropped++;
+			} else {
+				Keep = _consumerProcess(Relay, p, FD_ISSET(p->Sock, &rfds), FD_ISSET(p->Sock, &wfds));
+			}
+
+			// source has ended, players leave once they have got everything
+			if (Keep && Relay->SourceState == SOURCE_DONE &&
+				(p->State != CONSUMER_STREAM || p->Cursor + p->Align >= Relay->Total)) Keep = false;
+
+			if (!Keep) _consumerClose(Relay, i);
+		}
+	}
+
+	_reset(Relay);
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+struct sRelay *RelayCreate(struct in_addr Host, uint16_t PortBase, uint16_t PortRange) {
+	struct sRelay *Relay = calloc(1, sizeof(struct sRelay));
+	struct sockaddr_in Addr;
+	socklen_t len = sizeof(Addr);
+	int i = 0, on = 1;
+
+	Relay->Listener = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(Relay->Listener, SOL_SOCKET, SO_REUSEADDR, (char*) &on, sizeof(on));
+
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr = Host;
+
+	// same port range as AirPlay instances so that one firewall rule covers all
+	do {
+		Addr.sin_port = htons(PortBase ? PortBase + (rand() % PortRange) : 0);
+	} while (bind(Relay->Listener, (struct sockaddr*) &Addr, sizeof(Addr)) < 0 && PortBase && ++i < PortRange);
+
+	if (listen(Relay->Listener, RELAY_CONSUMERS) < 0 || getsockname(Relay->Listener, (struct sockaddr*) &Addr, &len) < 0) {
+		LOG_ERROR("cannot create relay on %s", inet_ntoa(Host));
+		closesocket(Relay->Listener);
+		free(Relay);
+		return NULL;
+	}
+
+	set_nonblock(Relay->Listener);
+	Relay->Port = ntohs(Addr.sin_port);
+	Relay->Ring = malloc(RELAY_SIZE);
+	Relay->SourceSock = -1;
+	Relay->Running = true;
+	pthread_mutex_init(&Relay->Mutex, 0);
+	pthread_create(&Relay->Thread, NULL, RelayThread, Relay);
+
+	LOG_INFO("[%p]: relay listening on port %hu", Relay, Relay->Port);
+	return Relay;
+}
+
+/*----------------------------------------------------------------------------*/
+void RelayDelete(struct sRelay *Relay) {
+	if (!Relay) return;
+
+	Relay->Running = false;
+	pthread_join(Relay->Thread, NULL);
+	pthread_mutex_destroy(&Relay->Mutex);
+
+	closesocket(Relay->Listener);
+	NFREE(Relay->Source);
+	free(Relay->Ring);
+	free(Relay);
+}
+
+/*----------------------------------------------------------------------------*/
+bool RelayStart(struct sRelay *Relay, const char *Source) {
+	if (!Relay) return false;
+
+	pthread_mutex_lock(&Relay->Mutex);
+	NFREE(Relay->Source);
+	Relay->Source = strdup(Source);
+	Relay->Generation++;
+	pthread_mutex_unlock(&Relay->Mutex);
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+void RelayStop(struct sRelay *Relay) {
+	if (!Relay) return;
+
+	pthread_mutex_lock(&Relay->Mutex);
+	NFREE(Relay->Source);
+	Relay->Generation++;
+	pthread_mutex_unlock(&Relay->Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+uint16_t RelayPort(struct sRelay *Relay) {
+	return Relay ? Relay->Port : 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void RelayStats(struct sRelay *Relay, int *Consumers, uint32_t *Dropped, uint64_t *Bytes) {
+	// values are only indicative, no need to lock
+	*Consumers = Relay ? Relay->Count : 0;
+	*Dropped = Relay ? Relay->Dropped : 0;
+	*Bytes = Relay ? Relay->Total : 0;
+}
@@ -0,0 +1,23 @@
+/*
+ *  HTTP stream relay for virtual groups
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ *  See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "platform.h"
+
+struct sRelay;
+
+struct sRelay*	RelayCreate(struct in_addr Host, uint16_t PortBase, uint16_t PortRange);
+void			RelayDelete(struct sRelay *Relay);
+bool			RelayStart(struct sRelay *Relay, const char *Source);
+void			RelayStop(struct sRelay *Relay);
+uint16_t		RelayPort(struct sRelay *Relay);
+void			RelayStats(struct sRelay *Relay, int *Consumers, uint32_t *Dropped, uint64_t *Bytes);
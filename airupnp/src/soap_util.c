@@ -0,0 +1,796 @@
+/*
+ *  SOAP client with keep-alive connections
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ *  See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "platform.h"
+#include "ixml.h"
+#include "ixmlextra.h"
+#include "upnp.h"
+#include "cross_net.h"
+#include "cross_thread.h"
+#include "cross_log.h"
+#include "airupnp.h"
+#include "soap_util.h"
+
+/*
+ libupnp opens a new connection for every action, which adds up quickly with
+ polling and volume traffic. Actions are sent here on one keep-alive connection
+ per renderer by a pool of workers. A worker waits for one renderer at a time,
+ so the pool grows (up to SOAP_WORKERS) whenever connections with queued jobs
+ outnumber idle workers: a renderer that is slow to answer only holds its own.
+ Once a connection has proven to be reusable, several requests are written
+ before reading their responses. Renderers
+ that keep closing connections, or whose URL we cannot handle, go back to libupnp.
+ In any case, the callback is called exactly once for each accepted action,
+ except for the jobs of a device being removed
+*/
+
+#define SOAP_WORKERS	16			// at most one per busy connection
+#define SOAP_SPARE		2			// idle workers that never exit
+#define SOAP_LINGER		(30*1000)	// before an extra idle worker exits
+#define SOAP_PIPELINE	4			// requests in flight on a trusted connection
+#define SOAP_TRUST		8			// exchanges on one connection before pipelining
+#define SOAP_CLOSES		3			// connections closed without reuse before giving up
+#define SOAP_TIMEOUT	(5*1000)
+#define SOAP_CONNECT	(2*1000)
+#define SOAP_CHUNK		2048
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+extern log_level	upnp_loglevel;
+static log_level 	*loglevel = &upnp_loglevel;
+
+typedef struct sSoapJob {
+	struct sSoapJob	*Next;
+	char			*CtrlURL, *Type, *Action;
+	char			*Request;
+	int				Len;
+	Upnp_FunPtr		Callback;
+	void			*Cookie;
+} tSoapJob;
+
+typedef struct sSoapConn {
+	struct sSoapConn	*Next;
+	struct sMR			*Device;
+	struct sockaddr_in	Addr;
+	int					Sock;
+	bool				Busy, Dead;
+	// these are only changed with glSoap's mutex
+	bool				Fallback, Reused, NoPipeline;
+	int					Depth, Closes;
+	// these are only used by the worker that owns the connection
+	uint32_t			Served;
+	char				*Buf;
+	int					Len, Size;
+	tSoapJob			*Jobs;
+} tSoapConn;
+
+enum { SOAP_OK, SOAP_CLOSED, SOAP_FAILED };
+
+static struct {
+	bool			Running;
+	int				Workers, Idle;
+	pthread_mutex_t	Mutex;
+	pthread_cond_t	Cond;
+	tSoapConn		*List;
+	uint32_t		Sent, Reused, Fallback;
+} glSoap;
+
+/*----------------------------------------------------------------------------*/
+static void _freeJob(tSoapJob *Job) {
+	free(Job->CtrlURL);
+	free(Job->Type);
+	free(Job->Action);
+	free(Job->Request);
+	free(Job);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _close(tSoapConn *Conn) {
+	if (Conn->Sock >= 0) closesocket(Conn->Sock);
+	Conn->Sock = -1;
+	Conn->Len = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _freeConn(tSoapConn *Conn) {
+	tSoapConn **p;
+
+	for (p = &glSoap.List; *p && *p != Conn; p = &(*p)->Next);
+	if (*p) *p = Conn->Next;
+
+	while (Conn->Jobs) {
+		tSoapJob *Job = Conn->Jobs;
+		Conn->Jobs = Job->Next;
+		_freeJob(Job);
+	}
+
+	_close(Conn);
+	free(Conn->Buf);
+	free(Conn);
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _parseURL(const char *URL, struct sockaddr_in *Addr, char *Host, const char **Path) {
+	unsigned Port = 80;
+	int n = 0;
+
+	// only plain http and numeric address
+	if (strncasecmp(URL, "http://", 7) || sscanf(URL + 7, "%63[^:/]%n", Host, &n) != 1) return false;
+	URL += 7 + n;
+
+	if (*URL == ':') Port = strtoul(URL + 1, (char**) &URL, 10);
+	*Path = *URL == '/' ? URL : "/";
+
+	memset(Addr, 0, sizeof(struct sockaddr_in));
+	Addr->sin_family = AF_INET;
+	Addr->sin_port = htons(Port);
+	Addr->sin_addr.s_addr = inet_addr(Host);
+
+	return Port && Port < 65536 && Addr->sin_addr.s_addr != INADDR_NONE;
+}
+
+/*----------------------------------------------------------------------------*/
+int HttpConnect(const char *URL, struct sockaddr_in *Addr, char *Host, const char **Path) {
+	int Sock;
+
+	if (!_parseURL(URL, Addr, Host, Path) || (Sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+
+	set_nonblock(Sock);
+	set_nosigpipe(Sock);
+	// failures are reported by select() like any other connection
+	(void)! connect(Sock, (struct sockaddr*) Addr, sizeof(struct sockaddr_in));
+
+	return Sock;
+}
+
+/*----------------------------------------------------------------------------*/
+bool HttpGet(int Sock, struct sockaddr_in *Addr, const char *Host, const char *Path, const char *Headers) {
+	char Request[1024];
+	socklen_t len = sizeof(int);
+	int Error = 0, n;
+
+	// socket has become writable, find out if it is connected
+	if (getsockopt(Sock, SOL_SOCKET, SO_ERROR, (void*) &Error, &len) < 0 || Error) return false;
+
+	n = snprintf(Request, sizeof(Request), "GET %s HTTP/1.1\r\nHost: %s:%hu\r\n%sConnection: close\r\n\r\n",
+				 Path, Host, ntohs(Addr->sin_port), Headers ? Headers : "");
+
+	return n < (int) sizeof(Request) && send(Sock, Request, n, MSG_NOSIGNAL) == n;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _complete(tSoapJob *Job, int ErrCode, IXML_Document *Result) {
+	UpnpActionComplete *Event = UpnpActionComplete_new();
+
+	UpnpActionComplete_set_ErrCode(Event, ErrCode);
+	UpnpActionComplete_strcpy_CtrlUrl(Event, Job->CtrlURL);
+	UpnpActionComplete_set_ActionResult(Event, Result);
+
+	Job->Callback(UPNP_CONTROL_ACTION_COMPLETE, Event, Job->Cookie);
+
+	// result belongs to us
+	UpnpActionComplete_set_ActionResult(Event, NULL);
+	UpnpActionComplete_delete(Event);
+	if (Result) ixmlDocument_free(Result);
+
+	_freeJob(Job);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _fallback(tSoapJob *Jobs) {
+	while (Jobs) {
+		tSoapJob *Job = Jobs;
+		IXML_Document *Action = ixmlParseBuffer(Job->Action);
+		int rc = UPNP_E_INVALID_ACTION;
+
+		Jobs = Job->Next;
+
+		if (Action) {
+			rc = UpnpSendActionAsync(glControlPointHandle, Job->CtrlURL, Job->Type, NULL,
+									 Action, Job->Callback, Job->Cookie);
+			ixmlDocument_free(Action);
+		}
+
+		// callback is due anyway
+		if (rc != UPNP_E_SUCCESS) _complete(Job, rc, NULL);
+		else _freeJob(Job);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _connect(tSoapConn *Conn) {
+	if ((Conn->Sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) return false;
+
+	set_nonblock(Conn->Sock);
+	set_nosigpipe(Conn->Sock);
+
+	if (tcp_connect_timeout(Conn->Sock, Conn->Addr, SOAP_CONNECT)) {
+		LOG_DEBUG("[%p]: cannot connect to %s:%hu", Conn->Device, inet_ntoa(Conn->Addr.sin_addr), ntohs(Conn->Addr.sin_port));
+		_close(Conn);
+		return false;
+	}
+
+	set_block(Conn->Sock);
+	Conn->Served = 0;
+	Conn->Len = 0;
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _send(int Sock, const char *Data, int Len) {
+	while (Len > 0) {
+		int n = send(Sock, Data, Len, MSG_NOSIGNAL);
+		if (n <= 0) return false;
+		Data += n;
+		Len -= n;
+	}
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static int _fill(tSoapConn *Conn) {
+	struct timeval timeout = { SOAP_TIMEOUT / 1000, 0 };
+	fd_set rfds;
+	int n;
+
+	FD_ZERO(&rfds);
+	FD_SET(Conn->Sock, &rfds);
+	if (select(Conn->Sock + 1, &rfds, NULL, NULL, &timeout) <= 0) return -1;
+
+	// buffer is always zero-terminated
+	if (Conn->Size - Conn->Len < SOAP_CHUNK) {
+		Conn->Size = Conn->Len + 2 * SOAP_CHUNK;
+		Conn->Buf = realloc(Conn->Buf, Conn->Size + 1);
+	}
+
+	// 0 when connection is closed, -1 on timeout or error
+	n = recv(Conn->Sock, Conn->Buf + Conn->Len, Conn->Size - Conn->Len, 0);
+	if (n > 0) Conn->Len += n;
+	Conn->Buf[Conn->Len] = '\0';
+
+	return n;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _wait(tSoapConn *Conn, int Len) {
+	while (Conn->Len < Len) if (_fill(Conn) <= 0) return false;
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _hasValue(char *Line, char *Value) {
+	char *End = strstr(Line, "\r\n"), *p = strcasestr(Line, Value);
+	return p && (!End || p < End);
+}
+
+/*----------------------------------------------------------------------------*/
+static char *_readBody(tSoapConn *Conn, int Pos, bool *Close) {
+	char *Header = Conn->Buf, *Body = NULL, *p;
+	int Length = -1, Size = 0;
+	bool Chunked = false;
+
+	*Close = !strncasecmp(Header, "HTTP/1.0", 8);
+
+	for (p = strstr(Header, "\r\n"); p && p + 2 < Header + Pos; p = strstr(p, "\r\n")) {
+		p += 2;
+		if (!strncasecmp(p, "Content-Length:", 15)) Length = atoi(p + 15);
+		else if (!strncasecmp(p, "Transfer-Encoding:", 18)) Chunked = _hasValue(p, "chunked");
+		else if (!strncasecmp(p, "Connection:", 11)) *Close = _hasValue(p, "close");
+	}
+
+	if (Chunked) {
+		// chunks are appended to body as they come
+		while (1) {
+			int Chunk;
+
+			while ((p = strstr(Conn->Buf + Pos, "\r\n")) == NULL) if (_fill(Conn) <= 0) goto error;
+			Chunk = strtol(Conn->Buf + Pos, NULL, 16);
+			Pos = p + 2 - Conn->Buf;
+
+			if (!Chunk) {
+				// skip trailers up to the empty line
+				while ((p = strstr(Conn->Buf + Pos, "\r\n")) != Conn->Buf + Pos) {
+					if (p) Pos = p + 2 - Conn->Buf;
+					else if (_fill(Conn) <= 0) goto error;
+				}
+				Pos += 2;
+				break;
+			}
+
+			if (!_wait(Conn, Pos + Chunk + 2)) goto error;
+			Body = realloc(Body, Size + Chunk + 1);
+			memcpy(Body + Size, Conn->Buf + Pos, Chunk);
+			Size += Chunk;
+			Pos += Chunk + 2;
+		}
+	} else if (Length >= 0) {
+		if (!_wait(Conn, Pos + Length)) goto error;
+		Body = malloc(Length + 1);
+		memcpy(Body, Conn->Buf + Pos, Length);
+		Size = Length;
+		Pos += Length;
+	} else {
+		// no length, so body ends with connection
+		while (_fill(Conn) > 0);
+		Size = Conn->Len - Pos;
+		Body = malloc(Size + 1);
+		memcpy(Body, Conn->Buf + Pos, Size);
+		Pos = Conn->Len;
+		*Close = true;
+	}
+
+	if (!Body) Body = malloc(1);
+	Body[Size] = '\0';
+
+	// what's left belongs to next response
+	Conn->Len -= Pos;
+	memmove(Conn->Buf, Conn->Buf + Pos, Conn->Len + 1);
+
+	return Body;
+
+error:
+	free(Body);
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+static IXML_Node *_firstElement(IXML_Node *Node) {
+	for (Node = Node ? ixmlNode_getFirstChild(Node) : NULL; Node; Node = ixmlNode_getNextSibling(Node)) {
+		if (ixmlNode_getNodeType(Node) == eELEMENT_NODE) break;
+	}
+	return Node;
+}
+
+/*----------------------------------------------------------------------------*/
+static int _parseResponse(int Status, char *Body, IXML_Document **Result) {
+	IXML_Document *Doc = ixmlParseBuffer(Body);
+	IXML_Node *Node = _firstElement((IXML_Node*) Doc);
+	int ErrCode = UPNP_E_BAD_RESPONSE;
+
+	*Result = NULL;
+
+	// look for Body in Envelope, the first element in it is response or fault
+	for (Node = _firstElement(Node); Node; Node = ixmlNode_getNextSibling(Node)) {
+		const char *Name = ixmlNode_getLocalName(Node);
+		if (Name && !strcmp(Name, "Body")) break;
+	}
+
+	if ((Node = _firstElement(Node)) != NULL) {
+		const char *Name = ixmlNode_getLocalName(Node);
+
+		if (Name && !strcmp(Name, "Fault")) {
+			char *Code = XMLGetFirstDocumentItem(Doc, "errorCode", true);
+			if (Code) ErrCode = atoi(Code);
+			NFREE(Code);
+		} else if (Status == 200) {
+			IXML_Node *Response;
+			*Result = ixmlDocument_createDocument();
+			ixmlDocument_importNode(*Result, Node, true, &Response);
+			ixmlNode_appendChild((IXML_Node*) *Result, Response);
+			ErrCode = UPNP_E_SUCCESS;
+		}
+	}
+
+	if (Doc) ixmlDocument_free(Doc);
+
+	return ErrCode;
+}
+
+/*----------------------------------------------------------------------------*/
+static int _readResponse(tSoapConn *Conn, int *ErrCode, IXML_Document **Result, bool *Close) {
+	char *End, *Body;
+	int Status = 0;
+
+	*Result = NULL;
+
+	while (!Conn->Buf || (End = strstr(Conn->Buf, "\r\n\r\n")) == NULL) {
+		bool Empty = !Conn->Len;
+		int n = _fill(Conn);
+		// only a close before anything was received means request can be sent again
+		if (n == 0 && Empty) return SOAP_CLOSED;
+		if (n <= 0) return SOAP_FAILED;
+	}
+
+	sscanf(Conn->Buf, "HTTP/%*u.%*u %d", &Status);
+	if ((Body = _readBody(Conn, End + 4 - Conn->Buf, Close)) == NULL) return SOAP_FAILED;
+
+	*ErrCode = _parseResponse(Status, Body, Result);
+	free(Body);
+
+	return SOAP_OK;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _exchange(tSoapConn *Conn, tSoapJob *Jobs) {
+	int Count = 0;
+
+	for (tSoapJob *Job = Jobs; Job; Job = Job->Next) Count++;
+
+	// a reused connection might have been closed in our back, so try twice
+	for (int Try = 0; Jobs && Try < 2; Try++) {
+		bool Reused = Conn->Sock >= 0, Close = false;
+		tSoapJob *Job;
+		int rc = SOAP_OK;
+
+		if (!Reused && !_connect(Conn)) break;
+
+		// send everything, responses come back in the same order
+		for (Job = Jobs; Job && _send(Conn->Sock, Job->Request, Job->Len); Job = Job->Next);
+
+		while (!Job && Jobs && !Close) {
+			IXML_Document *Result;
+			int ErrCode = UPNP_E_SOCKET_READ;
+
+			if ((rc = _readResponse(Conn, &ErrCode, &Result, &Close)) == SOAP_CLOSED) break;
+
+			// request has been received, so never send it again
+			Job = Jobs;
+			Jobs = Jobs->Next;
+			Conn->Served++;
+			_complete(Job, ErrCode, Result);
+			Job = NULL;
+
+			if (rc == SOAP_FAILED) break;
+		}
+
+		// others have been sent as well, so their answer is lost but not the request
+		while (rc == SOAP_FAILED && Jobs) {
+			Job = Jobs;
+			Jobs = Jobs->Next;
+			_complete(Job, UPNP_E_SOCKET_READ, NULL);
+		}
+
+		// renderer has closed a connection we could not use for long
+		pthread_mutex_lock(&glSoap.Mutex);
+		if (Conn->Served > 1) Conn->Reused = true;
+		if (Reused) glSoap.Reused += Count;
+		if ((Close || rc == SOAP_CLOSED) && Conn->Served <= 1 && !Conn->Reused && ++Conn->Closes >= SOAP_CLOSES) {
+			LOG_INFO("[%p]: renderer does not keep connections alive, using libupnp", Conn->Device);
+			Conn->Fallback = true;
+		}
+		if (rc != SOAP_OK && Count > 1) {
+			LOG_INFO("[%p]: pipelining failed, sending one request at a time", Conn->Device);
+			Conn->NoPipeline = true;
+			Conn->Depth = 1;
+		} else if (!Conn->NoPipeline && Conn->Served >= SOAP_TRUST) {
+			Conn->Depth = SOAP_PIPELINE;
+		}
+		pthread_mutex_unlock(&glSoap.Mutex);
+
+		if (!Jobs && !Close && rc == SOAP_OK) return;
+		_close(Conn);
+
+		// only a reused connection deserves a second chance
+		if (!Reused || rc == SOAP_FAILED) break;
+	}
+
+	// whatever is left has not been answered, let libupnp try
+	_fallback(Jobs);
+}
+
+/*----------------------------------------------------------------------------*/
+static void *SoapWorker(void *args) {
+	uint32_t Since = gettime_ms();
+
+	pthread_mutex_lock(&glSoap.Mutex);
+
+	while (glSoap.Running) {
+		tSoapConn *Conn;
+		tSoapJob *Jobs, **p;
+		int n;
+
+		for (Conn = glSoap.List; Conn && (Conn->Busy || !Conn->Jobs); Conn = Conn->Next);
+
+		if (!Conn) {
+			// pool shrinks back once traffic is gone
+			if (glSoap.Workers > SOAP_SPARE && gettime_ms() - Since >= SOAP_LINGER) break;
+			pthread_cond_reltimedwait(&glSoap.Cond, &glSoap.Mutex, SOAP_LINGER);
+			continue;
+		}
+
+		// take as many requests as that connection can have in flight
+		Jobs = Conn->Jobs;
+		for (n = 1, p = &Jobs->Next; *p && n < Conn->Depth; n++, p = &(*p)->Next);
+		Conn->Jobs = *p;
+		*p = NULL;
+		Conn->Busy = true;
+		glSoap.Idle--;
+
+		pthread_mutex_unlock(&glSoap.Mutex);
+		_exchange(Conn, Jobs);
+		pthread_mutex_lock(&glSoap.Mutex);
+
+		Conn->Busy = false;
+		glSoap.Idle++;
+		Since = gettime_ms();
+
+		// device has been removed while we were busy
+		if (Conn->Dead) _freeConn(Conn);
+	}
+
+	glSoap.Idle--;
+	glSoap.Workers--;
+	// SoapEnd might be waiting for us
+	pthread_cond_broadcast(&glSoap.Cond);
+	pthread_mutex_unlock(&glSoap.Mutex);
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _dispatch(void) {
+	int Ready = 0;
+
+	// must be called with glSoap's mutex
+	for (tSoapConn *Conn = glSoap.List; Conn; Conn = Conn->Next) if (!Conn->Busy && Conn->Jobs) Ready++;
+
+	while (Ready > glSoap.Idle && glSoap.Workers < SOAP_WORKERS) {
+		pthread_t Thread;
+		if (pthread_create(&Thread, NULL, SoapWorker, NULL)) break;
+		pthread_detach(Thread);
+		glSoap.Workers++;
+		glSoap.Idle++;
+	}
+
+	// a single signal could land on a worker about to pick another connection
+	pthread_cond_broadcast(&glSoap.Cond);
+}
+
+/*----------------------------------------------------------------------------*/
+int SoapSendAsync(struct sMR *Device, struct sService *Service, IXML_Document *Action,
+				  Upnp_FunPtr Callback, void *Cookie) {
+	static const char *Envelope = "<?xml version=\"1.0\"?>\r\n"
+								  "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+								  "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+								  "<s:Body>%s</s:Body></s:Envelope>\r\n";
+	IXML_Node *Node = _firstElement((IXML_Node*) Action);
+	struct sockaddr_in Addr;
+	char Host[64], *Body = NULL;
+	const char *Path;
+	tSoapConn *Conn;
+	tSoapJob *Job, **p;
+
+	if (!Device->Config.KeepAlive || !Node || !_parseURL(Service->ControlURL, &Addr, Host, &Path)) goto fallback;
+
+	pthread_mutex_lock(&glSoap.Mutex);
+
+	for (Conn = glSoap.List; Conn; Conn = Conn->Next) {
+		if (Conn->Device == Device && !Conn->Dead && Conn->Addr.sin_addr.s_addr == Addr.sin_addr.s_addr &&
+			Conn->Addr.sin_port == Addr.sin_port) break;
+	}
+
+	if (!Conn) {
+		Conn = calloc(1, sizeof(tSoapConn));
+		Conn->Device = Device;
+		Conn->Addr = Addr;
+		Conn->Sock = -1;
+		Conn->Depth = 1;
+		Conn->Next = glSoap.List;
+		glSoap.List = Conn;
+	}
+
+	if (!glSoap.Running || Conn->Fallback) {
+		pthread_mutex_unlock(&glSoap.Mutex);
+		goto fallback;
+	}
+
+	// serialize now as caller re-uses action's DOM
+	Job = calloc(1, sizeof(tSoapJob));
+	Job->CtrlURL = strdup(Service->ControlURL);
+	Job->Type = strdup(Service->Type);
+	Job->Action = ixmlPrintNode(Node);
+	Job->Callback = Callback;
+	Job->Cookie = Cookie;
+
+	(void) !asprintf(&Body, Envelope, Job->Action);
+	Job->Len = asprintf(&Job->Request, "POST %s HTTP/1.1\r\nHOST: %s:%hu\r\nCONTENT-LENGTH: %zu\r\n"
+						"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\nSOAPACTION: \"%s#%s\"\r\n\r\n%s",
+						Path, Host, ntohs(Addr.sin_port), strlen(Body), Service->Type,
+						ixmlNode_getLocalName(Node), Body);
+	free(Body);
+
+	for (p = &Conn->Jobs; *p; p = &(*p)->Next);
+	*p = Job;
+
+	glSoap.Sent++;
+	_dispatch();
+	pthread_mutex_unlock(&glSoap.Mutex);
+
+	return UPNP_E_SUCCESS;
+
+fallback:
+	pthread_mutex_lock(&glSoap.Mutex);
+	glSoap.Fallback++;
+	pthread_mutex_unlock(&glSoap.Mutex);
+
+	return UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
+							   Action, Callback, Cookie);
+}
+
+/*----------------------------------------------------------------------------*/
+void SoapFlush(struct sMR *Device) {
+	pthread_mutex_lock(&glSoap.Mutex);
+
+	for (tSoapConn *Conn = glSoap.List, *Next; Conn; Conn = Next) {
+		Next = Conn->Next;
+		if (Conn->Device != Device) continue;
+
+		// worker will free it when done
+		if (Conn->Busy) {
+			Conn->Dead = true;
+			while (Conn->Jobs) {
+				tSoapJob *Job = Conn->Jobs;
+				Conn->Jobs = Job->Next;
+				_freeJob(Job);
+			}
+		} else _freeConn(Conn);
+	}
+
+	pthread_mutex_unlock(&glSoap.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void SoapStats(uint32_t *Sent, uint32_t *Reused, uint32_t *Fallback) {
+	pthread_mutex_lock(&glSoap.Mutex);
+	*Sent = glSoap.Sent;
+	*Reused = glSoap.Reused;
+	*Fallback = glSoap.Fallback;
+	pthread_mutex_unlock(&glSoap.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void SoapProbe(char *URL[], int Alive[], int Count, uint32_t Timeout) {
+	enum { PROBE_CONNECT, PROBE_READ, PROBE_DONE };
+	struct {
+		int		Sock, State;
+		char	Host[64];
+		const char *Path;
+		struct sockaddr_in Addr;
+	} *Probes = calloc(Count, sizeof(*Probes));
+	uint32_t Deadline = gettime_ms() + Timeout;
+	int Pending = 0;
+
+	/*
+	 all probes are started at once and then progress together in one select()
+	 loop, so the whole sweep lasts at most Timeout. A player is present as soon
+	 as it answers anything that looks like HTTP to a GET of its description
+	*/
+	for (int i = 0; i < Count; i++) {
+		Alive[i] = 0;
+		Probes[i].Sock = -1;
+		Probes[i].State = PROBE_DONE;
+		if (!URL[i]) continue;
+
+		// cannot tell for a URL we do not handle
+		if ((Probes[i].Sock = HttpConnect(URL[i], &Probes[i].Addr, Probes[i].Host, &Probes[i].Path)) < 0) {
+			Alive[i] = -1;
+			continue;
+		}
+
+		Probes[i].State = PROBE_CONNECT;
+		Pending++;
+	}
+
+	while (Pending) {
+		int32_t Wait = Deadline - gettime_ms();
+		struct timeval timeout;
+		fd_set rfds, wfds, efds;
+		int MaxSock = -1;
+
+		if (Wait <= 0) break;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+
+		for (int i = 0; i < Count; i++) {
+			if (Probes[i].State == PROBE_DONE) continue;
+			if (Probes[i].State == PROBE_CONNECT) FD_SET(Probes[i].Sock, &wfds);
+			else FD_SET(Probes[i].Sock, &rfds);
+			FD_SET(Probes[i].Sock, &efds);
+			MaxSock = max(MaxSock, Probes[i].Sock);
+		}
+
+		timeout.tv_sec = Wait / 1000;
+		timeout.tv_usec = (Wait % 1000) * 1000;
+		if (select(MaxSock + 1, &rfds, &wfds, &efds, &timeout) <= 0) continue;
+
+		for (int i = 0; i < Count; i++) {
+			int Sock = Probes[i].Sock;
+
+			if (Probes[i].State == PROBE_DONE) continue;
+
+			if (FD_ISSET(Sock, &efds)) {
+				Probes[i].State = PROBE_DONE;
+			} else if (Probes[i].State == PROBE_CONNECT && FD_ISSET(Sock, &wfds)) {
+				if (HttpGet(Sock, &Probes[i].Addr, Probes[i].Host, Probes[i].Path, NULL)) Probes[i].State = PROBE_READ;
+				else Probes[i].State = PROBE_DONE;
+			} else if (Probes[i].State == PROBE_READ && FD_ISSET(Sock, &rfds)) {
+				char Buf[16] = "";
+				Alive[i] = recv(Sock, Buf, sizeof(Buf) - 1, 0) > 0 && !strncasecmp(Buf, "HTTP/", 5);
+				Probes[i].State = PROBE_DONE;
+			}
+
+			if (Probes[i].State == PROBE_DONE) Pending--;
+		}
+	}
+
+	for (int i = 0; i < Count; i++) if (Probes[i].Sock >= 0) closesocket(Probes[i].Sock);
+	free(Probes);
+}
+
+/*----------------------------------------------------------------------------*/
+void SoapInit(void) {
+	glSoap.Running = true;
+	glSoap.List = NULL;
+	glSoap.Sent = glSoap.Reused = glSoap.Fallback = 0;
+	glSoap.Workers = glSoap.Idle = 0;
+	pthread_mutex_init(&glSoap.Mutex, 0);
+	pthread_cond_init(&glSoap.Cond, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _stop(void) {
+	pthread_mutex_lock(&glSoap.Mutex);
+	glSoap.Running = false;
+	pthread_cond_broadcast(&glSoap.Cond);
+
+	tSoapJob *Jobs = NULL, **p = &Jobs;
+
+	// workers are detached, wait for the last one to leave
+	while (glSoap.Workers) pthread_cond_wait(&glSoap.Cond, &glSoap.Mutex);
+
+	// queued jobs have not been sent, their owner still expects an answer
+	while (glSoap.List) {
+		*p = glSoap.List->Jobs;
+		glSoap.List->Jobs = NULL;
+		while (*p) p = &(*p)->Next;
+		_freeConn(glSoap.List);
+	}
+	pthread_mutex_unlock(&glSoap.Mutex);
+
+	// callbacks take the device's lock and might send again, so not with ours
+	while (Jobs) {
+		tSoapJob *Job = Jobs;
+		Jobs = Job->Next;
+		_complete(Job, UPNP_E_CANCELED, NULL);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+void SoapPause(bool Pause) {
+	/*
+	 once paused, exchanges in progress are over and connections are closed,
+	 so nothing uses libupnp or the old address anymore. New actions go to
+	 libupnp until we resume
+	*/
+	if (Pause) {
+		_stop();
+	} else {
+		pthread_mutex_lock(&glSoap.Mutex);
+		glSoap.Running = true;
+		pthread_mutex_unlock(&glSoap.Mutex);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+void SoapEnd(void) {
+	_stop();
+
+	pthread_mutex_destroy(&glSoap.Mutex);
+	pthread_cond_destroy(&glSoap.Cond);
+}
@@ -0,0 +1,31 @@
+/*
+ *  SOAP client with keep-alive connections
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ *  See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "upnp.h"
+#include "platform.h"
+
+struct sMR;
+struct sService;
+
+void	SoapInit(void);
+void	SoapEnd(void);
+void	SoapPause(bool Pause);
+int		SoapSendAsync(struct sMR *Device, struct sService *Service, IXML_Document *Action,
+					  Upnp_FunPtr Callback, void *Cookie);
+void	SoapFlush(struct sMR *Device);
+void	SoapStats(uint32_t *Sent, uint32_t *Reused, uint32_t *Fallback);
+void	SoapProbe(char *URL[], int Alive[], int Count, uint32_t Timeout);
+
+// non-blocking GET, HttpGet is called once HttpConnect's socket is writable
+int		HttpConnect(const char *URL, struct sockaddr_in *Addr, char *Host, const char **Path);
+bool	HttpGet(int Sock, struct sockaddr_in *Addr, const char *Host, const char *Path, const char *Headers);
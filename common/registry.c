@@ -0,0 +1,121 @@
+/*
+ *  Registry of renderers
+ *
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ *  See LICENSE
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+
+/*----------------------------------------------------------------------------*/
+void registry_init(registry_t *registry, size_t item_size, void (*create)(void*), void (*destroy)(void*)) {
+	registry->total = registry->count = registry->nfree = 0;
+	registry->size = 16;
+	registry->item_size = item_size;
+	registry->create = create;
+	registry->destroy = destroy;
+	registry->slots = malloc(registry->size * sizeof(void*));
+	registry->live = malloc(registry->size * sizeof(void*));
+	registry->free = malloc(registry->size * sizeof(void*));
+	pthread_mutex_init(&registry->mutex, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+void registry_end(registry_t *registry) {
+	// nothing can signal an item anymore
+	for (int i = 0; i < registry->total; i++) {
+		if (registry->destroy) registry->destroy(registry->slots[i]);
+		free(registry->slots[i]);
+	}
+
+	free(registry->slots);
+	free(registry->live);
+	free(registry->free);
+	registry->slots = registry->live = registry->free = NULL;
+	registry->total = registry->count = registry->nfree = 0;
+	pthread_mutex_destroy(&registry->mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void *registry_acquire(registry_t *registry, int max) {
+	void *item = NULL;
+
+	pthread_mutex_lock(&registry->mutex);
+
+	if (registry->nfree) {
+		item = registry->free[--registry->nfree];
+	} else if (registry->total < max) {
+		// all arrays share the same size as none can hold more than total
+		if (registry->total == registry->size) {
+			registry->size *= 2;
+			registry->slots = realloc(registry->slots, registry->size * sizeof(void*));
+			registry->live = realloc(registry->live, registry->size * sizeof(void*));
+			registry->free = realloc(registry->free, registry->size * sizeof(void*));
+		}
+
+		// whatever create sets up (e.g. a mutex) must *always* be valid
+		item = calloc(1, registry->item_size);
+		if (registry->create) registry->create(item);
+		registry->slots[registry->total++] = item;
+	}
+
+	pthread_mutex_unlock(&registry->mutex);
+
+	return item;
+}
+
+/*----------------------------------------------------------------------------*/
+void registry_publish(registry_t *registry, void *item) {
+	pthread_mutex_lock(&registry->mutex);
+	registry->live[registry->count++] = item;
+	pthread_mutex_unlock(&registry->mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void registry_release(registry_t *registry, void *item) {
+	pthread_mutex_lock(&registry->mutex);
+
+	// might not have been published yet
+	for (int i = 0; i < registry->count; i++) {
+		if (registry->live[i] != item) continue;
+		registry->live[i] = registry->live[--registry->count];
+		break;
+	}
+
+	registry->free[registry->nfree++] = item;
+	pthread_mutex_unlock(&registry->mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+int registry_list(registry_t *registry, void ***list, bool all) {
+	int count;
+
+	pthread_mutex_lock(&registry->mutex);
+
+	count = all ? registry->total : registry->count;
+	*list = malloc((count ? count : 1) * sizeof(void*));
+	memcpy(*list, all ? registry->slots : registry->live, count * sizeof(void*));
+
+	pthread_mutex_unlock(&registry->mutex);
+
+	return count;
+}
+
+/*----------------------------------------------------------------------------*/
+int registry_lock(registry_t *registry, void ***live) {
+	// no item's lock can be taken until registry_unlock
+	pthread_mutex_lock(&registry->mutex);
+	*live = registry->live;
+	return registry->count;
+}
+
+/*----------------------------------------------------------------------------*/
+void registry_unlock(registry_t *registry) {
+	pthread_mutex_unlock(&registry->mutex);
+}
@@ -0,0 +1,39 @@
+/*
+ *  Registry of renderers
+ *
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ *  See LICENSE
+ *
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ items are allocated one at a time and only freed by registry_end, so whatever
+ pointer a callback holds is still a valid item that can be checked under its
+ own lock. Items in use are also listed in a compact array so that loops only
+ visit live ones. Registry's mutex is never held while taking an item's lock
+*/
+typedef struct registry_s {
+	pthread_mutex_t	mutex;
+	void			**slots, **live, **free;
+	int				total, count, nfree, size;
+	size_t			item_size;
+	void			(*create)(void *item);
+	void			(*destroy)(void *item);
+} registry_t;
+
+void	registry_init(registry_t *registry, size_t item_size, void (*create)(void*), void (*destroy)(void*));
+void	registry_end(registry_t *registry);
+void*	registry_acquire(registry_t *registry, int max);
+void	registry_publish(registry_t *registry, void *item);
+void	registry_release(registry_t *registry, void *item);
+int		registry_list(registry_t *registry, void ***list, bool all);
+int		registry_lock(registry_t *registry, void ***live);
+void	registry_unlock(registry_t *registry);